@@ -0,0 +1,497 @@
+/**
+ * @file benchmark.cc
+ * @brief Times every kernel of tensorcpufunctions.h over a sweep of sizes and thread counts.
+ *
+ * Each kernel is reported in GFLOP/s and GB/s next to a roofline measured on the machine, the
+ * peak rate of fused multiply-adds in the instruction set the kernels use and the bandwidth of a
+ * triad over arrays larger than the caches. The roofline fraction is the time the roofline allows
+ * for the kernel's flops and bytes over the time measured. Sizes that fit in cache can exceed one,
+ * since cache bandwidth is above the measured memory bandwidth.
+ *
+ * cpuMatmulInt8 is also compared with cpuGemm on the same square shapes.
+ *
+ * Usage: benchmark [--quick] [--threads 1,2,4] [--filter name] [--json path]
+ * Results are also written as JSON (default: benchmark.json) to compare between commits.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "src/tensorcpufunctions.h"
+
+#ifdef OMP
+    #include <omp.h>
+#endif
+
+#if defined(__x86_64__)
+    #include <immintrin.h>
+#endif
+
+// A kernel is run until both are reached, and its fastest run is reported
+#define BENCHMINREPS 3
+#define BENCHMINSECONDS 0.05
+
+// Independent multiply-add chains per thread when measuring the peak, enough to hide the latency
+#define PEAKCHAINS 12
+#define PEAKREPS 2000000
+
+// Elements of each triad array when measuring bandwidth, far larger than the caches
+#define TRIADLEN (1 << 23)
+
+struct Measurement{
+    std::string kernel, dtype, shape;
+    size_t threads;
+    double seconds, flops, bytes, roofSeconds;
+};
+
+// Time of cpuGemm over the time of cpuMatmulInt8 on the same shape, dtype and threads
+struct Int8Speedup{
+    std::string dtype, shape;
+    size_t threads;
+    double speedup;
+};
+
+struct Roofline{
+    size_t threads;
+    double gflops32, gflops64, gbps;
+};
+
+struct Benchmark{
+    std::string kernel, shape;
+    double flops, bytes;
+    std::function<void()> run;
+};
+
+static volatile unsigned char sink;
+
+static size_t maxThreads(){
+    #ifdef OMP
+        return omp_get_max_threads();
+    #else
+        return 1;
+    #endif
+}
+
+static void setThreads(size_t threads){
+    #ifdef OMP
+        omp_set_num_threads(threads);
+    #else
+        (void) threads;
+    #endif
+}
+
+static double now(){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double timeRun(const std::function<void()>& run, double minSeconds){
+    run();
+    double best = 1e300, start = now();
+    for(size_t reps = 0; reps < BENCHMINREPS || now() - start < minSeconds; ++reps){
+        double t = now();
+        run();
+        best = std::min(best, now() - t);
+    }
+    return best;
+}
+
+/*
+ * Peak multiply-add loops, one per instruction set of simdLevel. Each returns the flops it did.
+ * The chains are independent, so the loop is bound by the throughput of the multiply-add units.
+ */
+#define PEAKLOOP(V, SET1, FMA, LANES) \
+    V a = SET1(0.999999), b = SET1(1e-7); \
+    V acc[PEAKCHAINS]; \
+    for(size_t j = 0; j < PEAKCHAINS; ++j) acc[j] = SET1((double) j); \
+    for(size_t r = 0; r < reps; ++r) \
+        for(size_t j = 0; j < PEAKCHAINS; ++j) acc[j] = FMA(acc[j], a, b); \
+    for(size_t j = 0; j < PEAKCHAINS; ++j) sink = sink ^ reinterpret_cast<unsigned char *>(&acc[j])[0]; \
+    return 2.0 * reps * PEAKCHAINS * (LANES);
+
+template<typename T>
+static double peakScalar(size_t reps){
+    #define SCALARSET1(X) ((T) (X))
+    #define SCALARFMA(X, Y, Z) ((X) * (Y) + (Z))
+    PEAKLOOP(T, SCALARSET1, SCALARFMA, 1)
+    #undef SCALARSET1
+    #undef SCALARFMA
+}
+
+#if defined(__x86_64__)
+
+#define SSEFMAPS(X, Y, Z) _mm_add_ps(_mm_mul_ps(X, Y), Z)
+#define SSEFMAPD(X, Y, Z) _mm_add_pd(_mm_mul_pd(X, Y), Z)
+#define SSESET1PS(X) _mm_set1_ps((float) (X))
+
+__attribute__((target("sse2"))) static double peakSse32(size_t reps){PEAKLOOP(__m128, SSESET1PS, SSEFMAPS, 4)}
+__attribute__((target("sse2"))) static double peakSse64(size_t reps){PEAKLOOP(__m128d, _mm_set1_pd, SSEFMAPD, 2)}
+
+#define AVX2SET1PS(X) _mm256_set1_ps((float) (X))
+__attribute__((target("avx2,fma"))) static double peakAvx232(size_t reps){PEAKLOOP(__m256, AVX2SET1PS, _mm256_fmadd_ps, 8)}
+__attribute__((target("avx2,fma"))) static double peakAvx264(size_t reps){PEAKLOOP(__m256d, _mm256_set1_pd, _mm256_fmadd_pd, 4)}
+
+#define AVX512SET1PS(X) _mm512_set1_ps((float) (X))
+__attribute__((target("avx512f"))) static double peakAvx51232(size_t reps){PEAKLOOP(__m512, AVX512SET1PS, _mm512_fmadd_ps, 16)}
+__attribute__((target("avx512f"))) static double peakAvx51264(size_t reps){PEAKLOOP(__m512d, _mm512_set1_pd, _mm512_fmadd_pd, 8)}
+
+#endif
+
+static double peakFlops(bool isFloat, size_t reps){
+    #if defined(__x86_64__)
+        switch(cpuGetSimdLevel()){
+            case SIMDAVX512: return isFloat ? peakAvx51232(reps) : peakAvx51264(reps);
+            case SIMDAVX2: return isFloat ? peakAvx232(reps) : peakAvx264(reps);
+            case SIMDSSE: return isFloat ? peakSse32(reps) : peakSse64(reps);
+            case SIMDNONE: break;
+        }
+    #endif
+    return isFloat ? peakScalar<float>(reps) : peakScalar<double>(reps);
+}
+
+static double measurePeak(bool isFloat, size_t threads, size_t reps){
+    double best = 0;
+    for(int trial = 0; trial < 3; ++trial){
+        double t = now(), flops = 0;
+        #pragma omp parallel num_threads(threads) reduction(+:flops)
+        flops += peakFlops(isFloat, reps);
+        best = std::max(best, flops / (now() - t) / 1e9);
+    }
+    return best;
+}
+
+// Bandwidth of a[i] = b[i] + s * c[i], counting the bytes read and written
+static double measureBandwidth(size_t threads, size_t len){
+    std::vector<double> a(len), b(len, 1), c(len, 2);
+    double best = 0;
+    for(int trial = 0; trial < 5; ++trial){
+        double t = now();
+        #pragma omp parallel for num_threads(threads)
+        for(size_t i = 0; i < len; ++i) a[i] = b[i] + 3 * c[i];
+        best = std::max(best, 3.0 * len * sizeof(double) / (now() - t) / 1e9);
+    }
+    sink = sink ^ (unsigned char) a[len / 2];
+    return best;
+}
+
+static BroadcastShape makeShape(std::vector<size_t> dims, std::vector<size_t> strides1, std::vector<size_t> strides2){
+    BroadcastShape shape = {};
+    shape.numDims = dims.size();
+    for(size_t d = 0; d < dims.size(); ++d){
+        shape.dims[d] = dims[d];
+        shape.strides1[d] = strides1[d];
+        shape.strides2[d] = strides2[d];
+    }
+    return shape;
+}
+
+template<typename T>
+static std::vector<T> randomData(size_t len, std::mt19937& gen){
+    std::uniform_real_distribution<double> dist(0.5, 1.5);
+    std::vector<T> ret(len);
+    for(auto& x : ret) x = (T) dist(gen);
+    return ret;
+}
+
+static std::string dimString(std::vector<size_t> dims){
+    std::string ret;
+    for(size_t d = 0; d < dims.size(); ++d) ret += (d ? "x" : "") + std::to_string(dims[d]);
+    return ret;
+}
+
+// Kernels over n elements, with n a power of four so square and cube shaped views are exact
+template<typename T, typename U>
+static void elementwiseBenchmarks(std::vector<Benchmark>& out, size_t n, std::mt19937& gen){
+    double s = sizeof(T);
+    auto a = std::make_shared<std::vector<T>>(randomData<T>(n, gen));
+    auto b = std::make_shared<std::vector<T>>(randomData<T>(n, gen));
+    auto c = std::make_shared<std::vector<T>>(randomData<T>(n, gen));
+    auto d = std::make_shared<std::vector<T>>(randomData<T>(n, gen));
+    auto ret = std::make_shared<std::vector<T>>(n);
+    auto other = std::make_shared<std::vector<U>>(randomData<U>(n, gen));
+    size_t side = (size_t) std::lround(std::sqrt((double) n));
+    auto quantized = std::make_shared<std::vector<int8_t>>(n, 3);
+    auto scales = std::make_shared<std::vector<float>>(side, 0.01f);
+    T * pa = a->data(), * pb = b->data(), * pc = c->data(), * pd = d->data(), * pr = ret->data();
+
+    size_t cols = std::min(n, (size_t) 256);
+    size_t rows = n / cols;
+    std::string flat = dimString({n}), square = dimString({side, side}), matrix = dimString({rows, cols});
+    auto add = [&](std::string kernel, std::string shape, double flops, double bytes, std::function<void()> run){
+        out.push_back({kernel, shape, flops, bytes, [run, a, b, c, d, ret, other, quantized, scales](){run();}});
+    };
+
+    add("cpuCopy", flat, 0, 2 * n * s, [=](){cpuCopy(pr, pa, n);});
+    add("cpuNeg", flat, n, 2 * n * s, [=](){cpuNeg(pr, pa, n);});
+    add("cpuAdd", flat, n, 3 * n * s, [=](){cpuAdd(pr, pa, pb, n);});
+    add("cpuAddScalar", flat, n, 2 * n * s, [=](){cpuAddScalar(pr, pa, (T) 2, n);});
+    add("cpuSubtract", flat, n, 3 * n * s, [=](){cpuSubtract(pr, pa, pb, n);});
+    add("cpuSubtractScalar", flat, n, 2 * n * s, [=](){cpuSubtractScalar(pr, pa, (T) 2, n);});
+    add("cpuScalarSubtract", flat, n, 2 * n * s, [=](){cpuScalarSubtract(pr, pa, (T) 2, n);});
+    add("cpuPow", flat, n, 2 * n * s, [=](){cpuPow(pr, pa, (T) 3, n);});
+    add("cpuZeroes", flat, 0, n * s, [=](){cpuZeroes(pr, n);});
+    add("cpuOnes", flat, 0, n * s, [=](){cpuOnes(pr, n);});
+    add("cpuFill", flat, 0, n * s, [=](){cpuFill(pr, (T) 2, n);});
+    add("cpuElementwiseMult", flat, n, 3 * n * s, [=](){cpuElementwiseMult(pr, pa, pb, n);});
+    add("cpuElementwiseMultScalar", flat, n, 2 * n * s, [=](){cpuElementwiseMultScalar(pr, pa, (T) 2, n);});
+    add("cpuElementwiseDivision", flat, n, 3 * n * s, [=](){cpuElementwiseDivision(pr, pa, pb, n);});
+    add("cpuElementwiseDivisionScalar", flat, n, 2 * n * s, [=](){cpuElementwiseDivisionScalar(pr, pa, (T) 2, n);});
+    add("cpuElementwiseDivisionScalar2", flat, n, 2 * n * s, [=](){cpuElementwiseDivisionScalar2(pr, pa, (T) 2, n);});
+
+    // A row vector broadcast over every row of a matrix, like adding a bias
+    BroadcastShape rowBroadcast = makeShape({rows, cols}, {cols, 1}, {0, 1});
+    std::string broadcast = matrix + "+" + dimString({cols});
+    add("cpuAddBroadcast", broadcast, n, (2 * n + cols) * s, [=](){cpuAddBroadcast(pr, pa, pb, rowBroadcast);});
+    add("cpuSubtractBroadcast", broadcast, n, (2 * n + cols) * s, [=](){cpuSubtractBroadcast(pr, pa, pb, rowBroadcast);});
+    add("cpuElementwiseMultBroadcast", broadcast, n, (2 * n + cols) * s, [=](){cpuElementwiseMultBroadcast(pr, pa, pb, rowBroadcast);});
+    add("cpuElementwiseDivisionBroadcast", broadcast, n, (2 * n + cols) * s, [=](){cpuElementwiseDivisionBroadcast(pr, pa, pb, rowBroadcast);});
+    add("cpuEqualBroadcast", flat, n, 3 * n * s, [=](){cpuEqualBroadcast(pr, pa, pb, makeShape({n}, {1}, {1}));});
+    add("cpuSumToShape", matrix + "->" + dimString({cols}), n, (n + cols) * s,
+        [=](){cpuSumToShape(pr, pa, makeShape({rows, cols}, {0, 1}, {cols, 1}), cols);});
+    add("cpuStridedCopy", square + " transposed", 0, 2 * n * s,
+        [=](){cpuStridedCopy(pr, pa, makeShape({side, side}, {side, 1}, {1, side}));});
+
+    add("cpuRelu", flat, n, 2 * n * s, [=](){cpuRelu(pr, pa, n);});
+    add("cpuBinarize", flat, n, 2 * n * s, [=](){cpuBinarize(pr, pa, n);});
+    add("cpuTranspose2d", square, 0, 2 * n * s, [=](){cpuTranspose2d(pr, pa, side, side);});
+    size_t side3 = (size_t) std::lround(std::sqrt((double) (n / 4)));
+    add("cpuTranspose3d", dimString({4, side3, side3}), 0, 2 * n * s, [=](){cpuTranspose3d(pr, pa, 4, side3, side3);});
+
+    add("cpuReduceSum", flat, n, n * s, [=](){cpuReduceSum(pr, pa, n);});
+    size_t reduceLen = std::min(n, (size_t) 1024);
+    add("cpuReduce sum", dimString({n / reduceLen, reduceLen}) + " last axis", n, n * s,
+        [=](){cpuReduce(pr, pa, n / reduceLen, reduceLen, 1, REDUCTIONSUM, (T) 1);});
+    add("cpuReduce max", dimString({n / reduceLen, reduceLen}) + " last axis", n, n * s,
+        [=](){cpuReduce(pr, pa, n / reduceLen, reduceLen, 1, REDUCTIONMAX, (T) 1);});
+    add("cpuReduce sum", dimString({n / reduceLen, reduceLen}) + " first axis", n, n * s,
+        [=](){cpuReduce(pr, pa, 1, n / reduceLen, reduceLen, REDUCTIONSUM, (T) 1);});
+
+    // Row kernels count an exponential as one flop
+    add("cpuSoftmax", matrix, 4 * n, 2 * n * s, [=](){cpuSoftmax(pr, pa, rows, cols);});
+    add("cpuSoftmaxBackward", matrix, 4 * n, 3 * n * s, [=](){cpuSoftmaxBackward(pr, pa, pb, rows, cols);});
+    add("cpuArgmax", matrix, n, (n + rows) * s, [=](){cpuArgmax(pr, pa, rows, cols);});
+    for(size_t i = 0; i < rows; ++i) (*c)[i] = (T) (i % cols);
+    add("cpuCrossEntropy", matrix, 3 * n, (n + rows) * s, [=](){cpuCrossEntropy(pr, pa, pc, rows, cols, true);});
+    add("cpuCrossEntropyBackward", matrix, 4 * n, (2 * n + rows) * s, [=](){cpuCrossEntropyBackward(pr, pa, pa, pc, rows, cols, true);});
+
+    // Optimizer steps update their state in place, so the bytes count each state array twice
+    add("cpuSgdStep", flat, 2 * n, 3 * n * s, [=](){cpuSgdStep(pr, pa, (T) 1e-6, n);});
+    add("cpuMomentumStep", flat, 4 * n, 5 * n * s, [=](){cpuMomentumStep(pr, pa, pb, (T) 1e-6, (T) 0.9, n);});
+    add("cpuAdamStep", flat, 12 * n, 7 * n * s, [=](){cpuAdamStep(pr, pa, pb, pd, (T) 1e-6, (T) 0.9, (T) 0.999, (T) 1e-8, 10, n);});
+
+    add("cpuFillRandom", flat, 0, n * s, [=](){cpuFillRandom(pr, (T) 0, (T) 1, 7, n);});
+    add("cpuDropout", flat, n, 2 * n * s, [=](){cpuDropout(pr, pa, 0.5, 7, n);});
+    U * po = other->data();
+    add(std::string("cpuConvert from ") + (sizeof(U) == 4 ? "float32" : "float64"), flat, 0, n * (s + sizeof(U)), [=](){cpuConvert(pr, po, n);});
+
+    // relu(a * b + c), the shape of a fused bias and activation
+    auto program = std::make_shared<std::vector<FusedInstruction>>(std::vector<FusedInstruction>{
+        {FUSEDMULT, 0, 1, 0, 0}, {FUSEDADD, 3, 2, 0, 0}, {FUSEDRELU, 4, 0, 0, 0}});
+    auto inputs = std::make_shared<std::vector<T *>>(std::vector<T *>{pa, pb, pc});
+    auto inputStrides = std::make_shared<std::vector<size_t>>(std::vector<size_t>{1, 1, 1});
+    add("cpuFusedElementwise relu(a*b+c)", flat, 3 * n, 4 * n * s,
+        [=](){cpuFusedElementwise(pr, inputs->data(), inputStrides->data(), 3, program->data(), program->size(), n);});
+
+    // Per-channel quantization of a square matrix, and back
+    int8_t * pq = quantized->data();
+    float * ps = scales->data();
+    add("cpuQuantize", square, 3 * n, n * (s + 1) + side * 4, [=](){cpuQuantize(pq, ps, pa, side, side);});
+    add("cpuDequantize", square, n, n * (s + 1) + side * 4, [=](){cpuDequantize(pr, pq, ps, side, side);});
+}
+
+// Matrix products of size m = n = k
+template<typename T>
+static void matmulBenchmarks(std::vector<Benchmark>& out, size_t m, std::mt19937& gen){
+    double s = sizeof(T);
+    size_t batch = 4, half = m / 2;
+    auto a = std::make_shared<std::vector<T>>(randomData<T>(m * m, gen));
+    auto b = std::make_shared<std::vector<T>>(randomData<T>(m * m, gen));
+    auto ret = std::make_shared<std::vector<T>>(m * m);
+    auto quantized = std::make_shared<std::vector<int8_t>>(m * m, 3);
+    auto scales = std::make_shared<std::vector<float>>(m, 0.01f);
+    T * pa = a->data(), * pb = b->data(), * pr = ret->data();
+    int8_t * pq = quantized->data();
+    float * ps = scales->data();
+
+    double flops = 2.0 * m * m * m, bytes = 3.0 * m * m * s;
+    std::string square = dimString({m, m, m});
+    auto add = [&](std::string kernel, std::string shape, double flops, double bytes, std::function<void()> run){
+        out.push_back({kernel, shape, flops, bytes, [run, a, b, ret, quantized, scales](){run();}});
+    };
+
+    add("cpuGemm", square, flops, bytes, [=](){cpuGemm(pr, pa, pb, m, m, m, m, 1, m, 1, false);});
+    add("cpuGemm transposed b", square, flops, bytes, [=](){cpuGemm(pr, pa, pb, m, m, m, m, 1, 1, m, false);});
+    add("cpuMatmul2d", square, flops, bytes, [=](){cpuMatmul2d(pr, pa, pb, m, m, m, m);});
+
+    // Batched products use batch of four half sized products, which fit in the same buffers
+    double batchFlops = 2.0 * batch * half * half * half, batchBytes = 3.0 * batch * half * half * s;
+    std::string batched = dimString({batch, half, half, half});
+    add("cpuMatmul3d", batched, batchFlops, (2.0 * batch + 1) * half * half * s,
+        [=](){cpuMatmul3d(pr, pa, pb, batch, half, half, half, half, half);});
+    MatmulStrides strides = {half * half, half, 1, half * half, half, 1};
+    add("cpuMatmulBatched", batched, batchFlops, batchBytes, [=](){cpuMatmulBatched(pr, pa, pb, batch, half, half, half, strides);});
+    add("cpuMatmulGradLeft", batched, batchFlops, batchBytes, [=](){cpuMatmulGradLeft(pr, pa, pb, batch, half, half, half, strides, false);});
+    add("cpuMatmulGradRight", batched, batchFlops, batchBytes, [=](){cpuMatmulGradRight(pr, pa, pb, batch, half, half, half, strides, false);});
+
+    add("cpuMatmulInt8", square, flops, m * m * (2 * s + 1) + m * 4, [=](){cpuMatmulInt8(pr, pa, pq, ps, 1, m, m, m, 0, 0);});
+}
+
+template<typename T>
+static std::vector<Benchmark> benchmarks(std::vector<size_t> elementSizes, std::vector<size_t> matmulSizes){
+    std::mt19937 gen(7);
+    std::vector<Benchmark> ret;
+    for(size_t n : elementSizes){
+        if(sizeof(T) == 4) elementwiseBenchmarks<float, double>(ret, n, gen);
+        else elementwiseBenchmarks<double, float>(ret, n, gen);
+    }
+    for(size_t m : matmulSizes) matmulBenchmarks<T>(ret, m, gen);
+    return ret;
+}
+
+static std::string jsonString(const std::string& s){
+    std::string ret = "\"";
+    for(char c : s){
+        if(c == '"' || c == '\\') ret += '\\';
+        ret += c;
+    }
+    return ret + "\"";
+}
+
+static const char * simdName(simdLevel level){
+    switch(level){
+        case SIMDNONE: return "none";
+        case SIMDSSE: return "sse2";
+        case SIMDAVX2: return "avx2";
+        case SIMDAVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+static std::vector<Int8Speedup> int8Speedups(std::vector<Measurement>& results){
+    std::vector<Int8Speedup> ret;
+    for(auto& q : results){
+        if(q.kernel != "cpuMatmulInt8") continue;
+        for(auto& f : results)
+            if(f.kernel == "cpuGemm" && f.dtype == q.dtype && f.shape == q.shape && f.threads == q.threads)
+                ret.push_back({q.dtype, q.shape, q.threads, f.seconds / q.seconds});
+    }
+    return ret;
+}
+
+static void writeJson(std::string path, std::vector<Roofline>& roofs, std::vector<Measurement>& results, std::vector<Int8Speedup>& speedups){
+    FILE * file = fopen(path.c_str(), "w");
+    if(!file){
+        std::cerr << "Could not write " << path << "\n";
+        return;
+    }
+    fprintf(file, "{\n  \"simd\": \"%s\",\n  \"roofline\": [\n", simdName(cpuGetSimdLevel()));
+    for(size_t i = 0; i < roofs.size(); ++i){
+        Roofline& r = roofs[i];
+        fprintf(file, "    {\"threads\": %zu, \"gflops_float32\": %.3f, \"gflops_float64\": %.3f, \"gbps\": %.3f}%s\n",
+                r.threads, r.gflops32, r.gflops64, r.gbps, i + 1 < roofs.size() ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"results\": [\n");
+    for(size_t i = 0; i < results.size(); ++i){
+        Measurement& m = results[i];
+        fprintf(file, "    {\"kernel\": %s, \"dtype\": \"%s\", \"shape\": %s, \"threads\": %zu, \"seconds\": %.9g, "
+                "\"gflops\": %.4f, \"gbps\": %.4f, \"roofline_fraction\": %.4f}%s\n",
+                jsonString(m.kernel).c_str(), m.dtype.c_str(), jsonString(m.shape).c_str(), m.threads, m.seconds,
+                m.flops / m.seconds / 1e9, m.bytes / m.seconds / 1e9, m.roofSeconds / m.seconds, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"int8_vs_float\": [\n");
+    for(size_t i = 0; i < speedups.size(); ++i){
+        Int8Speedup& s = speedups[i];
+        fprintf(file, "    {\"dtype\": \"%s\", \"shape\": %s, \"threads\": %zu, \"speedup\": %.4f}%s\n",
+                s.dtype.c_str(), jsonString(s.shape).c_str(), s.threads, s.speedup, i + 1 < speedups.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+int main(int argc, char ** argv){
+    bool quick = false;
+    std::string jsonPath = "benchmark.json", filter;
+    std::vector<size_t> threadCounts;
+    for(int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if(arg == "--quick") quick = true;
+        else if(arg == "--json" && i + 1 < argc) jsonPath = argv[++i];
+        else if(arg == "--filter" && i + 1 < argc) filter = argv[++i];
+        else if(arg == "--threads" && i + 1 < argc){
+            std::string list = argv[++i];
+            for(size_t start = 0; start < list.size();){
+                size_t comma = list.find(',', start);
+                if(comma == std::string::npos) comma = list.size();
+                threadCounts.push_back(std::max(1, atoi(list.substr(start, comma - start).c_str())));
+                start = comma + 1;
+            }
+        }
+        else{
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--threads 1,2,4] [--filter name] [--json path]\n";
+            return 1;
+        }
+    }
+
+    // Powers of two up to every thread, and every thread
+    if(threadCounts.empty()){
+        size_t most = maxThreads();
+        for(size_t t = 1; t < most; t *= 2) threadCounts.push_back(t);
+        threadCounts.push_back(most);
+    }
+
+    std::vector<size_t> elementSizes = quick ? std::vector<size_t>{1 << 12, 1 << 18} : std::vector<size_t>{1 << 12, 1 << 18, 1 << 22};
+    std::vector<size_t> matmulSizes = quick ? std::vector<size_t>{64, 128} : std::vector<size_t>{64, 256, 512};
+    double minSeconds = quick ? BENCHMINSECONDS / 5 : BENCHMINSECONDS;
+
+    std::vector<Roofline> roofs;
+    std::cout << "Roofline (" << simdName(cpuGetSimdLevel()) << ")\n";
+    for(size_t t : threadCounts){
+        Roofline r = {t, measurePeak(true, t, quick ? PEAKREPS / 10 : PEAKREPS), measurePeak(false, t, quick ? PEAKREPS / 10 : PEAKREPS),
+            measureBandwidth(t, quick ? TRIADLEN / 4 : TRIADLEN)};
+        roofs.push_back(r);
+        printf("  %3zu threads: %9.2f GFLOP/s float32 %9.2f GFLOP/s float64 %8.2f GB/s\n", t, r.gflops32, r.gflops64, r.gbps);
+    }
+
+    std::vector<Measurement> results;
+    printf("\n%-34s %-8s %-22s %7s %12s %10s %10s %7s\n", "kernel", "dtype", "shape", "threads", "time (us)", "GFLOP/s", "GB/s", "roof");
+    for(int isFloat = 1; isFloat >= 0; --isFloat){
+        std::vector<Benchmark> list = isFloat ? benchmarks<float>(elementSizes, matmulSizes) : benchmarks<double>(elementSizes, matmulSizes);
+        for(auto& bench : list){
+            if(!filter.empty() && bench.kernel.find(filter) == std::string::npos) continue;
+            for(size_t i = 0; i < threadCounts.size(); ++i){
+                setThreads(threadCounts[i]);
+                Roofline& roof = roofs[i];
+                double seconds = timeRun(bench.run, minSeconds);
+                double peak = isFloat ? roof.gflops32 : roof.gflops64;
+                double roofSeconds = std::max(bench.flops / peak, bench.bytes / roof.gbps) / 1e9;
+                Measurement m = {bench.kernel, isFloat ? "float32" : "float64", bench.shape, threadCounts[i], seconds, bench.flops, bench.bytes, roofSeconds};
+                results.push_back(m);
+                printf("%-34s %-8s %-22s %7zu %12.2f %10.3f %10.3f %6.1f%%\n", m.kernel.c_str(), m.dtype.c_str(), m.shape.c_str(),
+                        m.threads, seconds * 1e6, m.flops / seconds / 1e9, m.bytes / seconds / 1e9, 100 * roofSeconds / seconds);
+                fflush(stdout);
+            }
+        }
+    }
+
+    std::vector<Int8Speedup> speedups = int8Speedups(results);
+    if(!speedups.empty()){
+        printf("\nInt8 vs float GEMM (cpuGemm time / cpuMatmulInt8 time)\n");
+        for(auto& s : speedups) printf("  %-8s %-22s %7zu threads: %6.2fx\n", s.dtype.c_str(), s.shape.c_str(), s.threads, s.speedup);
+    }
+    writeJson(jsonPath, roofs, results, speedups);
+    std::cout << "\nWrote " << jsonPath << "\n";
+    return 0;
+}
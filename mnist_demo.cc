@@ -1,90 +1,53 @@
-#include <fstream>
-#include <sstream>
 #include <string>
-#include <utility>
 #include <vector>
 #include <iostream>
 
+#include "src/dataloader.h"
+#include "src/dataset.h"
+#include "src/optimizer.h"
 #include "src/tensor.h"
 
-std::vector<std::pair<int, Tensor>> readInput(std::string filename, size_t size){
-    std::ifstream file(filename);
-
-    std::vector<std::pair<int, Tensor>> data;
-
-    std::string line;
-    while(getline(file, line)){
-        std::stringstream ls(line);
-
-        std::string slabel;
-        ls >> slabel;
-        int label = std::stoi(slabel);
-
-        std::vector<double> d(size, 0);
-        std::string tmp;
-        while(ls >> tmp){
-            size_t index = std::stoi(tmp.substr(0, tmp.find(":")));
-            int num = std::stoi(tmp.substr(tmp.find(":") + 1));
-            d[index] = num;
-        }
-
-        data.push_back(std::make_pair(label ,Tensor({size}, d, false)));
-    }
-
-    return data;
+// Scores every sample of the batch against every class with one matmul, then takes the best class of each row
+Tensor predict(Tensor weights, Tensor features){
+    return features.matmul(weights).argmax();
 }
 
-std::pair<int, std::vector<Tensor>> predict(std::vector<Tensor> weights, Tensor t, int num_classes, int label){
-    std::vector<Tensor> class_outputs;
-    for(Tensor& w : weights){
-        class_outputs.push_back(t.elementwiseMult(w).reduceSum());
-    }
-
-    int index = 0;
-    double max = class_outputs[0].getData()[0];
-
-    for(int i = 1; i < num_classes; ++i){
-        double output = class_outputs[i].getData()[0];
-        if(output > max){
-            index = i;
-            max = output;
-        }
-    }
-
-    return std::make_pair(index, class_outputs);
+size_t countCorrect(Tensor predictions, Tensor labels){
+    std::vector<double> p = predictions.getData();
+    std::vector<double> l = labels.getData();
+    size_t num_correct = 0;
+    for(size_t i = 0; i < p.size(); ++i)
+        if(p[i] == l[i])
+            num_correct ++;
+    return num_correct;
 }
 
-std::vector<Tensor> train(std::vector<Tensor> weights, std::vector<std::pair<int, Tensor>> data, std::vector<std::pair<int, Tensor>> test_data, double req_acc, int num_classes, double learning_rate, int max_epochs, size_t num_features){
+Tensor train(Tensor weights, Dataset data, Dataset test_data, double req_acc, double learning_rate, int max_epochs, size_t batch_size){
+    DataLoader loader = DataLoader::fromDataset(data, batch_size, data.size());
+    DataLoader test_loader = DataLoader::fromDataset(test_data, batch_size);
+    Optimizer optimizer = Optimizer::sgd({weights}, learning_rate);
+
     double acc = 0;
     int epoch = 0;
 
     while(acc < req_acc && epoch < max_epochs){
         size_t m = 0;
-        for(auto& d : data){
-            auto p = predict(weights, d.second, num_classes, d.first);
-            int index = p.first;
-            std::vector<Tensor> outputs = p.second;
-            
-            if(index != d.first){
-                for(int i = 0; i < num_classes; ++i){
-                    outputs[i].backward();
-                    weights[i] = Tensor({num_features}, weights[i].getData(), true) -
-                        weights[i].getGradient() * learning_rate * Tensor({1}, outputs[i].getData()) / data.size();
-                }
-            }
-
-            if(m % 1000 == 0)
-                std::cout << "Training sample " << m << " processed\n";
-            m ++;
+        for(auto batch = loader.next(); !batch.empty(); batch = loader.next()){
+            size_t n = batch[0].getDims()[0];
+
+            Tensor loss = batch[0].matmul(weights).crossEntropy(batch[1]);
+            loss.backward();
+            optimizer.step();
+            optimizer.zeroGrad();
+
+            if(m / 1000 != (m + n) / 1000)
+                std::cout << "Training sample " << (m + n) / 1000 * 1000 << " processed\n";
+            m += n;
         }
-        
+
         size_t num_correct = 0;
-        for(auto& t : test_data){
-            auto p = predict(weights, t.second, num_classes, num_features);
-            int index = p.first;
-            if(index == t.first)
-                num_correct ++;
-        }
+        for(auto batch = test_loader.next(); !batch.empty(); batch = test_loader.next())
+            num_correct += countCorrect(predict(weights, batch[0]), batch[1]);
         acc = (double) num_correct / test_data.size();
 
         std::cout << "Epoch " << epoch << " complete with accuracy " << acc * 100 << "%\n";
@@ -98,20 +61,21 @@ int main(){
     Tensor::setOmpNumThreads(8);
 
     size_t num_features = 784;
-    int num_classes = 10;
+    size_t num_classes = 10;
+    size_t batch_size = 64;
 
     std::string data_file = "data/mnist";
     std::string test_data_file = "data/mnist.t";
 
-    auto data = readInput(data_file, num_features);
-    auto test_data = readInput(test_data_file, num_features);
+    // Pixels are stored as 0 to 255
+    Dataset raw_data = Dataset::readLibsvm(data_file, num_features);
+    Dataset raw_test_data = Dataset::readLibsvm(test_data_file, num_features);
+    Dataset data(raw_data.getFeatures() / 255, raw_data.getLabels());
+    Dataset test_data(raw_test_data.getFeatures() / 255, raw_test_data.getLabels());
 
-    std::vector<Tensor> weights;
-    for(int i = 0; i < num_classes; ++i)
-        weights.push_back(Tensor::fillRandom({num_features}, 0, 0.1, true));
+    Tensor weights = Tensor::fillRandom({num_features, num_classes}, 0, 0.1, true);
 
-    auto final_weights = train(weights, data, test_data, 0.6, num_classes, 0.2, 100, num_features);
+    Tensor final_weights = train(weights, data, test_data, 0.6, 0.2, 100, batch_size);
 
     return 0;
 }
-
@@ -0,0 +1,270 @@
+/**
+ * @file checkpoint.cc
+ * @brief Implements the methods of the Checkpoint class.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "tensor.h"
+#include "tensorcontents.cc"
+#include "tensormemorypool.h"
+
+#define CHECKPOINTMAGIC "ZDLFCKPT"
+#define CHECKPOINTVERSION 1
+#define CHECKPOINTMAXDIMS 8
+
+// Data starts on multiples of the memory pool's alignment, so mapped tensors are aligned like allocated ones
+#define CHECKPOINTALIGNMENT POOLALIGNMENT
+
+namespace{
+    struct CheckpointHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t alignment;
+        uint64_t numTensors;
+    };
+
+    struct CheckpointEntry{
+        uint32_t dtype;
+        uint32_t numDims;
+        uint64_t dims[CHECKPOINTMAXDIMS];
+        uint64_t dataOffset, dataBytes;
+        uint64_t scalesOffset, scalesBytes;
+    };
+
+    struct PendingSaves{
+        std::mutex lock;
+        std::condition_variable done;
+        size_t count = 0;
+        size_t nextId = 0;
+    };
+
+    // Never destroyed, since detached save threads may still use it while the program exits
+    PendingSaves& pending(){
+        static PendingSaves * pendingSaves = new PendingSaves();
+        return *pendingSaves;
+    }
+
+    uint64_t alignUp(uint64_t offset){
+        return (offset + CHECKPOINTALIGNMENT - 1) / CHECKPOINTALIGNMENT * CHECKPOINTALIGNMENT;
+    }
+
+    void writeAll(FILE * file, const void * data, size_t numBytes){
+        if(numBytes > 0 && fwrite(data, 1, numBytes, file) != numBytes) throw std::runtime_error("Could not write checkpoint");
+    }
+
+    std::string temporaryPath(std::string path){
+        PendingSaves& p = pending();
+        std::lock_guard<std::mutex> guard(p.lock);
+        return path + ".tmp" + std::to_string(p.nextId++);
+    }
+}
+
+struct Checkpoint::SavedTensor{
+    CheckpointEntry entry;
+    vDataPtr data, scales;
+};
+
+// Evaluates t and returns its data contiguous and on the host, copied when copy is set so it no longer changes with t
+Checkpoint::SavedTensor Checkpoint::saveTensor(Tensor& t, bool copy){
+    TensorContentsPtr& c = t.contents;
+    if(c->dims.size() > CHECKPOINTMAXDIMS) throw std::runtime_error("Too many dimensions to save in a checkpoint");
+
+    SavedTensor ret;
+    ret.entry = {};
+    ret.entry.dtype = c->dtype;
+    ret.entry.numDims = c->dims.size();
+    for(size_t d = 0; d < c->dims.size(); ++d) ret.entry.dims[d] = c->dims[d];
+    ret.entry.dataBytes = c->dataLen * TensorContents::dtypeSize(c->dtype);
+
+    vDataPtr data = t.eval();
+    if(!c->isContiguous()){
+        data = c->contiguousData();
+        copy = false;
+    }
+    #ifdef CUDA
+        if(c->onGPU){
+            data = TensorGPUUtility::convert(data, false, ret.entry.dataBytes);
+            copy = false;
+        }
+    #endif
+    if(copy){
+        vDataPtr snapshot = TensorMemoryPool::allocate(ret.entry.dataBytes);
+        std::memcpy(snapshot.get(), data.get(), ret.entry.dataBytes);
+        data = snapshot;
+    }
+    ret.data = data;
+
+    // Scales of quantized tensors are never changed in place, so they are not copied
+    if(c->dtype == INT8){
+        ret.entry.scalesBytes = c->dims.back() * sizeof(float);
+        ret.scales = c->scales;
+    }
+    return ret;
+}
+
+void Checkpoint::writeFile(std::string path, std::string temporary, std::vector<SavedTensor>& tensors){
+    CheckpointHeader header = {};
+    std::memcpy(header.magic, CHECKPOINTMAGIC, sizeof(header.magic));
+    header.version = CHECKPOINTVERSION;
+    header.alignment = CHECKPOINTALIGNMENT;
+    header.numTensors = tensors.size();
+
+    uint64_t offset = sizeof(CheckpointHeader) + tensors.size() * sizeof(CheckpointEntry);
+    for(auto& t : tensors){
+        t.entry.dataOffset = alignUp(offset);
+        offset = t.entry.dataOffset + t.entry.dataBytes;
+        if(t.scales){
+            t.entry.scalesOffset = alignUp(offset);
+            offset = t.entry.scalesOffset + t.entry.scalesBytes;
+        }
+    }
+
+    FILE * file = fopen(temporary.c_str(), "wb");
+    if(!file) throw std::runtime_error("Could not open " + temporary + " to write a checkpoint");
+    try{
+        writeAll(file, &header, sizeof(header));
+        for(auto& t : tensors) writeAll(file, &t.entry, sizeof(t.entry));
+
+        static const char padding[CHECKPOINTALIGNMENT] = {};
+        uint64_t position = sizeof(CheckpointHeader) + tensors.size() * sizeof(CheckpointEntry);
+        auto writeAt = [&](uint64_t at, const void * data, size_t numBytes){
+            writeAll(file, padding, at - position);
+            writeAll(file, data, numBytes);
+            position = at + numBytes;
+        };
+        for(auto& t : tensors){
+            writeAt(t.entry.dataOffset, t.data.get(), t.entry.dataBytes);
+            if(t.scales) writeAt(t.entry.scalesOffset, t.scales.get(), t.entry.scalesBytes);
+        }
+        if(fflush(file) != 0 || fsync(fileno(file)) != 0) throw std::runtime_error("Could not write checkpoint");
+    }
+    catch(...){
+        fclose(file);
+        std::remove(temporary.c_str());
+        throw;
+    }
+    if(fclose(file) != 0 || std::rename(temporary.c_str(), path.c_str()) != 0){
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Could not write checkpoint " + path);
+    }
+}
+
+void Checkpoint::save(std::string path, std::vector<Tensor> tensors){
+    std::vector<SavedTensor> saved;
+    for(auto& t : tensors) saved.push_back(saveTensor(t, false));
+    writeFile(path, temporaryPath(path), saved);
+}
+
+std::shared_future<void> Checkpoint::saveAsync(std::string path, std::vector<Tensor> tensors){
+    auto saved = std::make_shared<std::vector<SavedTensor>>();
+    for(auto& t : tensors) saved->push_back(saveTensor(t, true));
+
+    // A promise rather than std::async, whose future would wait for the thread when dropped
+    auto promise = std::make_shared<std::promise<void>>();
+    std::shared_future<void> ret = promise->get_future().share();
+    std::string temporary = temporaryPath(path);
+
+    PendingSaves& p = pending();
+    {
+        std::lock_guard<std::mutex> guard(p.lock);
+        ++p.count;
+    }
+    std::thread([path, temporary, saved, promise](){
+        try{
+            writeFile(path, temporary, *saved);
+            promise->set_value();
+        }
+        catch(...){
+            promise->set_exception(std::current_exception());
+        }
+        PendingSaves& p = pending();
+        std::lock_guard<std::mutex> guard(p.lock);
+        --p.count;
+        p.done.notify_all();
+    }).detach();
+    return ret;
+}
+
+void Checkpoint::waitForSaves(){
+    PendingSaves& p = pending();
+    std::unique_lock<std::mutex> guard(p.lock);
+    p.done.wait(guard, [&p]{return p.count == 0;});
+}
+
+std::vector<Tensor> Checkpoint::load(std::string path, bool saveGradient, deviceOptions device){
+    bool onGPU = device == GPU;
+    #ifndef CUDA
+        if(onGPU) throw std::runtime_error("Cannot select GPU since not compiled with CUDA");
+    #endif
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) throw std::runtime_error("Could not open checkpoint " + path);
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(CheckpointHeader)){
+        close(fd);
+        throw std::runtime_error(path + " is not a checkpoint");
+    }
+    size_t fileSize = info.st_size;
+    void * p = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) throw std::runtime_error("Could not map checkpoint " + path);
+
+    // Unmapped once the last tensor reading from the file is freed
+    std::shared_ptr<void> mapping(p, [fileSize](void * p){munmap(p, fileSize);});
+    char * base = static_cast<char *>(p);
+
+    CheckpointHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if(std::memcmp(header.magic, CHECKPOINTMAGIC, sizeof(header.magic)) != 0) throw std::runtime_error(path + " is not a checkpoint");
+    if(header.version != CHECKPOINTVERSION) throw std::runtime_error("Unsupported checkpoint version in " + path);
+    if(header.alignment == 0 || header.alignment % CHECKPOINTALIGNMENT != 0) throw std::runtime_error("Unsupported checkpoint alignment in " + path);
+    if(header.numTensors > (fileSize - sizeof(CheckpointHeader)) / sizeof(CheckpointEntry)) throw std::runtime_error("Truncated checkpoint " + path);
+
+    auto inFile = [&](uint64_t offset, uint64_t numBytes){
+        return offset % header.alignment == 0 && offset <= fileSize && numBytes <= fileSize - offset;
+    };
+
+    std::vector<Tensor> ret;
+    for(uint64_t i = 0; i < header.numTensors; ++i){
+        CheckpointEntry entry;
+        std::memcpy(&entry, base + sizeof(CheckpointHeader) + i * sizeof(CheckpointEntry), sizeof(entry));
+        if(entry.dtype > INT8 || entry.numDims == 0 || entry.numDims > CHECKPOINTMAXDIMS) throw std::runtime_error("Corrupt checkpoint " + path);
+
+        dtypeOptions dtype = (dtypeOptions) entry.dtype;
+        vDims dims(entry.dims, entry.dims + entry.numDims);
+        size_t dataBytes = TensorContents::calculateDataLen(dims) * TensorContents::dtypeSize(dtype);
+        if(entry.dataBytes != dataBytes || !inFile(entry.dataOffset, dataBytes)) throw std::runtime_error("Corrupt checkpoint " + path);
+        if(dtype == INT8 && (entry.scalesBytes != dims.back() * sizeof(float) || !inFile(entry.scalesOffset, entry.scalesBytes)))
+            throw std::runtime_error("Corrupt checkpoint " + path);
+
+        vDataPtr data(mapping, base + entry.dataOffset);
+        #ifdef CUDA
+            if(onGPU) data = TensorGPUUtility::convert(data, true, dataBytes);
+        #endif
+        auto contents = std::make_shared<TensorContents>(dims, data, saveGradient && dtype != INT8, onGPU, dtype);
+        if(dtype == INT8) contents->scales = vDataPtr(mapping, base + entry.scalesOffset);
+        ret.push_back(Tensor(contents));
+    }
+    return ret;
+}
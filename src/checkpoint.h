@@ -0,0 +1,79 @@
+/**
+ * @file checkpoint.h
+ * @brief Defines the Checkpoint class, which saves tensors to a binary file and maps them back
+ * into memory without copying.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef CHECKPOINTH
+#define CHECKPOINTH
+
+#include <future>
+#include <string>
+#include <vector>
+
+#include "tensor.h"
+
+/**
+ * @brief Reads and writes checkpoint files of a list of tensors.
+ *
+ * A file starts with a header holding a magic string, the format version, the alignment of the
+ * data and the number of tensors. A table follows with the dtype, dims and data offset of each
+ * tensor, then the raw row-major data of each, starting on a multiple of the alignment. INT8
+ * tensors also store their per-channel scales.
+ *
+ * Loading maps the file into memory and the tensors read their data from the mapping, so a large
+ * model loads without reading the file up front and without a copy. Pages are read from disk
+ * when first touched. The mapping is private, so changes to the loaded data never reach the file.
+ */
+class Checkpoint{
+    private:
+        // A tensor's contiguous host data and its entry in the file's table
+        struct SavedTensor;
+
+        static SavedTensor saveTensor(Tensor& t, bool copy);
+        static void writeFile(std::string path, std::string temporary, std::vector<SavedTensor>& tensors);
+
+    public:
+        /**
+         * @brief Evaluates the tensors and writes them to a file.
+         *
+         * The file is written under a temporary name and renamed when complete, so an interrupted
+         * save leaves any earlier checkpoint at path whole.
+         *
+         * @param path File to write.
+         * @param tensors Tensors to save, in the order load returns them.
+         */
+        static void save(std::string path, std::vector<Tensor> tensors);
+
+        /**
+         * @brief Like save, but writes the file on a background thread.
+         *
+         * The tensors are evaluated and their data copied before this returns, so they may be
+         * changed, for example by an Optimizer step, while the file is written.
+         *
+         * @param path File to write.
+         * @param tensors Tensors to save, in the order load returns them.
+         * @return A future that is ready once the file is written, and rethrows any error from writing it.
+         */
+        static std::shared_future<void> saveAsync(std::string path, std::vector<Tensor> tensors);
+
+        /**
+         * @brief Waits for every save started by saveAsync to finish, for example before exiting.
+         */
+        static void waitForSaves();
+
+        /**
+         * @brief Maps a checkpoint file into memory.
+         *
+         * @param path File to load.
+         * @param saveGradient Whether the loaded tensors compute gradients (default: false).
+         * @param device Device of the loaded tensors, GPU tensors are copied to the device (default: CPU).
+         * @return The saved tensors, in the order they were saved.
+         */
+        static std::vector<Tensor> load(std::string path, bool saveGradient = false, deviceOptions device = CPU);
+};
+
+#endif
@@ -0,0 +1,274 @@
+/**
+ * @file dataloader.cc
+ * @brief Implements the methods of the DataLoader class.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dataloader.h"
+#include "dataset.h"
+#include "tensor.h"
+#include "tensorcontents.cc"
+#include "tensormemorypool.h"
+
+// Marks the end of an epoch in the queue of filled batches
+#define ENDOFEPOCH SIZE_MAX
+
+struct DataLoader::State{
+    // A stream is read in order with nextSample, a dataset by index with readSample
+    std::function<bool(void *, int&)> nextSample;
+    std::function<void()> rewind;
+    std::function<void(size_t, void *, int&)> readSample;
+    size_t numSamples = 0;
+    size_t numFeatures, batchSize, shuffleBuffer;
+    dtypeOptions dtype;
+    bool dropLast;
+    uint64_t key, counter = 0;
+
+    struct Batch{
+        vDataPtr features, labels;
+        size_t numSamples = 0;
+        bool free = true;
+    };
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<Batch> batches;
+    std::deque<size_t> ready;
+    std::exception_ptr error;
+    bool stop = false;
+
+    // Called once nothing reads a batch handed out by next
+    void release(size_t index){
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            batches[index].free = true;
+        }
+        changed.notify_all();
+    }
+
+    size_t random(size_t n){
+        uint32_t out[4];
+        philox(out, counter++, key);
+        return (((uint64_t) out[1] << 32) | out[0]) % n;
+    }
+};
+
+DataLoader::DataLoader(std::shared_ptr<State> source, size_t numFeatures, dtypeOptions dtype, size_t batchSize,
+        size_t shuffleBuffer, bool dropLast, size_t numBuffers) : state(source) {
+    if(dtype == INT8) throw std::runtime_error("DataLoader cannot batch INT8 tensors");
+    if(batchSize == 0) throw std::runtime_error("DataLoader batch size must be positive");
+    if(numBuffers < 2) throw std::runtime_error("DataLoader needs at least two buffers");
+
+    State& s = *state;
+    s.numFeatures = numFeatures;
+    s.batchSize = batchSize;
+    s.shuffleBuffer = shuffleBuffer;
+    s.dtype = dtype;
+    s.dropLast = dropLast;
+    s.key = Tensor::nextRandomKey();
+
+    s.batches.resize(numBuffers);
+    for(auto& b : s.batches){
+        b.features = TensorMemoryPool::allocate(batchSize * numFeatures * TensorContents::dtypeSize(dtype));
+        b.labels = TensorMemoryPool::allocate(batchSize * TensorContents::dtypeSize(dtype));
+    }
+
+    producer = std::thread(produce, state);
+}
+
+DataLoader DataLoader::fromDataset(Dataset dataset, size_t batchSize, size_t shuffleBuffer, bool dropLast, size_t numBuffers){
+    Tensor features = dataset.getFeatures();
+    TensorContentsPtr& c = features.contents;
+    size_t numFeatures = c->dims[1];
+    size_t rowBytes = numFeatures * TensorContents::dtypeSize(c->dtype);
+
+    // Rows are copied from contiguous host data
+    vDataPtr data = features.eval();
+    if(!c->isContiguous()) data = c->contiguousData();
+    #ifdef CUDA
+        if(c->onGPU) data = TensorGPUUtility::convert(data, false, c->dataLen * TensorContents::dtypeSize(c->dtype));
+    #endif
+
+    // Rows are copied straight from the dataset into the batches, only their indices are shuffled
+    std::vector<int> labels = dataset.getLabels();
+    auto state = std::make_shared<State>();
+    state->numSamples = labels.size();
+    state->readSample = [data, labels, rowBytes](size_t index, void * row, int& label){
+        std::memcpy(row, static_cast<char *>(data.get()) + index * rowBytes, rowBytes);
+        label = labels[index];
+    };
+    return DataLoader(state, numFeatures, c->dtype, batchSize, shuffleBuffer, dropLast, numBuffers);
+}
+
+DataLoader DataLoader::fromLibsvm(std::string path, size_t numFeatures, size_t batchSize, size_t shuffleBuffer,
+        bool dropLast, dtypeOptions dtype, size_t numBuffers){
+    auto stream = std::make_shared<LibsvmStream>(path, numFeatures, dtype);
+    auto state = std::make_shared<State>();
+    state->nextSample = [stream](void * row, int& label){return stream->next(row, label);};
+    state->rewind = [stream](){stream->rewind();};
+    return DataLoader(state, numFeatures, dtype, batchSize, shuffleBuffer, dropLast, numBuffers);
+}
+
+DataLoader::~DataLoader(){
+    if(state){
+        {
+            std::lock_guard<std::mutex> guard(state->lock);
+            state->stop = true;
+        }
+        state->changed.notify_all();
+    }
+    if(producer.joinable()) producer.join();
+}
+
+/**
+ * Runs on the background thread. Samples are read into a shuffle buffer, and each sample drawn from
+ * it is replaced by the next sample of the source, so the buffer holds the same number of samples
+ * until the source runs out. A dataset is shuffled the same way over the indices of its samples, so
+ * only indices are buffered and a buffer of the whole dataset draws a random permutation. Each
+ * epoch is followed by an ENDOFEPOCH marker and the source is rewound.
+ */
+void DataLoader::produce(std::shared_ptr<State> state){
+    State& s = *state;
+    size_t rowBytes = s.numFeatures * TensorContents::dtypeSize(s.dtype);
+    bool shuffle = s.shuffleBuffer > 1;
+    bool indexed = (bool) s.readSample;
+    size_t poolSize = indexed ? std::min(s.shuffleBuffer, s.numSamples) : s.shuffleBuffer;
+    std::vector<char> pool(shuffle && !indexed ? poolSize * rowBytes : 0);
+    std::vector<int> poolLabels(shuffle && !indexed ? poolSize : 0);
+    std::vector<size_t> poolIndices(shuffle && indexed ? poolSize : 0);
+    size_t inPool = 0, nextIndex = 0;
+    bool sourceDone = false;
+
+    auto drawIndex = [&](char * row, int& label){
+        if(shuffle){
+            while(nextIndex < s.numSamples && inPool < poolSize) poolIndices[inPool++] = nextIndex++;
+            if(inPool == 0) return false;
+            size_t i = s.random(inPool);
+            s.readSample(poolIndices[i], row, label);
+            poolIndices[i] = nextIndex < s.numSamples ? nextIndex++ : poolIndices[--inPool];
+            return true;
+        }
+        if(nextIndex == s.numSamples) return false;
+        s.readSample(nextIndex++, row, label);
+        return true;
+    };
+
+    auto draw = [&](char * row, int& label){
+        if(indexed) return drawIndex(row, label);
+        if(!shuffle) return s.nextSample(row, label);
+        while(!sourceDone && inPool < poolSize){
+            if(s.nextSample(pool.data() + inPool * rowBytes, poolLabels[inPool])) ++inPool;
+            else sourceDone = true;
+        }
+        if(inPool == 0) return false;
+
+        size_t i = s.random(inPool);
+        std::memcpy(row, pool.data() + i * rowBytes, rowBytes);
+        label = poolLabels[i];
+        if(sourceDone || !s.nextSample(pool.data() + i * rowBytes, poolLabels[i])){
+            sourceDone = true;
+            if(i != --inPool){
+                std::memcpy(pool.data() + i * rowBytes, pool.data() + inPool * rowBytes, rowBytes);
+                poolLabels[i] = poolLabels[inPool];
+            }
+        }
+        return true;
+    };
+
+    std::vector<int> labels(s.batchSize);
+    try{
+        while(true){
+            size_t numBatches = 0;
+            size_t numSamples = s.batchSize;
+            while(numSamples == s.batchSize){
+                size_t index = 0;
+                {
+                    std::unique_lock<std::mutex> guard(s.lock);
+                    auto freeBatch = [&](){
+                        for(index = 0; index < s.batches.size(); ++index)
+                            if(s.batches[index].free) return true;
+                        return false;
+                    };
+                    s.changed.wait(guard, [&](){return s.stop || freeBatch();});
+                    if(s.stop) return;
+                    s.batches[index].free = false;
+                }
+
+                State::Batch& b = s.batches[index];
+                char * rows = static_cast<char *>(b.features.get());
+                numSamples = 0;
+                while(numSamples < s.batchSize && draw(rows + numSamples * rowBytes, labels[numSamples])) ++numSamples;
+                DTYPESWITCH(s.dtype,
+                    for(size_t i = 0; i < numSamples; ++i) TDATA(b.labels)[i] = (T) labels[i];
+                )
+
+                {
+                    std::lock_guard<std::mutex> guard(s.lock);
+                    if(numSamples == s.batchSize || (numSamples > 0 && !s.dropLast)){
+                        b.numSamples = numSamples;
+                        s.ready.push_back(index);
+                        ++numBatches;
+                    }
+                    else b.free = true;
+                }
+                s.changed.notify_all();
+            }
+            if(numBatches == 0) throw std::runtime_error("DataLoader source has too few samples for a batch");
+
+            {
+                std::unique_lock<std::mutex> guard(s.lock);
+                s.changed.wait(guard, [&](){return s.stop || s.ready.size() < s.batches.size();});
+                if(s.stop) return;
+                s.ready.push_back(ENDOFEPOCH);
+            }
+            s.changed.notify_all();
+            if(indexed) nextIndex = 0;
+            else s.rewind();
+            sourceDone = false;
+        }
+    }
+    catch(...){
+        {
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.error = std::current_exception();
+        }
+        s.changed.notify_all();
+    }
+}
+
+std::vector<Tensor> DataLoader::next(){
+    State& s = *state;
+    size_t index;
+    {
+        std::unique_lock<std::mutex> guard(s.lock);
+        s.changed.wait(guard, [&](){return !s.ready.empty() || s.error;});
+        if(s.ready.empty()) std::rethrow_exception(s.error);
+        index = s.ready.front();
+        s.ready.pop_front();
+    }
+    s.changed.notify_all();
+    if(index == ENDOFEPOCH) return {};
+
+    State::Batch& b = s.batches[index];
+    std::shared_ptr<State> shared = state;
+    vDataPtr featureData(b.features.get(), [shared, index](void *){shared->release(index);});
+    vDataPtr labelData(featureData, b.labels.get());
+    return {TensorContents::makeTensor(std::make_shared<TensorContents>(vDims{b.numSamples, s.numFeatures}, featureData, false, false, s.dtype)),
+        TensorContents::makeTensor(std::make_shared<TensorContents>(vDims{b.numSamples}, labelData, false, false, s.dtype))};
+}
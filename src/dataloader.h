@@ -0,0 +1,100 @@
+/**
+ * @file dataloader.h
+ * @brief Defines the DataLoader class, which assembles shuffled minibatches on a background thread.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef DATALOADERH
+#define DATALOADERH
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dataset.h"
+#include "tensor.h"
+
+// Batches a loader holds at once, one the training loop reads while the others are filled
+#define DATALOADERBUFFERS 3
+
+/**
+ * @brief Streams minibatches from a Dataset or a libsvm file.
+ *
+ * A background thread reads samples from the source into a shuffle buffer, the rows of a stream or
+ * the indices of a dataset's samples. It draws random samples from that buffer into the next free
+ * batch of a fixed ring of buffers. Data preparation therefore overlaps with the evaluation and
+ * backward pass of the previous batch. Memory use depends only on the batch size, the shuffle
+ * buffer size and the number of buffers, not on the size of the source.
+ *
+ * The features and labels of a batch are read straight from its buffer. The buffer is refilled
+ * once every tensor that reads it, including unevaluated results computed from it, is destroyed. A
+ * training loop that holds on to more than numBuffers batches would wait forever for a free buffer.
+ *
+ * Shuffling uses the random keys of fillRandom, so Tensor::setSeed makes the order repeatable.
+ */
+class DataLoader{
+    private:
+        // State shared with the background thread and the batches handed out
+        struct State;
+
+        std::shared_ptr<State> state;
+        std::thread producer;
+
+        // Starts the background thread on a state whose source is already set
+        DataLoader(std::shared_ptr<State> source, size_t numFeatures, dtypeOptions dtype, size_t batchSize,
+                size_t shuffleBuffer, bool dropLast, size_t numBuffers);
+        static void produce(std::shared_ptr<State> state);
+
+    public:
+        /**
+         * @brief Batches the samples of a dataset.
+         *
+         * Rows are copied from the dataset straight into the batches. Shuffling buffers the indices
+         * of samples rather than their rows, so even a full shuffle adds one index per sample.
+         *
+         * @param dataset Samples to batch.
+         * @param batchSize Samples per batch.
+         * @param shuffleBuffer Samples to draw each sample from at random, zero or one for the
+         * order of the dataset, at least the size of the dataset for a full shuffle (default: 0).
+         * @param dropLast Whether to skip the last batch of an epoch when it is smaller than batchSize (default: false).
+         * @param numBuffers Batches allocated for the ring, at least two (default: DATALOADERBUFFERS).
+         * @return The loader.
+         */
+        static DataLoader fromDataset(Dataset dataset, size_t batchSize, size_t shuffleBuffer = 0, bool dropLast = false,
+                size_t numBuffers = DATALOADERBUFFERS);
+
+        /**
+         * @brief Batches the samples of a libsvm file as it is read, without loading the whole file.
+         *
+         * @param path File to read.
+         * @param numFeatures Number of features of a sample, the largest index allowed.
+         * @param batchSize Samples per batch.
+         * @param shuffleBuffer Samples to draw each sample from at random, zero or one for the order of the file (default: 0).
+         * @param dropLast Whether to skip the last batch of an epoch when it is smaller than batchSize (default: false).
+         * @param dtype Element type of the batches (default: FLOAT64).
+         * @param numBuffers Batches allocated for the ring, at least two (default: DATALOADERBUFFERS).
+         * @return The loader.
+         */
+        static DataLoader fromLibsvm(std::string path, size_t numFeatures, size_t batchSize, size_t shuffleBuffer = 0,
+                bool dropLast = false, dtypeOptions dtype = FLOAT64, size_t numBuffers = DATALOADERBUFFERS);
+
+        DataLoader(DataLoader&&) = default;
+        DataLoader& operator=(DataLoader&&) = delete;
+        ~DataLoader();
+
+        /**
+         * @brief Takes the next batch, waiting for the background thread if it is not ready yet.
+         *
+         * After the last batch of an epoch, returns an empty vector once and then continues with the
+         * next epoch. Errors reading the source are thrown here.
+         *
+         * @return The features of the batch, of shape [samples, numFeatures], and the label of each
+         * sample, of shape [samples] in the dtype of the features. Empty at the end of an epoch.
+         */
+        std::vector<Tensor> next();
+};
+
+#endif
@@ -0,0 +1,293 @@
+/**
+ * @file dataset.cc
+ * @brief Implements the methods of the Dataset class.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dataset.h"
+#include "tensor.h"
+#include "tensorcontents.cc"
+#include "tensormemorypool.h"
+
+#ifdef OMP
+    #include <omp.h>
+#endif
+
+// Pieces of the file per thread, so threads that finish early pick up more
+#define LIBSVMCHUNKSPERTHREAD 4
+
+// Bytes a LibsvmStream reads at a time, grown when a line is longer
+#define LIBSVMBLOCKSIZE (1 << 20)
+
+namespace{
+    // Read-only mapping of a whole file, unmapped when destroyed
+    class MappedFile{
+        void * p = MAP_FAILED;
+        size_t numBytes = 0;
+
+        public:
+            MappedFile(std::string path){
+                int fd = open(path.c_str(), O_RDONLY);
+                if(fd < 0) throw std::runtime_error("Could not open " + path);
+                struct stat info;
+                if(fstat(fd, &info) == 0) numBytes = info.st_size;
+                if(numBytes > 0) p = mmap(nullptr, numBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if(numBytes == 0) throw std::runtime_error(path + " is empty");
+                if(p == MAP_FAILED) throw std::runtime_error("Could not map " + path);
+                madvise(p, numBytes, MADV_WILLNEED);
+            }
+
+            ~MappedFile(){
+                munmap(p, numBytes);
+            }
+
+            const char * begin() {return static_cast<const char *>(p);}
+            const char * end() {return begin() + numBytes;}
+    };
+
+    bool isSpace(char c){
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    bool isDigit(char c){
+        return c >= '0' && c <= '9';
+    }
+
+    // End of the line starting at p, the newline or end
+    const char * lineEnd(const char * p, const char * end){
+        const char * newline = static_cast<const char *>(memchr(p, '\n', end - p));
+        return newline ? newline : end;
+    }
+
+    const char * nextLine(const char * p, const char * end){
+        const char * e = lineEnd(p, end);
+        return e < end ? e + 1 : end;
+    }
+
+    bool isBlank(const char * p, const char * end){
+        while(p < end && isSpace(*p)) ++p;
+        return p == end;
+    }
+
+    bool parseIndex(const char *& p, const char * end, size_t& value){
+        const char * start = p;
+        value = 0;
+        while(p < end && isDigit(*p)) value = value * 10 + (*p++ - '0');
+        return p != start;
+    }
+
+    // Decimal number with an optional sign, fraction and exponent, the digits are summed as an integer and scaled once
+    bool parseNumber(const char *& p, const char * end, double& value){
+        bool negative = false;
+        if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+        uint64_t mantissa = 0;
+        int exponent = 0;
+        bool digits = false;
+        for(; p < end && isDigit(*p); ++p, digits = true){
+            if(mantissa < UINT64_MAX / 10) mantissa = mantissa * 10 + (*p - '0');
+            else ++exponent;
+        }
+        if(p < end && *p == '.'){
+            for(++p; p < end && isDigit(*p); ++p, digits = true){
+                if(mantissa < UINT64_MAX / 10){
+                    mantissa = mantissa * 10 + (*p - '0');
+                    --exponent;
+                }
+            }
+        }
+        if(!digits) return false;
+
+        if(p < end && (*p == 'e' || *p == 'E')){
+            ++p;
+            bool negativeExponent = false;
+            if(p < end && (*p == '-' || *p == '+')) negativeExponent = *p++ == '-';
+            size_t e;
+            if(!parseIndex(p, end, e)) return false;
+            exponent += negativeExponent ? -(int) e : (int) e;
+        }
+
+        value = (double) mantissa;
+        if(exponent != 0) value *= std::pow(10.0, exponent);
+        if(negative) value = -value;
+        return true;
+    }
+
+    // Parses "label index:value ..." into row and label
+    template<typename T>
+    bool parseLine(const char * p, const char * end, T * row, size_t numFeatures, int& label){
+        double value;
+        while(p < end && isSpace(*p)) ++p;
+        if(!parseNumber(p, end, value)) return false;
+        label = (int) value;
+
+        while(true){
+            while(p < end && isSpace(*p)) ++p;
+            if(p == end) return true;
+            size_t index;
+            if(!parseIndex(p, end, index) || p == end || *p++ != ':') return false;
+            if(!parseNumber(p, end, value)) return false;
+            if(index == 0 || index > numFeatures) return false;
+            row[index - 1] = (T) value;
+        }
+    }
+
+    // Parses the samples of each piece into its rows, returning the first sample that does not parse or SIZE_MAX
+    template<typename T>
+    size_t parseSamples(T * features, std::vector<int>& labels, std::vector<const char *>& bounds, std::vector<size_t>& firstRow, size_t numFeatures){
+        size_t numChunks = bounds.size() - 1;
+        std::vector<size_t> badRow(numChunks, SIZE_MAX);
+
+        // Failures are recorded, since exceptions cannot leave a parallel loop
+        #pragma omp parallel for schedule(dynamic)
+        for(size_t c = 0; c < numChunks; ++c){
+            size_t row = firstRow[c];
+            for(const char * p = bounds[c]; p < bounds[c + 1]; p = nextLine(p, bounds[c + 1])){
+                const char * e = lineEnd(p, bounds[c + 1]);
+                if(isBlank(p, e)) continue;
+                if(!parseLine(p, e, features + row * numFeatures, numFeatures, labels[row])){
+                    badRow[c] = row;
+                    break;
+                }
+                ++row;
+            }
+        }
+
+        for(auto row : badRow)
+            if(row != SIZE_MAX) return row;
+        return SIZE_MAX;
+    }
+}
+
+Dataset::Dataset(Tensor features, std::vector<int> labels) : features(features), labels(labels) {
+    vDims dims = features.getDims();
+    if(dims.size() != 2 || dims[0] != labels.size()) throw std::runtime_error("Dataset features must be of shape [N, features] with a label per sample");
+}
+
+Dataset Dataset::readLibsvm(std::string path, size_t numFeatures, dtypeOptions dtype){
+    if(dtype == INT8) throw std::runtime_error("INT8 tensors can only be created by quantize");
+    MappedFile file(path);
+    const char * begin = file.begin();
+    const char * end = file.end();
+
+    // Pieces start at the beginning of a line
+    size_t numChunks = 1;
+    #ifdef OMP
+        numChunks = omp_get_max_threads() * LIBSVMCHUNKSPERTHREAD;
+    #endif
+    std::vector<const char *> bounds(numChunks + 1, end);
+    bounds[0] = begin;
+    for(size_t c = 1; c < numChunks; ++c){
+        const char * p = begin + (end - begin) * c / numChunks;
+        if(p < bounds[c - 1]) p = bounds[c - 1];
+        if(p > begin && p[-1] != '\n') p = lineEnd(p, end);
+        bounds[c] = p < end && *p == '\n' ? p + 1 : p;
+    }
+
+    // Samples per piece, then the row each piece starts at
+    std::vector<size_t> firstRow(numChunks + 1, 0);
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t c = 0; c < numChunks; ++c){
+        size_t rows = 0;
+        for(const char * p = bounds[c]; p < bounds[c + 1]; p = nextLine(p, bounds[c + 1]))
+            if(!isBlank(p, lineEnd(p, bounds[c + 1]))) ++rows;
+        firstRow[c + 1] = rows;
+    }
+    for(size_t c = 0; c < numChunks; ++c) firstRow[c + 1] += firstRow[c];
+    size_t numSamples = firstRow[numChunks];
+    if(numSamples == 0) throw std::runtime_error(path + " has no samples");
+
+    vDims dims = {numSamples, numFeatures};
+    size_t dataLen = numSamples * numFeatures;
+    vDataPtr data = TensorMemoryPool::allocate(dataLen * TensorContents::dtypeSize(dtype));
+    std::vector<int> labels(numSamples);
+
+    size_t badRow;
+    DTYPESWITCH(dtype,
+        cpuZeroes<T>(TDATA(data), dataLen);
+        badRow = parseSamples<T>(TDATA(data), labels, bounds, firstRow, numFeatures);
+    )
+    if(badRow != SIZE_MAX)
+        throw std::runtime_error("Sample " + std::to_string(badRow + 1) + " of " + path + " is not valid libsvm with at most " + std::to_string(numFeatures) + " features");
+
+    Tensor features = TensorContents::makeTensor(std::make_shared<TensorContents>(dims, data, false, false, dtype));
+    return Dataset(features, labels);
+}
+
+LibsvmStream::LibsvmStream(std::string path, size_t numFeatures, dtypeOptions dtype) : path(path), numFeatures(numFeatures), dtype(dtype), buffer(LIBSVMBLOCKSIZE) {
+    if(dtype == INT8) throw std::runtime_error("INT8 tensors can only be created by quantize");
+    file = fopen(path.c_str(), "rb");
+    if(!file) throw std::runtime_error("Could not open " + path);
+}
+
+LibsvmStream::~LibsvmStream(){
+    fclose(file);
+}
+
+// Moves the unparsed bytes to the front of the buffer and reads more after them, returning false at the end of the file
+bool LibsvmStream::refill(){
+    if(atEnd) return false;
+    if(begin > 0){
+        std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+    }
+    if(end == buffer.size()) buffer.resize(buffer.size() * 2);
+    size_t numBytes = fread(buffer.data() + end, 1, buffer.size() - end, file);
+    if(numBytes == 0){
+        if(ferror(file)) throw std::runtime_error("Could not read " + path);
+        atEnd = true;
+        return false;
+    }
+    end += numBytes;
+    return true;
+}
+
+bool LibsvmStream::next(void * row, int& label){
+    while(true){
+        const char * newline = static_cast<const char *>(memchr(buffer.data() + begin, '\n', end - begin));
+        if(!newline && refill()) continue;
+        if(!newline && begin == end) return false;
+
+        // The last line of the file may have no newline, refill has moved it to the front
+        const char * p = buffer.data() + begin;
+        const char * e = newline ? newline : buffer.data() + end;
+        begin = newline ? newline + 1 - buffer.data() : end;
+        if(isBlank(p, e)) continue;
+
+        ++numRead;
+        bool parsed;
+        DTYPESWITCH(dtype,
+            std::fill(static_cast<T *>(row), static_cast<T *>(row) + numFeatures, (T) 0);
+            parsed = parseLine(p, e, static_cast<T *>(row), numFeatures, label);
+        )
+        if(!parsed)
+            throw std::runtime_error("Sample " + std::to_string(numRead) + " of " + path + " is not valid libsvm with at most " + std::to_string(numFeatures) + " features");
+        return true;
+    }
+}
+
+void LibsvmStream::rewind(){
+    std::rewind(file);
+    begin = end = 0;
+    atEnd = false;
+    numRead = 0;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file dataset.h
+ * @brief Defines the Dataset class, which holds the samples of a dataset in one tensor, and
+ * LibsvmStream, which reads them one at a time.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef DATASETH
+#define DATASETH
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "tensor.h"
+
+/**
+ * @brief Samples stored as the rows of one contiguous [N, features] tensor, with a label per row.
+ */
+class Dataset{
+    private:
+        Tensor features;
+        std::vector<int> labels;
+
+    public:
+        /**
+         * @brief Wraps samples that are already in one tensor.
+         * @param features Tensor of shape [N, features].
+         * @param labels Label of each of the N samples.
+         */
+        Dataset(Tensor features, std::vector<int> labels);
+
+        /**
+         * @brief Reads a file in libsvm format, a line per sample of the form "label index:value ...".
+         *
+         * Indices start at one and features that are not listed are zero. The file is mapped into
+         * memory, split at line boundaries, and the pieces are parsed in parallel straight into
+         * the rows of the features tensor.
+         *
+         * @param path File to read.
+         * @param numFeatures Number of features of a sample, the largest index allowed.
+         * @param dtype Element type of the features (default: FLOAT64).
+         * @return The dataset.
+         */
+        static Dataset readLibsvm(std::string path, size_t numFeatures, dtypeOptions dtype = FLOAT64);
+
+        // Features of every sample, of shape [N, features]
+        Tensor getFeatures() {return features;}
+        std::vector<int>& getLabels() {return labels;}
+        size_t size() {return labels.size();}
+};
+
+/**
+ * @brief Reads the samples of a libsvm file one at a time, holding only a block of the file in memory.
+ */
+class LibsvmStream{
+    private:
+        FILE * file;
+        std::string path;
+        size_t numFeatures;
+        dtypeOptions dtype;
+
+        // Bytes of the file read but not yet parsed are buffer[begin, end)
+        std::vector<char> buffer;
+        size_t begin = 0, end = 0;
+        bool atEnd = false;
+        size_t numRead = 0;
+
+        bool refill();
+
+    public:
+        /**
+         * @brief Opens a file in libsvm format, a line per sample of the form "label index:value ...".
+         * @param path File to read.
+         * @param numFeatures Number of features of a sample, the largest index allowed.
+         * @param dtype Element type the features are written in (default: FLOAT64).
+         */
+        LibsvmStream(std::string path, size_t numFeatures, dtypeOptions dtype = FLOAT64);
+        ~LibsvmStream();
+        LibsvmStream(const LibsvmStream&) = delete;
+        LibsvmStream& operator=(const LibsvmStream&) = delete;
+
+        /**
+         * @brief Reads the next sample.
+         * @param row Written with the numFeatures features of the sample, in dtype.
+         * @param label Written with the label of the sample.
+         * @return False, writing nothing, once every sample of the file has been read.
+         */
+        bool next(void * row, int& label);
+
+        // Starts again from the first sample
+        void rewind();
+
+        size_t getNumFeatures() {return numFeatures;}
+        dtypeOptions getDtype() {return dtype;}
+};
+
+#endif
@@ -6,19 +6,87 @@
  * @date November 2024
  */
 
+#include <memory>
+#include <vector>
+
 #include "layers.h"
 #include "tensor.h"
 
+Layers::Linear::Linear(size_t inputSize, size_t outputSize, activationOptions activation, deviceOptions device, dtypeOptions dtype)
+    : weight(Tensor::fillRandom({inputSize, outputSize}, 0, 0.1, true, device, dtype)),
+      bias(Tensor::fillRandom({outputSize}, 0, 0.1, true, device, dtype)), activation(activation) {}
+
+Layers::Linear::Linear(Tensor weight, Tensor bias, activationOptions activation)
+    : weight(weight), bias(bias), activation(activation) {}
+
+Tensor Layers::Linear::forward(Tensor input){
+    Tensor w = weight;
+    if(quantized){
+        if(!quantizedWeight || weight.getVersion() != quantizedVersion){
+            quantizedWeight = std::make_shared<Tensor>(weight.quantize());
+            quantizedVersion = weight.getVersion();
+        }
+        w = *quantizedWeight;
+    }
+
+    auto out = input.matmul(w) + bias;
+    if(activation == RELUACTIVATION) return out.relu();
+    if(activation == SOFTMAXACTIVATION) return out.softmax();
+    return out;
+}
+
+std::vector<Tensor> Layers::Linear::parameters(){
+    return {weight, bias};
+}
+
+void Layers::Linear::setQuantized(bool quantized){
+    this->quantized = quantized;
+    if(!quantized) quantizedWeight.reset();
+}
+
+Layers::MultiLayer::MultiLayer(size_t inputSize, size_t outputSize, std::vector<size_t> intermediateSizes,
+        activationOptions outputActivation, deviceOptions device, dtypeOptions dtype){
+    for(auto size : intermediateSizes){
+        layers.push_back(Linear(inputSize, size, RELUACTIVATION, device, dtype));
+        inputSize = size;
+    }
+    layers.push_back(Linear(inputSize, outputSize, outputActivation, device, dtype));
+}
+
+Tensor Layers::MultiLayer::forward(Tensor input){
+    for(auto& layer : layers) input = layer.forward(input);
+    return input;
+}
+
+std::vector<Tensor> Layers::MultiLayer::parameters(){
+    std::vector<Tensor> ret;
+    for(auto& layer : layers)
+        for(auto& p : layer.parameters()) ret.push_back(p);
+    return ret;
+}
+
+void Layers::MultiLayer::setQuantized(bool quantized){
+    for(auto& layer : layers) layer.setQuantized(quantized);
+}
+
 Tensor Layers::singleLinearSoftmax(Tensor input, size_t inputSize, size_t outputSize){
     auto weight = Tensor::fillRandom({inputSize, outputSize}, 0, 0.1);
     auto bias = Tensor::fillRandom({outputSize}, 0, 0.1);
-    auto probs = (input.matmul(weight) + bias).softmax();
-    return probs;
+    return singleLinearSoftmax(input, weight, bias);
 }
 
 Tensor Layers::singleLinearRelu(Tensor input, size_t inputSize, size_t outputSize){
     auto weight = Tensor::fillRandom({inputSize, outputSize}, 0, 0.1);
     auto bias = Tensor::fillRandom({outputSize}, 0, 0.1);
+    return singleLinearRelu(input, weight, bias);
+}
+
+Tensor Layers::singleLinearSoftmax(Tensor input, Tensor weight, Tensor bias){
+    auto probs = (input.matmul(weight) + bias).softmax();
+    return probs;
+}
+
+Tensor Layers::singleLinearRelu(Tensor input, Tensor weight, Tensor bias){
     auto probs = (input.matmul(weight) + bias).relu();
     return probs;
 }
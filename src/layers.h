@@ -1,17 +1,85 @@
 /**
  * @file layers.h
  * @brief Defines layers methods.
- * 
+ *
  * @author Zoe Lurie
  * @date November 2024
  */
 
+#ifndef LAYERSH
+#define LAYERSH
+
+#include <memory>
+#include <vector>
+
 #include "tensor.h"
 
 namespace Layers{
 
+    enum activationOptions {NOACTIVATION, RELUACTIVATION, SOFTMAXACTIVATION};
+
+    /**
+     * A fully connected layer, activation(input.matmul(weight) + bias), that owns its weight and
+     * bias so they can be trained. Weights are drawn once when the layer is made.
+     *
+     * When quantized, forward multiplies by an INT8 copy of the weight for inference. The copy is
+     * cached and made again only after the weight changes, for example by an Optimizer step.
+     */
+    class Linear{
+        private:
+            Tensor weight, bias;
+            activationOptions activation;
+
+            bool quantized = false;
+            std::shared_ptr<Tensor> quantizedWeight;
+            size_t quantizedVersion = 0;
+
+        public:
+            // Weight of shape {inputSize, outputSize} and bias of shape {outputSize}, both saving gradients
+            Linear(size_t inputSize, size_t outputSize, activationOptions activation = NOACTIVATION,
+                    deviceOptions device = DEFAULTDEVICE, dtypeOptions dtype = FLOAT64);
+
+            // Uses the given (trained) weight and bias
+            Linear(Tensor weight, Tensor bias, activationOptions activation = NOACTIVATION);
+
+            Tensor forward(Tensor input);
+            Tensor operator()(Tensor input) {return forward(input);}
+
+            // Weight and bias, to be passed to an Optimizer
+            std::vector<Tensor> parameters();
+
+            Tensor getWeight() {return weight;}
+            Tensor getBias() {return bias;}
+
+            void setQuantized(bool quantized);
+    };
+
+    // Relu layers of the intermediate sizes followed by an output layer with the given activation
+    class MultiLayer{
+        private:
+            std::vector<Linear> layers;
+
+        public:
+            MultiLayer(size_t inputSize, size_t outputSize, std::vector<size_t> intermediateSizes,
+                    activationOptions outputActivation = SOFTMAXACTIVATION, deviceOptions device = DEFAULTDEVICE, dtypeOptions dtype = FLOAT64);
+
+            Tensor forward(Tensor input);
+            Tensor operator()(Tensor input) {return forward(input);}
+
+            std::vector<Tensor> parameters();
+            std::vector<Linear>& getLayers() {return layers;}
+
+            void setQuantized(bool quantized);
+    };
+
+    // These draw new random weights on every call, use Linear or MultiLayer to train a model
     Tensor singleLinearSoftmax(Tensor input, size_t inputSize, size_t outputSize);
     Tensor singleLinearRelu(Tensor input, size_t inputSize, size_t outputSize);
+
+    // Apply a layer with given (trained) weights, which may be quantized with Tensor::quantize for inference
+    Tensor singleLinearSoftmax(Tensor input, Tensor weight, Tensor bias);
+    Tensor singleLinearRelu(Tensor input, Tensor weight, Tensor bias);
     Tensor multiLayer(Tensor input, size_t inputSize, size_t outputSize, std::vector<size_t> intermediateSizes);
 }
 
+#endif
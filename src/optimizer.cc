@@ -0,0 +1,145 @@
+/**
+ * @file optimizer.cc
+ * @brief Implements the methods of the Optimizer class.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <memory>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+
+#include "optimizer.h"
+#include "tensor.h"
+#include "tensorcontents.cc"
+#include "tensormemorypool.h"
+
+Optimizer::Optimizer(std::vector<Tensor> parameters, optimizerOptions method, double learningRate, double beta1, double beta2, double epsilon)
+    : method(method), learningRate(learningRate), beta1(beta1), beta2(beta2), epsilon(epsilon) {
+    std::unordered_set<TensorContents *> seen;
+    for(auto& p : parameters){
+        TensorContentsPtr& c = p.contents;
+        if(!c->saveGradient) throw std::runtime_error("Optimizer parameters must have saveGradient set");
+        if(!c->getArgs().empty()) throw std::runtime_error("Optimizer parameters cannot be the result of an operation");
+        if(c->dtype == INT8) throw std::runtime_error("INT8 tensors cannot be optimized");
+        if(c->packedGradient) throw std::runtime_error("Tensor is already a parameter of another Optimizer");
+        if(!seen.insert(c.get()).second) continue;
+
+        size_t g = 0;
+        while(g < groups.size() && (groups[g].dtype != c->dtype || groups[g].onGPU != c->onGPU)) ++g;
+        if(g == groups.size()){
+            groups.push_back(ParameterGroup());
+            groups[g].dtype = c->dtype;
+            groups[g].onGPU = c->onGPU;
+        }
+        groups[g].parameters.push_back(p);
+    }
+    for(auto& group : groups) pack(group);
+}
+
+/**
+ * Moves the data of each parameter into one buffer and points the parameter at its slice. Each
+ * slice starts on a POOLALIGNMENT boundary, the padding between slices is zero and stays zero.
+ * Gradients found before the optimizer was made are copied into the packed gradient buffer.
+ */
+void Optimizer::pack(ParameterGroup& group){
+    bool onGPU = group.onGPU;
+    size_t typeSize = TensorContents::dtypeSize(group.dtype);
+    size_t align = POOLALIGNMENT / typeSize;
+
+    std::vector<size_t> offsets;
+    for(auto& p : group.parameters){
+        offsets.push_back(group.dataLen);
+        group.dataLen += (p.contents->dataLen + align - 1) / align * align;
+    }
+
+    size_t numBytes = group.dataLen * typeSize;
+    group.params = TensorMemoryPool::allocate(numBytes, onGPU);
+    group.grads = TensorMemoryPool::allocate(numBytes, onGPU);
+    if(method != SGD) group.state1 = TensorMemoryPool::allocate(numBytes, onGPU);
+    if(method == ADAM) group.state2 = TensorMemoryPool::allocate(numBytes, onGPU);
+
+    DTYPESWITCH(group.dtype,
+        for(auto buffer : {group.params, group.grads, group.state1, group.state2})
+            if(buffer) CALLFUNC(Zeroes, (TDATA(buffer), group.dataLen));
+
+        for(size_t i = 0; i < group.parameters.size(); ++i){
+            Tensor& p = group.parameters[i];
+            TensorContentsPtr& c = p.contents;
+
+            vDataPtr data = p.eval();
+            if(!c->isContiguous()) data = c->contiguousData();
+            T * slice = TDATA(group.params) + offsets[i];
+            CALLFUNC(Copy, (slice, TDATA(data), c->dataLen));
+            c->data = vDataPtr(group.params, slice);
+            c->strides.clear();
+            ++*c->versionCounter();
+
+            T * gradSlice = TDATA(group.grads) + offsets[i];
+            if(c->foundGradient) CALLFUNC(Copy, (gradSlice, TDATA(c->gradient->eval()), c->dataLen));
+            c->gradient = std::make_shared<Tensor>(Tensor(std::make_shared<TensorContents>(c->dims, vDataPtr(group.grads, gradSlice), false, onGPU, c->dtype)));
+            c->foundGradient = true;
+            c->packedGradient = true;
+        }
+    )
+}
+
+Optimizer Optimizer::sgd(std::vector<Tensor> parameters, double learningRate){
+    return Optimizer(parameters, SGD, learningRate, 0, 0, 0);
+}
+
+Optimizer Optimizer::momentum(std::vector<Tensor> parameters, double learningRate, double momentum){
+    return Optimizer(parameters, MOMENTUM, learningRate, momentum, 0, 0);
+}
+
+Optimizer Optimizer::adam(std::vector<Tensor> parameters, double learningRate, double beta1, double beta2, double epsilon){
+    return Optimizer(parameters, ADAM, learningRate, beta1, beta2, epsilon);
+}
+
+void Optimizer::step(){
+    ++numSteps;
+    for(auto& group : groups){
+        #ifdef CUDA
+            bool onGPU = group.onGPU;
+        #endif
+        DTYPESWITCH(group.dtype,
+            T * params = TDATA(group.params);
+            T * grads = TDATA(group.grads);
+            switch(method){
+                case SGD:
+                    CALLFUNC(SgdStep, (params, grads, (T) learningRate, group.dataLen));
+                    break;
+                case MOMENTUM:
+                    CALLFUNC(MomentumStep, (params, grads, TDATA(group.state1), (T) learningRate, (T) beta1, group.dataLen));
+                    break;
+                case ADAM:
+                    CALLFUNC(AdamStep, (params, grads, TDATA(group.state1), TDATA(group.state2), (T) learningRate, (T) beta1, (T) beta2, (T) epsilon, numSteps, group.dataLen));
+                    break;
+            }
+        )
+        // Views of a parameter hold the values from before the step and are recomputed when read
+        for(auto& p : group.parameters) ++*p.contents->versionCounter();
+    }
+}
+
+void Optimizer::zeroGrad(){
+    for(auto& group : groups){
+        #ifdef CUDA
+            bool onGPU = group.onGPU;
+        #endif
+        DTYPESWITCH(group.dtype,
+            CALLFUNC(Zeroes, (TDATA(group.grads), group.dataLen));
+        )
+        for(auto& p : group.parameters) ++*p.contents->gradient->contents->versionCounter();
+    }
+}
+
+void Optimizer::setLearningRate(double learningRate){
+    this->learningRate = learningRate;
+}
+
+double Optimizer::getLearningRate(){
+    return learningRate;
+}
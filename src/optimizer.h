@@ -0,0 +1,106 @@
+/**
+ * @file optimizer.h
+ * @brief Defines the Optimizer class, which updates the parameters of a model in place from their
+ * gradients with SGD, SGD with momentum, or Adam.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef OPTIMIZERH
+#define OPTIMIZERH
+
+#include <vector>
+
+#include "tensor.h"
+
+enum optimizerOptions {SGD, MOMENTUM, ADAM};
+
+/**
+ * @brief Updates a set of parameters from their gradients, one fused kernel per step.
+ *
+ * The parameters are packed into one contiguous buffer per dtype and device and each parameter's
+ * data becomes a slice of it. Their gradients, and the optimizer state (momentum velocity or the
+ * Adam moments), are packed in the same layout, so a step is a single pass over flat buffers.
+ * Backward adds gradients of the parameters into the packed gradient buffer, where they accumulate
+ * until zeroGrad is called.
+ *
+ * A step writes the parameters in place. Tensors computed from the parameters that were already
+ * evaluated keep the values they had, except views, which are recomputed from the new values.
+ */
+class Optimizer{
+    private:
+        // Parameters sharing a dtype and device, with their packed buffers
+        struct ParameterGroup{
+            dtypeOptions dtype;
+            bool onGPU;
+            size_t dataLen = 0;
+            std::vector<Tensor> parameters;
+            vDataPtr params, grads, state1, state2;
+        };
+
+        std::vector<ParameterGroup> groups;
+        optimizerOptions method;
+        // beta1 holds the momentum of MOMENTUM
+        double learningRate, beta1, beta2, epsilon;
+        size_t numSteps = 0;
+
+        Optimizer(std::vector<Tensor> parameters, optimizerOptions method, double learningRate, double beta1, double beta2, double epsilon);
+        void pack(ParameterGroup& group);
+
+    public:
+        /**
+         * @brief Plain gradient descent, parameter -= learningRate * gradient.
+         *
+         * @param parameters Tensors to optimize, which must be created with saveGradient set and not be the result of an operation.
+         * @param learningRate Step size.
+         * @return The optimizer.
+         */
+        static Optimizer sgd(std::vector<Tensor> parameters, double learningRate);
+
+        /**
+         * @brief Gradient descent with momentum, velocity = momentum * velocity + gradient and parameter -= learningRate * velocity.
+         *
+         * @param parameters Tensors to optimize, which must be created with saveGradient set and not be the result of an operation.
+         * @param learningRate Step size.
+         * @param momentum Decay of the velocity (default: 0.9).
+         * @return The optimizer.
+         */
+        static Optimizer momentum(std::vector<Tensor> parameters, double learningRate, double momentum = 0.9);
+
+        /**
+         * @brief Adam, with bias-corrected estimates of the first and second moments of the gradient.
+         *
+         * @param parameters Tensors to optimize, which must be created with saveGradient set and not be the result of an operation.
+         * @param learningRate Step size (default: 0.001).
+         * @param beta1 Decay of the first moment (default: 0.9).
+         * @param beta2 Decay of the second moment (default: 0.999).
+         * @param epsilon Added to the denominator for numerical stability (default: 1e-8).
+         * @return The optimizer.
+         */
+        static Optimizer adam(std::vector<Tensor> parameters, double learningRate = 0.001, double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8);
+
+        /**
+         * @brief Updates every parameter in place from its accumulated gradient.
+         */
+        void step();
+
+        /**
+         * @brief Sets the accumulated gradients of every parameter to zero.
+         */
+        void zeroGrad();
+
+        /**
+         * @brief Changes the step size used by later steps, for learning rate schedules.
+         * @param learningRate The new step size.
+         */
+        void setLearningRate(double learningRate);
+
+        /**
+         * @brief Returns the current step size.
+         * @return The learning rate.
+         */
+        double getLearningRate();
+};
+
+#endif
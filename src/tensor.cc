@@ -6,12 +6,18 @@
  * @date November 2024
  */
 
+#include <algorithm>
 #include <memory>
 #include <stdexcept>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "tensor.h"
 #include "tensorcontents.cc"
+#include "tensormemorypool.h"
+#include "tensorprofiler.h"
+#include "tensorthreadpool.h"
 
 #ifdef CUDA
     #include "tensorgpuutility.h"
@@ -23,25 +29,27 @@
 
 #define MAKET(NAME, ARGS) Tensor(std::make_shared<Tensor##NAME>(Tensor##NAME ARGS))
 
-Tensor::Tensor(vDims dims, std::vector<double> data, bool saveGradient, deviceOptions device) {
+Tensor::Tensor(vDims dims, std::vector<double> data, bool saveGradient, deviceOptions device, dtypeOptions dtype) {
+    if(dtype == INT8) throw std::runtime_error("INT8 tensors can only be created by quantize");
     bool onGPU = device == GPU;
-    std::shared_ptr<double> retDataPtr;
+    vDataPtr retDataPtr = TensorMemoryPool::allocate(data.size() * sizeof(double));
+    std::copy(data.begin(), data.end(), static_cast<double *>(retDataPtr.get()));
+    retDataPtr = TensorContents::convertData(retDataPtr, FLOAT64, dtype, data.size(), false);
     if(onGPU){
         #ifdef CUDA
-            retDataPtr = TensorGPUUtility::toGPU(data.data(), data.size());
+            retDataPtr = TensorGPUUtility::convert(retDataPtr, true, data.size() * TensorContents::dtypeSize(dtype));
         #else
             throw std::runtime_error("Cannot select GPU since not compiled with CUDA");
         #endif
     }
-    else{
-        retDataPtr = std::shared_ptr<double>(new double[data.size()], std::default_delete<double[]>());
-        std::copy(data.begin(), data.end(), retDataPtr.get());
-    }
     contents = std::make_shared<TensorContents>(
-            TensorContents(dims, retDataPtr, saveGradient, onGPU));
+            TensorContents(dims, retDataPtr, saveGradient, onGPU, dtype));
 }
 
-Tensor::Tensor(TensorContentsPtr ptr) : contents(ptr) {}
+Tensor::Tensor(TensorContentsPtr ptr) : contents(ptr) {
+    for(auto& arg : contents->getArgs())
+        arg.contents->addConsumer(contents);
+}
 
 #ifdef OMP
     void Tensor::setOmpNumThreads(int numThreads){
@@ -49,22 +57,98 @@ Tensor::Tensor(TensorContentsPtr ptr) : contents(ptr) {}
     }
 #endif
 
+void Tensor::setInterOpNumThreads(size_t numThreads){
+    TensorThreadPool::setNumWorkers(numThreads > 1 ? numThreads - 1 : 0);
+}
+
 vDataPtr Tensor::eval(){
-    if(!contents->evaluated){
-        //contents->optimize();
-        contents->eval();
-    }
+    if(!contents->evaluated || contents->isStale()) TensorContents::evaluate(contents);
     return contents->data;
 }
 
+bool Tensor::gradEnabled = true;
+
+uint64_t Tensor::randomSeed = 7;
+uint64_t Tensor::randomStreams = 0;
+
+// splitmix64 of the seed and stream, so keys of consecutive tensors are unrelated
+uint64_t Tensor::nextRandomKey(){
+    uint64_t z = randomSeed + ++randomStreams * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void Tensor::setSeed(uint64_t seed){
+    randomSeed = seed;
+    randomStreams = 0;
+}
+
 void Tensor::backward(Tensor grad){
     if(contents->dims != grad.contents->dims) throw std::runtime_error("Dimenions of grad and tensor must match in backward");
     if(!contents->saveGradient) return;
 
-    if(!contents->gradient) contents->gradient = std::make_shared<Tensor>(grad);
-    else contents->gradient = std::make_shared<Tensor>(*(contents->gradient) + grad);
-    contents->backward(grad);
-    contents->foundGradient = true;
+    // Post-order over the nodes that save gradients, reversed so every node follows its consumers
+    std::vector<TensorContentsPtr> order;
+    std::unordered_set<TensorContents *> visited;
+    std::vector<std::pair<TensorContentsPtr, bool>> stack = {{contents, false}};
+    while(!stack.empty()){
+        auto top = stack.back();
+        stack.pop_back();
+        if(top.second){
+            order.push_back(top.first);
+            continue;
+        }
+        if(!visited.insert(top.first.get()).second) continue;
+        stack.push_back({top.first, true});
+        for(auto& arg : top.first->getArgs())
+            if(arg.contents->saveGradient && !visited.count(arg.contents.get()))
+                stack.push_back({arg.contents, false});
+    }
+    std::reverse(order.begin(), order.end());
+
+    // Restores gradient tracking and drops partial gradients even if a backward function throws
+    struct BackwardPass{
+        std::vector<TensorContentsPtr>& order;
+
+        BackwardPass(std::vector<TensorContentsPtr>& order) : order(order) {gradEnabled = false;}
+        ~BackwardPass(){
+            gradEnabled = true;
+            for(auto& node : order){
+                node->gradientSum.reset();
+                node->gradientData.reset();
+            }
+        }
+    } pass(order);
+
+    contents->accumulateGradient(grad);
+    for(auto& node : order){
+        if(!node->gradientSum) continue;
+        std::unique_ptr<TensorProfiler::Scope> scope;
+        if(TensorProfiler::isEnabled())
+            scope.reset(new TensorProfiler::Scope("gradfn", opName(node->getOp()), {node->dims}));
+        node->backward(*(node->gradientSum));
+    }
+
+    // Gradients from earlier calls to backward are added to, not overwritten
+    std::vector<TensorContentsPtr> sums;
+    for(auto& node : order){
+        if(!node->gradientSum) continue;
+        if(node->gradient && !node->packedGradient) node->accumulateGradient(*(node->gradient));
+        sums.push_back(node->gradientSum->contents);
+    }
+    TensorContents::evaluate(sums, "backward");
+
+    for(auto& node : order){
+        if(!node->gradientSum) continue;
+        node->gradientData = node->evalTensor(*(node->gradientSum));
+        if(node->packedGradient){
+            node->addPackedGradient();
+            continue;
+        }
+        node->gradient = std::make_shared<Tensor>(Tensor(std::make_shared<TensorContents>(node->dims, node->gradientData, false, node->onGPU, node->dtype)));
+        node->foundGradient = true;
+    }
 }
 
 Tensor Tensor::getGradient(){
@@ -74,22 +158,31 @@ Tensor Tensor::getGradient(){
 }
 
 
+size_t Tensor::getVersion(){
+    // Does not create a counter, since a node that has one no longer adopts the counter of an input it aliases
+    return contents->bufferVersion ? *contents->bufferVersion : 0;
+}
+
 vDims Tensor::getDims(){
     return contents->dims;
 }
 
+dtypeOptions Tensor::getDtype(){
+    return contents->dtype;
+}
+
 std::vector<double> Tensor::getData(){
-    eval();
+    if(contents->dtype == INT8) return cast(FLOAT64).getData();
+    vDataPtr data = eval();
+    if(!contents->isContiguous()) data = contents->contiguousData();
     std::vector<double> ret;
     ret.resize(contents->dataLen);
 
     #ifdef CUDA
-        if(contents->onGPU) TensorGPUUtility::toCPU(ret.data(), contents->data.get(), contents->dataLen);
-        else ret.insert(ret.begin(), contents->data.get(), contents->data.get() + contents->dataLen);
-    #else
-        ret.insert(ret.begin(), contents->data.get(), contents->data.get() + contents->dataLen);
+        if(contents->onGPU) data = TensorGPUUtility::convert(data, false, contents->dataLen * TensorContents::dtypeSize(contents->dtype));
     #endif
-
+    data = TensorContents::convertData(data, contents->dtype, FLOAT64, contents->dataLen, false);
+    std::copy(static_cast<double *>(data.get()), static_cast<double *>(data.get()) + contents->dataLen, ret.begin());
 
     return ret;
 }
@@ -101,163 +194,339 @@ void Tensor::print(){
 }
 
 
+// NumPy broadcasting: dimensions are aligned at the end and each pair must match or contain a one
 bool isBroadcastable(vDims d1, vDims d2){
-    return (d1 == d2) ||
-        (d1.size() == 1 && d1[0] == 1) ||
-        (d2.size() == 1 && d2[0] == 1);
+    for(size_t i = 0; i < d1.size() && i < d2.size(); ++i){
+        size_t a = d1[d1.size() - 1 - i], b = d2[d2.size() - 1 - i];
+        if(a != b && a != 1 && b != 1) return false;
+    }
+    return true;
 }
 
 vDims getBroadcastDims(vDims d1, vDims d2){
     if(d1 == d2) return d1;
     if(d1.size() == 1 && d1[0] == 1) return d2;
-    return d1;
+    if(d2.size() == 1 && d2[0] == 1) return d1;
+
+    vDims ret(d1.size() > d2.size() ? d1.size() : d2.size());
+    for(size_t i = 0; i < ret.size(); ++i){
+        size_t a = i < d1.size() ? d1[d1.size() - 1 - i] : 1;
+        size_t b = i < d2.size() ? d2[d2.size() - 1 - i] : 1;
+        ret[ret.size() - 1 - i] = a > b ? a : b;
+    }
+    return ret;
 }
 
 
-Tensor Tensor::zeroes(vDims dims, bool saveGradient, deviceOptions device){
+Tensor Tensor::zeroes(vDims dims, bool saveGradient, deviceOptions device, dtypeOptions dtype){
     bool onGPU = device == GPU;
-    return MAKET(Zeroes, (dims, saveGradient, onGPU));
+    return MAKET(Zeroes, (dims, saveGradient, onGPU, dtype));
 }
 
-Tensor Tensor::ones(vDims dims, bool saveGradient, deviceOptions device){
+Tensor Tensor::ones(vDims dims, bool saveGradient, deviceOptions device, dtypeOptions dtype){
     bool onGPU = device == GPU;
-    return MAKET(Ones, (dims, saveGradient, onGPU));
+    return MAKET(Ones, (dims, saveGradient, onGPU, dtype));
 }
 
-Tensor Tensor::fill(vDims dims, double n, bool saveGradient, deviceOptions device){
+Tensor Tensor::fill(vDims dims, double n, bool saveGradient, deviceOptions device, dtypeOptions dtype){
     bool onGPU = device == GPU;
-    return MAKET(Fill, (dims, saveGradient, n, onGPU));
+    return MAKET(Fill, (dims, saveGradient, n, onGPU, dtype));
 }
 
-Tensor Tensor::fillRandom(vDims dims, double mean, double stddev, bool saveGradient, deviceOptions device){
+Tensor Tensor::fillRandom(vDims dims, double mean, double stddev, bool saveGradient, deviceOptions device, dtypeOptions dtype){
     bool onGPU = device == GPU;
-    if(onGPU) throw std::runtime_error("fillRandom is not available on GPU");
-    return MAKET(FillRandom, (dims, saveGradient, mean, stddev, onGPU));
+    return MAKET(FillRandom, (dims, saveGradient, mean, stddev, nextRandomKey(), onGPU, dtype));
 }
 
 Tensor Tensor::neg(bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    Tensor ret =  MAKET(Neg, (contents->dims, saveGradient, *this, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    Tensor ret =  MAKET(Neg, (contents->dims, saveGradient, *this, onGPU, dtype));
     return ret;
 }
 
 Tensor Tensor::add(Tensor x, bool saveGradient, deviceOptions device){
     if(!isBroadcastable(contents->dims, x.contents->dims)) throw std::runtime_error("Mismatched dimensions in Tensor::add");
-    saveGradient = saveGradient || contents->saveGradient || x.contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient || x.contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && (contents->onGPU || x.contents->onGPU));
-    return MAKET(Add, (getBroadcastDims(contents->dims, x.contents->dims), saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::promoteDtype(contents->dtype, x.contents->dtype);
+    return MAKET(Add, (getBroadcastDims(contents->dims, x.contents->dims), saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::add(double x, bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(AddScalar, (contents->dims, saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(AddScalar, (contents->dims, saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::subtract(Tensor x, bool saveGradient, deviceOptions device){
     if(!isBroadcastable(contents->dims, x.contents->dims)) throw std::runtime_error("Mismatched dimensions in Tensor::add");
-    saveGradient = saveGradient || contents->saveGradient || x.contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient || x.contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && (contents->onGPU || x.contents->onGPU));
-    return MAKET(Subtract, (getBroadcastDims(contents->dims, x.contents->dims), saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::promoteDtype(contents->dtype, x.contents->dtype);
+    return MAKET(Subtract, (getBroadcastDims(contents->dims, x.contents->dims), saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::subtract(double x, bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(SubtractScalar, (contents->dims, saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(SubtractScalar, (contents->dims, saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::elementwiseMult(Tensor x, bool saveGradient, deviceOptions device){
     if(!isBroadcastable(contents->dims, x.contents->dims)) throw std::runtime_error("Mismatched dimensions in Tensor::elementwiseMult");
-    saveGradient = saveGradient || contents->saveGradient || x.contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient || x.contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && (contents->onGPU || x.contents->onGPU));
-    return MAKET(ElementwiseMult, (getBroadcastDims(contents->dims, x.contents->dims), saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::promoteDtype(contents->dtype, x.contents->dtype);
+    return MAKET(ElementwiseMult, (getBroadcastDims(contents->dims, x.contents->dims), saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::elementwiseMult(double x, bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(ElementwiseMultScalar, (contents->dims, saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(ElementwiseMultScalar, (contents->dims, saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::elementwiseDivision(Tensor x, bool saveGradient, deviceOptions device){
     if(!isBroadcastable(contents->dims, x.contents->dims)) throw std::runtime_error("Mismatched dimensions in Tensor::elementwiseDivision");
-    saveGradient = saveGradient || contents->saveGradient || x.contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient || x.contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && (contents->onGPU || x.contents->onGPU));
-    return MAKET(ElementwiseDivision, (getBroadcastDims(contents->dims, x.contents->dims), saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::promoteDtype(contents->dtype, x.contents->dtype);
+    return MAKET(ElementwiseDivision, (getBroadcastDims(contents->dims, x.contents->dims), saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::elementwiseDivision(double x, bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(ElementwiseDivisionScalar, (contents->dims, saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(ElementwiseDivisionScalar, (contents->dims, saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::relu(bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(Relu, (contents->dims, saveGradient, *this, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Relu, (contents->dims, saveGradient, *this, onGPU, dtype));
+}
+
+Tensor Tensor::dropout(double p, bool saveGradient, deviceOptions device){
+    if(p < 0 || p >= 1) throw std::runtime_error("Dropout probability must be in [0, 1)");
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
+    bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Dropout, (contents->dims, saveGradient, *this, p, nextRandomKey(), onGPU, dtype));
 }
 
 Tensor Tensor::binarize(bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(Binarize, (contents->dims, saveGradient, *this, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Binarize, (contents->dims, saveGradient, *this, onGPU, dtype));
 }
 
 Tensor Tensor::pow(double x, bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(Pow, (contents->dims, saveGradient, *this, x, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Pow, (contents->dims, saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::matmul(Tensor x, bool saveGradient, deviceOptions device){
     vDims dims = contents->dims;
     vDims xdims = x.contents->dims;
-    if(xdims.size() != 2){
-      throw std::runtime_error("The right operand of matmul must be 2D tensors");
-    }
-    if(dims.size() != 2 && dims.size() != 3){
-      throw std::runtime_error("The left operand of matmul must be 2D tensors or batched 2D tensors");
+    if((dims.size() != 2 && dims.size() != 3) || (xdims.size() != 2 && xdims.size() != 3)){
+      throw std::runtime_error("The operands of matmul must be 2D tensors or batched 2D tensors");
     }
-    if(dims[dims.size() - 1] != xdims[0]){
+    if(dims[dims.size() - 1] != xdims[xdims.size() - 2]){
       throw std::runtime_error("Mismatched matmul matrix dimensions");
     }
 
-    saveGradient = saveGradient || contents->saveGradient || x.contents->saveGradient;
+    size_t batch = dims.size() == 3 ? dims[0] : 1;
+    size_t xbatch = xdims.size() == 3 ? xdims[0] : 1;
+    if(batch != xbatch && batch != 1 && xbatch != 1){
+      throw std::runtime_error("Mismatched matmul batch dimensions");
+    }
+
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient || x.contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && (contents->onGPU || x.contents->onGPU));
+    dtypeOptions dtype = TensorContents::promoteDtype(contents->dtype, x.contents->dtype);
 
     vDims retdims;
-    if(dims.size() == 2) retdims = {dims[0], xdims[1]};
-    else retdims = {dims[0], dims[1], xdims[1]};
+    if(dims.size() == 2 && xdims.size() == 2) retdims = {dims[0], xdims[1]};
+    else retdims = {batch > xbatch ? batch : xbatch, dims[dims.size() - 2], xdims[xdims.size() - 1]};
 
-    return MAKET(Matmul, (retdims, saveGradient, *this, x, onGPU));
+    return MAKET(Matmul, (retdims, saveGradient, *this, x, onGPU, dtype));
 }
 
 Tensor Tensor::reduceSum(bool saveGradient, deviceOptions device){
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(ReduceSum, ({1}, saveGradient, *this, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(ReduceSum, ({1}, saveGradient, *this, onGPU, dtype));
 }
 
-Tensor Tensor::transpose(bool saveGradient, deviceOptions device){
+Tensor Tensor::reduceAxes(std::vector<size_t> axes, bool keepDims, bool takeMax, bool takeMean, bool saveGradient, deviceOptions device){
+    vDims dims = contents->dims;
+    if(axes.empty()) for(size_t d = 0; d < dims.size(); ++d) axes.push_back(d);
+    std::sort(axes.begin(), axes.end());
+    axes.erase(std::unique(axes.begin(), axes.end()), axes.end());
+    if(axes.back() >= dims.size()) throw std::runtime_error("Axis out of range in reduction");
+
+    size_t count = 1;
     vDims retDims;
-    if(contents->dims.size() == 2) retDims = {contents->dims[1], contents->dims[0]};
-    else if(contents->dims.size() == 3) retDims = {contents->dims[0], contents->dims[2], contents->dims[1]};
-    else throw std::runtime_error("The tensor must be 2d or batched 2d tensors in transpose");
+    for(size_t d = 0; d < dims.size(); ++d){
+        bool reduced = std::binary_search(axes.begin(), axes.end(), d);
+        if(reduced) count *= dims[d];
+        if(!reduced) retDims.push_back(dims[d]);
+        else if(keepDims) retDims.push_back(1);
+    }
+    if(retDims.empty()) retDims = {1};
+
+    // Axes that are not consecutive are moved behind the kept ones first, so the kernel always
+    // reduces one block of dimensions. The kept ones stay in order, so the output is laid out the same.
+    Tensor input = *this;
+    if(axes.back() - axes.front() + 1 != axes.size()){
+        std::vector<size_t> order;
+        for(size_t d = 0; d < dims.size(); ++d)
+            if(!std::binary_search(axes.begin(), axes.end(), d)) order.push_back(d);
+        size_t firstAxis = order.size();
+        order.insert(order.end(), axes.begin(), axes.end());
+        input = permute(order, saveGradient, device);
+        for(size_t i = 0; i < axes.size(); ++i) axes[i] = firstAxis + i;
+    }
 
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(Transpose, (retDims, saveGradient, *this, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Reduce, (retDims, saveGradient, input, axes, takeMax ? REDUCTIONMAX : REDUCTIONSUM,
+            takeMean ? 1.0 / count : 1.0, onGPU, dtype));
+}
+
+Tensor Tensor::sum(std::vector<size_t> axes, bool keepDims, bool saveGradient, deviceOptions device){
+    return reduceAxes(axes, keepDims, false, false, saveGradient, device);
+}
+
+Tensor Tensor::mean(std::vector<size_t> axes, bool keepDims, bool saveGradient, deviceOptions device){
+    return reduceAxes(axes, keepDims, false, true, saveGradient, device);
+}
+
+Tensor Tensor::max(std::vector<size_t> axes, bool keepDims, bool saveGradient, deviceOptions device){
+    return reduceAxes(axes, keepDims, true, false, saveGradient, device);
+}
+
+Tensor Tensor::softmax(bool saveGradient, deviceOptions device){
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
+    bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Softmax, (contents->dims, saveGradient, *this, onGPU, dtype));
+}
+
+Tensor Tensor::argmax(deviceOptions device){
+    vDims dims(contents->dims.begin(), contents->dims.end() - 1);
+    if(dims.empty()) dims = {1};
+
+    bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Argmax, (dims, false, *this, onGPU, dtype));
+}
+
+Tensor Tensor::crossEntropy(Tensor labels, bool saveGradient, deviceOptions device){
+    vDims dims = contents->dims;
+    vDims labelDims = labels.contents->dims;
+    if(labelDims != dims){
+        if(labels.contents->dataLen * dims.back() != contents->dataLen) throw std::runtime_error("crossEntropy needs one label per row of logits");
+        labelDims = vDims(dims.begin(), dims.end() - 1);
+        if(labelDims.empty()) labelDims = {1};
+        if(labelDims != labels.contents->dims) labels = labels.reshape(labelDims);
+    }
+
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
+    bool onGPU = device == GPU || (device == DEFAULTDEVICE && (contents->onGPU || labels.contents->onGPU));
+    dtypeOptions dtype = TensorContents::promoteDtype(contents->dtype, labels.contents->dtype);
+    return MAKET(CrossEntropy, ({1}, saveGradient, *this, labels, onGPU, dtype));
+}
+
+Tensor Tensor::transpose(bool saveGradient, deviceOptions device){
+    vDims retDims = contents->dims;
+    if(retDims.size() < 2) throw std::runtime_error("The tensor must be at least 2d in transpose");
+    std::swap(retDims[retDims.size() - 2], retDims[retDims.size() - 1]);
+
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
+    bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Transpose, (retDims, saveGradient, *this, onGPU, dtype));
+}
+
+Tensor Tensor::permute(std::vector<size_t> order, bool saveGradient, deviceOptions device){
+    if(order.size() != contents->dims.size()) throw std::runtime_error("permute needs one index per dimension");
+    vDims retDims(order.size());
+    std::vector<bool> seen(order.size(), false);
+    for(size_t i = 0; i < order.size(); ++i){
+        if(order[i] >= order.size() || seen[order[i]]) throw std::runtime_error("The order of permute must be a permutation of the dimensions");
+        seen[order[i]] = true;
+        retDims[i] = contents->dims[order[i]];
+    }
+
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
+    bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Permute, (retDims, saveGradient, *this, order, onGPU, dtype));
+}
+
+Tensor Tensor::slice(size_t dim, size_t start, size_t end, size_t step, bool saveGradient, deviceOptions device){
+    if(dim >= contents->dims.size()) throw std::runtime_error("Dimension out of range in slice");
+    if(end > contents->dims[dim]) end = contents->dims[dim];
+    if(start >= end || step == 0) throw std::runtime_error("slice must select at least one index");
+    vDims retDims = contents->dims;
+    retDims[dim] = (end - start + step - 1) / step;
+
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
+    bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Slice, (retDims, saveGradient, *this, dim, start, step, onGPU, dtype));
+}
+
+Tensor Tensor::narrow(size_t dim, size_t start, size_t length, bool saveGradient, deviceOptions device){
+    if(dim >= contents->dims.size() || start + length > contents->dims[dim]) throw std::runtime_error("narrow is out of range");
+    return slice(dim, start, start + length, 1, saveGradient, device);
+}
+
+Tensor Tensor::cast(dtypeOptions dtype, bool saveGradient, deviceOptions device){
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
+    bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
+    return MAKET(Cast, (contents->dims, saveGradient, *this, onGPU, dtype));
+}
+
+Tensor Tensor::quantize(){
+    if(contents->dtype == INT8) return *this;
+    if(contents->onGPU) throw std::runtime_error("quantize is not available on GPU");
+
+    vDataPtr data = eval();
+    if(!contents->isContiguous()) data = contents->contiguousData();
+    size_t channels = contents->dims.back();
+    vDataPtr retDataPtr = TensorMemoryPool::allocate(contents->dataLen * sizeof(int8_t));
+    vDataPtr scales = TensorMemoryPool::allocate(channels * sizeof(float));
+    DTYPESWITCH(contents->dtype,
+        cpuQuantize<T>(static_cast<int8_t *>(retDataPtr.get()), static_cast<float *>(scales.get()), TDATA(data),
+                contents->dataLen / channels, channels);
+    )
+
+    auto ret = std::make_shared<TensorContents>(contents->dims, retDataPtr, false, false, INT8);
+    ret->scales = scales;
+    return Tensor(ret);
 }
 
 Tensor Tensor::reshape(vDims dims, bool saveGradient, deviceOptions device){
     size_t newDataLen = TensorContents::calculateDataLen(dims);
     if(newDataLen != contents->dataLen) throw std::runtime_error("Dimensions do not match in reshape");
 
-    saveGradient = saveGradient || contents->saveGradient;
+    saveGradient = gradEnabled && (saveGradient || contents->saveGradient);
     bool onGPU = device == GPU || (device == DEFAULTDEVICE && contents->onGPU);
-    return MAKET(Reshape, (dims, saveGradient, *this, onGPU));
+    dtypeOptions dtype = TensorContents::computeDtype(contents->dtype);
+    return MAKET(Reshape, (dims, saveGradient, *this, onGPU, dtype));
 }
 
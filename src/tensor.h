@@ -16,32 +16,53 @@
 #ifndef TENSORH
 #define TENSORH
 
+#include <cstdint>
 #include <vector>
 #include <memory>
 
 struct TensorContents;
 
 typedef std::vector<size_t> vDims;
-typedef std::shared_ptr<double> vDataPtr;
+typedef std::shared_ptr<void> vDataPtr;
 typedef std::shared_ptr<TensorContents> TensorContentsPtr;
 
 enum deviceOptions {CPU, GPU, DEFAULTDEVICE};
 
+// Element type of a tensor's data. Operations on mixed float32 and float64 tensors produce float64.
+// INT8 tensors are made by quantize and are dequantized by every operation except matmul.
+enum dtypeOptions {FLOAT64, FLOAT32, INT8};
+
 /**
  * @brief Represents a multidimensional array with support for gradient computations and device allocation.
  * 
  * Provides methods for tensor manipulation, mathematical operations, and gradient-based optimization.
+ * Binary elementwise operations broadcast their operands NumPy style: dimensions are aligned at
+ * the end and a dimension of size one is stretched to match the other operand.
  */
 class Tensor{
     friend struct TensorContents;
     friend class TensorReshape;
     friend class TensorReduceSum;
+    friend class TensorMatmul;
+    friend class Optimizer;
+    friend class Checkpoint;
+    friend class DataLoader;
     private:
         TensorContentsPtr contents;
 
+        // False while backward builds gradient expressions, so they do not track gradients themselves
+        static bool gradEnabled;
+
+        // Random tensors take the next key when they are created, so their values do not depend on evaluation order
+        static uint64_t randomSeed, randomStreams;
+        static uint64_t nextRandomKey();
+
         Tensor(TensorContentsPtr);
         vDataPtr eval();
 
+        // Shared by sum, mean and max
+        Tensor reduceAxes(std::vector<size_t> axes, bool keepDims, bool takeMax, bool takeMean, bool saveGradient, deviceOptions device);
+
     public:
         /**
          * @brief Constructs a tensor with specified dimensions, data, and options.
@@ -50,8 +71,9 @@ class Tensor{
          * @param data Initial values for the tensor.
          * @param saveGradient Whether to compute and save gradients for this tensor (default: false).
          * @param device Device to allocate the tensor (CPU, GPU, or default: DEFAULTDEVICE).
+         * @param dtype Element type the data is stored as (default: FLOAT64).
          */
-        Tensor(vDims, std::vector<double> data, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+        Tensor(vDims, std::vector<double> data, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE, dtypeOptions dtype = FLOAT64);
 
         /**
          * @brief Prints the tensor's contents to the console.
@@ -70,6 +92,12 @@ class Tensor{
          */
         vDims getDims();
 
+        /**
+         * @brief Returns the element type of the tensor.
+         * @return The dtype of the tensor.
+         */
+        dtypeOptions getDtype();
+
         #ifdef OMP
             /**
              * @brief Sets the number of threads for omp globally
@@ -78,15 +106,22 @@ class Tensor{
             static void setOmpNumThreads(int numThreads);
         #endif
 
+        /**
+         * @brief Sets the number of threads that evaluate independent nodes of a graph concurrently.
+         * @param numThreads Number of threads including the calling thread, one evaluates nodes in order (default: one per core).
+         */
+        static void setInterOpNumThreads(size_t numThreads);
+
         /**
          * @brief Creates a tensor filled with ones.
          * 
          * @param dimensions Shape of the tensor.
          * @param saveGradient Whether to compute gradients (default: false).
          * @param device Device to allocate the tensor (default: DEFAULTDEVICE).
+         * @param dtype Element type of the tensor (default: FLOAT64).
          * @return A tensor filled with ones.
          */
-        static Tensor ones(vDims, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+        static Tensor ones(vDims, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE, dtypeOptions dtype = FLOAT64);
 
         /**
          * @brief Creates a tensor filled with ones.
@@ -94,9 +129,10 @@ class Tensor{
          * @param dimensions Shape of the tensor.
          * @param saveGradient Whether to compute gradients (default: false).
          * @param device Device to allocate the tensor (default: DEFAULTDEVICE).
+         * @param dtype Element type of the tensor (default: FLOAT64).
          * @return A tensor filled with ones.
          */
-        static Tensor zeroes(vDims, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+        static Tensor zeroes(vDims, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE, dtypeOptions dtype = FLOAT64);
 
         /**
          * @brief Creates a tensor filled with a specific value.
@@ -105,24 +141,39 @@ class Tensor{
          * @param value Value to fill the tensor with.
          * @param saveGradient Whether to compute gradients (default: false).
          * @param device Device to allocate the tensor (default: DEFAULTDEVICE).
+         * @param dtype Element type of the tensor (default: FLOAT64).
          * @return A tensor filled with the specified value.
          */
-        static Tensor fill(vDims, double n, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+        static Tensor fill(vDims, double n, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE, dtypeOptions dtype = FLOAT64);
 
         /**
          * @brief Creates a tensor filled with normally distrubuted random values.
+         *
+         * Values come from a counter-based generator keyed by the seed and the number of random
+         * tensors created since it was set, so they are the same for any number of threads.
          * 
          * @param dimensions Shape of the tensor.
          * @param mean Mean of normal distribution.
          * @param stddev Standard deviation of normal distribution.
          * @param saveGradient Whether to compute gradients (default: false).
          * @param device Device to allocate the tensor (default: DEFAULTDEVICE).
+         * @param dtype Element type of the tensor (default: FLOAT64).
          * @return A tensor filled with the specified value.
          */
-        static Tensor fillRandom(vDims, double mean, double stddev, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+        static Tensor fillRandom(vDims, double mean, double stddev, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE, dtypeOptions dtype = FLOAT64);
+
+        /**
+         * @brief Seeds the random values of fillRandom and dropout tensors created afterwards.
+         * @param seed The seed (the initial seed is 7).
+         */
+        static void setSeed(uint64_t seed);
 
         /**
          * @brief Performs backpropagation to compute gradients.
+         *
+         * Nodes are visited once in reverse topological order, and each node's gradient is
+         * summed from all of its consumers before it is propagated further. The gradients are
+         * built lazily and evaluated together in one plan, so independent branches run concurrently.
          * 
          * @param grad Gradient to propagate (default: a tensor of scalar one).
          */
@@ -134,6 +185,34 @@ class Tensor{
          */
         Tensor getGradient();
 
+        /**
+         * @brief Counts the in-place writes to the tensor's data, such as Optimizer steps.
+         *
+         * Data derived from a tensor can be cached and rebuilt only when the version changes.
+         * @return The version of the tensor's data.
+         */
+        size_t getVersion();
+
+        /**
+         * @brief Converts the tensor to another element type.
+         * 
+         * @param dtype Element type of the resulting tensor.
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
+         * @return The converted tensor.
+         */
+        Tensor cast(dtypeOptions, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
+        /**
+         * @brief Quantizes the tensor to int8 with one scale per channel of the last dimension,
+         * for inference. A matmul with a quantized right operand, such as a layer's weights,
+         * runs in int8 and returns the dtype of the left operand. Gradients do not flow into
+         * the quantized tensor.
+         * 
+         * @return The quantized tensor.
+         */
+        Tensor quantize();
+
         /**
          * @brief Reshapes the tensor to new dimensions.
          * 
@@ -145,7 +224,8 @@ class Tensor{
         Tensor reshape(vDims, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
 
         /**
-         * @brief Transposes the tensor.
+         * @brief Transposes the last two dimensions of the tensor. The result is a view that
+         * shares this tensor's data, so no elements are copied.
          * 
          * @param saveGradient Whether to compute gradients for this operation (default: false).
          * @param device Device to allocate the transposed tensor (default: DEFAULTDEVICE).
@@ -153,6 +233,43 @@ class Tensor{
          */
         Tensor transpose(bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
 
+        /**
+         * @brief Reorders the dimensions of the tensor as a view sharing this tensor's data.
+         * 
+         * @param order Dimension i of the result is dimension order[i] of this tensor.
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the permuted tensor (default: DEFAULTDEVICE).
+         * @return The permuted tensor.
+         */
+        Tensor permute(std::vector<size_t> order, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
+        /**
+         * @brief Selects indices start, start + step, ... below end of one dimension, as a view
+         * sharing this tensor's data.
+         * 
+         * @param dim The dimension to slice.
+         * @param start First index selected.
+         * @param end One past the last index that may be selected, clamped to the dimension.
+         * @param step Distance between selected indices (default: 1).
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the sliced tensor (default: DEFAULTDEVICE).
+         * @return The sliced tensor.
+         */
+        Tensor slice(size_t dim, size_t start, size_t end, size_t step = 1, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
+        /**
+         * @brief Selects length consecutive indices of one dimension starting at start, as a
+         * view sharing this tensor's data.
+         * 
+         * @param dim The dimension to narrow.
+         * @param start First index selected.
+         * @param length Number of indices selected.
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the narrowed tensor (default: DEFAULTDEVICE).
+         * @return The narrowed tensor.
+         */
+        Tensor narrow(size_t dim, size_t start, size_t length, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
         /**
          * @brief Adds another tensor to this tensor element-wise.
          * 
@@ -197,7 +314,7 @@ class Tensor{
          */
         Tensor subtract(double, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
         Tensor operator - (double x) {return subtract(x);}
-        friend Tensor operator - (double n, Tensor x) {return fill({1}, n).subtract(x);}
+        friend Tensor operator - (double n, Tensor x) {return fill({1}, n, false, DEFAULTDEVICE, x.getDtype()).subtract(x);}
 
         /**
          * @brief Multiplies this tensor element-wise with another tensor.
@@ -243,7 +360,7 @@ class Tensor{
          */
         Tensor elementwiseDivision(double, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
         Tensor operator / (double x) {return elementwiseDivision(x);}
-        friend Tensor operator / (double n, Tensor x) {return fill({1}, n).elementwiseDivision(x);}
+        friend Tensor operator / (double n, Tensor x) {return fill({1}, n, false, DEFAULTDEVICE, x.getDtype()).elementwiseDivision(x);}
 
         /**
          * @brief Negates the tensor, performing an element-wise negation.
@@ -283,6 +400,19 @@ class Tensor{
          */
         Tensor binarize(bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
 
+        /**
+         * @brief Zeroes each element with probability p and scales the others by 1 / (1 - p).
+         *
+         * The mask is never stored; it is regenerated from the tensor's random key by the
+         * forward kernel and by backward.
+         *
+         * @param p Probability of zeroing an element, in [0, 1).
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
+         * @return The tensor after dropout.
+         */
+        Tensor dropout(double p, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
         /**
          * @brief Computes the element-wise reciprocal of the tensor.
          * 
@@ -290,10 +420,13 @@ class Tensor{
          * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
          * @return A tensor with the reciprocal of each element.
          */
-        Tensor reciprocal(bool saveGradient = false, deviceOptions device = DEFAULTDEVICE) {return ones({1}).elementwiseDivision(*this, saveGradient, device);}
+        Tensor reciprocal(bool saveGradient = false, deviceOptions device = DEFAULTDEVICE) {return ones({1}, false, DEFAULTDEVICE, getDtype()).elementwiseDivision(*this, saveGradient, device);}
 
         /**
          * @brief Performs matrix multiplication between tensors.
+         *
+         * Either operand may be a 2D matrix or a batch of matrices [batch, rows, cols]. An operand
+         * without a batch, or with a batch of one, is broadcast across the other operand's batch.
          * 
          * @param other The other tensor to multiply.
          * @param saveGradient Whether to compute gradients for this operation (default: false).
@@ -313,13 +446,71 @@ class Tensor{
         Tensor reduceSum(bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
 
         /**
-         * @brief Computes the softmax of the tensor.
+         * @brief Sums the tensor over the given axes.
+         * 
+         * @param axes Dimensions to reduce, all of them if empty (default: {}).
+         * @param keepDims Whether reduced dimensions are kept with size one (default: false).
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
+         * @return The sums, with the reduced dimensions removed, or {1} if every dimension is reduced.
+         */
+        Tensor sum(std::vector<size_t> axes = {}, bool keepDims = false, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
+        /**
+         * @brief Averages the tensor over the given axes.
+         * 
+         * @param axes Dimensions to reduce, all of them if empty (default: {}).
+         * @param keepDims Whether reduced dimensions are kept with size one (default: false).
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
+         * @return The means, with the reduced dimensions removed, or {1} if every dimension is reduced.
+         */
+        Tensor mean(std::vector<size_t> axes = {}, bool keepDims = false, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
+        /**
+         * @brief Takes the maximum of the tensor over the given axes. The gradient is split
+         * evenly between the elements equal to the maximum.
+         * 
+         * @param axes Dimensions to reduce, all of them if empty (default: {}).
+         * @param keepDims Whether reduced dimensions are kept with size one (default: false).
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
+         * @return The maxima, with the reduced dimensions removed, or {1} if every dimension is reduced.
+         */
+        Tensor max(std::vector<size_t> axes = {}, bool keepDims = false, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
+        /**
+         * @brief Computes the softmax over the last dimension, so each row of a batch is
+         * normalized separately. The row maximum is subtracted before exponentiating.
          * 
          * @param saveGradient Whether to compute gradients for this operation (default: false).
          * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
          * @return A tensor with the softmax applied.
          */
-        Tensor softmax(bool saveGradient = false, deviceOptions device = DEFAULTDEVICE) {return this->elementwiseDivision(this->reduceSum(saveGradient), saveGradient, device);}
+        Tensor softmax(bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
+
+        /**
+         * @brief Finds the index of the largest element of each row of the last dimension, the
+         * first one when several are equal. Indices are returned as floating point values, like
+         * the labels of crossEntropy. The result has no gradient.
+         * 
+         * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
+         * @return The indices, shaped like this tensor without its last dimension, or {1} for a vector.
+         */
+        Tensor argmax(deviceOptions device = DEFAULTDEVICE);
+
+        /**
+         * @brief Cross entropy loss of this tensor as logits, averaged over rows. Computed from
+         * the log-sum-exp of each row, so the softmax is never formed and large logits do not
+         * overflow. The gradient of the logits is softmax minus the targets; labels get none.
+         * 
+         * @param labels The class index of each row (shaped like this tensor without its last
+         * dimension), or a target distribution per row (shaped like this tensor).
+         * @param saveGradient Whether to compute gradients for this operation (default: false).
+         * @param device Device to allocate the resulting tensor (default: DEFAULTDEVICE).
+         * @return The mean loss, with dimensions {1}.
+         */
+        Tensor crossEntropy(Tensor labels, bool saveGradient = false, deviceOptions device = DEFAULTDEVICE);
 };
 #endif
 
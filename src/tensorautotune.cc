@@ -0,0 +1,120 @@
+/**
+ * @file tensorautotune.cc
+ * @brief Implements the cache of kernel configurations chosen by benchmarking.
+ *
+ * The cache file has a line per tuned key, the key's words followed by a colon and the winning
+ * configuration, for example "gemm float32 9 9 9 : 256 64 8 1".
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tensorautotune.h"
+
+#define AUTOTUNEHEADER "# zdlf autotune cache 1"
+
+namespace{
+    struct TuningCache{
+        std::mutex lock;
+
+        // Read by every tuned kernel call, so it is checked without taking the lock
+        std::atomic<bool> enabled{false};
+        std::string path;
+        std::map<std::string, std::vector<size_t>> winners;
+
+        // Lines that do not parse, and files written by another version, are ignored
+        void load(){
+            std::ifstream file(path);
+            std::string line;
+            if(!std::getline(file, line) || line != AUTOTUNEHEADER) return;
+            while(std::getline(file, line)){
+                size_t colon = line.find(" : ");
+                if(colon == std::string::npos) continue;
+                std::istringstream values(line.substr(colon + 3));
+                std::vector<size_t> config;
+                size_t v;
+                while(values >> v) config.push_back(v);
+                if(!config.empty()) winners[line.substr(0, colon)] = config;
+            }
+        }
+
+        // Written to a temporary file first, so a run that stops while saving leaves the old cache
+        void save(){
+            if(path.empty()) return;
+            std::string temporary = path + ".tmp";
+            {
+                std::ofstream file(temporary);
+                if(!file) return;
+                file << AUTOTUNEHEADER << "\n";
+                for(auto& winner : winners){
+                    file << winner.first << " :";
+                    for(auto v : winner.second) file << " " << v;
+                    file << "\n";
+                }
+                if(!file) return;
+            }
+            std::rename(temporary.c_str(), path.c_str());
+        }
+    };
+
+    TuningCache& cache(){
+        static TuningCache * tuningCache = new TuningCache();
+        return *tuningCache;
+    }
+
+    const bool enabledAtStartup = [](){
+        const char * path = std::getenv("ZDLF_AUTOTUNE_CACHE");
+        if(path && *path) TensorAutotune::enable(path);
+        return path != nullptr;
+    }();
+}
+
+namespace TensorAutotune{
+    void enable(const std::string& cachePath){
+        TuningCache& c = cache();
+        std::lock_guard<std::mutex> guard(c.lock);
+        c.path = cachePath;
+        if(!cachePath.empty()) c.load();
+        c.enabled = true;
+    }
+
+    void disable(){
+        cache().enabled = false;
+    }
+
+    bool isEnabled(){
+        return cache().enabled.load(std::memory_order_relaxed);
+    }
+
+    bool lookup(const std::string& key, std::vector<size_t>& values){
+        TuningCache& c = cache();
+        std::lock_guard<std::mutex> guard(c.lock);
+        auto found = c.winners.find(key);
+        if(found == c.winners.end()) return false;
+        values = found->second;
+        return true;
+    }
+
+    void store(const std::string& key, const std::vector<size_t>& values){
+        TuningCache& c = cache();
+        std::lock_guard<std::mutex> guard(c.lock);
+        c.winners[key] = values;
+        c.save();
+    }
+
+    void clear(){
+        TuningCache& c = cache();
+        std::lock_guard<std::mutex> guard(c.lock);
+        c.winners.clear();
+    }
+}
@@ -0,0 +1,45 @@
+/**
+ * @file tensorautotune.h
+ * @brief Defines the cache of kernel configurations chosen by benchmarking.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef TENSORAUTOTUNEH
+#define TENSORAUTOTUNEH
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * While enabled, the first call of a tuned kernel for a class of shapes times a few candidate
+ * configurations (thread count, GEMM tile sizes, whether to pack) on scratch buffers of that
+ * shape and keeps the fastest. Shapes are classed by rounding each size up to a power of two.
+ * Winners are written to the cache file, and a later run that enables tuning with the same file
+ * starts with them instead of timing again. Setting ZDLF_AUTOTUNE_CACHE to a path enables tuning
+ * with that file at startup.
+ *
+ * While disabled, which is the default, kernels use their fixed configurations. Tuned kernels may
+ * split sums differently, so results can differ from untuned ones in the last bits.
+ */
+namespace TensorAutotune{
+    // Loads the winners cached in cachePath, if it exists. An empty path keeps winners in memory only.
+    void enable(const std::string& cachePath = "");
+
+    void disable();
+
+    bool isEnabled();
+
+    // Whether key was tuned, with its winning configuration in values
+    bool lookup(const std::string& key, std::vector<size_t>& values);
+
+    // Records the winner of key and rewrites the cache file
+    void store(const std::string& key, const std::vector<size_t>& values);
+
+    // Forgets every winner in memory, so they are tuned again. The cache file is left as it is.
+    void clear();
+}
+
+#endif
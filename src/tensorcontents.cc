@@ -12,11 +12,27 @@
  * @date November 2024
  */
 
+#ifndef TENSORCONTENTSCC
+#define TENSORCONTENTSCC
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "tensor.h"
 #include "tensorcpufunctions.h"
+#include "tensormemorypool.h"
+#include "tensorprofiler.h"
+#include "tensorthreadpool.h"
 
 
 //#define CUDA
@@ -24,38 +40,110 @@
     #include "tensorgpuutility.h"
     #include "tensorgpufunctions.h"
     
-    #define CALLFUNC(NAME, ARGS) if(onGPU) gpuS##NAME ARGS; else cpu##NAME ARGS;
-    #define MAKEDATA \
-            (onGPU) ? TensorGPUUtility::allocate(dataLen) : \
-                std::shared_ptr<double>(new double[dataLen], std::default_delete<double[]>());
+    #define CALLFUNC(NAME, ARGS) if(onGPU) gpuS##NAME<T> ARGS; else cpu##NAME<T> ARGS;
+    #define MAKEDATA TensorMemoryPool::allocate(dataLen * dtypeSize(dtype), onGPU);
 #else // no CUDA
-    #define CALLFUNC(NAME, ARGS) cpu##NAME ARGS;
-    #define MAKEDATA std::shared_ptr<double>(new double[dataLen], std::default_delete<double[]>());
+    #define CALLFUNC(NAME, ARGS) cpu##NAME<T> ARGS;
+    #define MAKEDATA TensorMemoryPool::allocate(dataLen * dtypeSize(dtype));
 #endif
 
+// Runs the statements with T defined as the element type of DTYPE, so CALLFUNC selects those kernels
+#define DTYPESWITCH(DTYPE, ...) \
+    if((DTYPE) == FLOAT32) {typedef float T; __VA_ARGS__} \
+    else {typedef double T; __VA_ARGS__}
+
+#define TDATA(PTR) static_cast<T *>((PTR).get())
+
 #define ISSCALAR(TENSOR) ((TENSOR).getDims().size() == 1 && (TENSOR).getDims()[0] == 1)
 
+// Elements a step must touch before it is split over OpenMP threads instead of run on one pool worker
+#define INTRAOPMINWORK 32768
+
 enum operation {ZEROES, ADD, ADDSCALAR, NEG, SOFTMAX, SUBTRACT, SUBTRACTSCALAR,
     ELEMENTWISEMULT, ELEMENTWISEMULTSCALAR, ELEMENTWISEDIVISION,
     ELEMENTWISEDIVISIONSCALAR, RELU, BINARIZE, POW, FILLRANDOM, 
-    ONES, MATMUL, FILL, DATA, REDUCESUM, TRANSPOSE, RESHAPE};
+    ONES, MATMUL, FILL, DATA, REDUCESUM, TRANSPOSE, RESHAPE, MATMULGRADLEFT,
+    MATMULGRADRIGHT, CAST, SUMTOSHAPE, BROADCAST, PERMUTE, SLICE, SLICEGRAD, REDUCE, EQUAL, SOFTMAXGRAD,
+    CROSSENTROPY, CROSSENTROPYGRAD, DROPOUT, ARGMAX};
+
+// Name of an operation in profiles, in the order of the enum
+static const char * opName(operation op){
+    static const char * names[] = {"ZEROES", "ADD", "ADDSCALAR", "NEG", "SOFTMAX", "SUBTRACT", "SUBTRACTSCALAR",
+        "ELEMENTWISEMULT", "ELEMENTWISEMULTSCALAR", "ELEMENTWISEDIVISION",
+        "ELEMENTWISEDIVISIONSCALAR", "RELU", "BINARIZE", "POW", "FILLRANDOM",
+        "ONES", "MATMUL", "FILL", "DATA", "REDUCESUM", "TRANSPOSE", "RESHAPE", "MATMULGRADLEFT",
+        "MATMULGRADRIGHT", "CAST", "SUMTOSHAPE", "BROADCAST", "PERMUTE", "SLICE", "SLICEGRAD", "REDUCE", "EQUAL", "SOFTMAXGRAD",
+        "CROSSENTROPY", "CROSSENTROPYGRAD", "DROPOUT", "ARGMAX"};
+    static_assert(sizeof(names) / sizeof(names[0]) == ARGMAX + 1, "Every operation needs a name");
+    return names[op];
+}
 
 
-struct TensorContents{
+/**
+ * A chain of elementwise nodes that is evaluated as a single loop. Inputs are the tensors the
+ * chain reads from memory, interior holds the nodes whose own buffers are never allocated.
+ */
+struct FusedProgram{
+    std::vector<Tensor> inputs;
+    std::vector<FusedInstruction> instructions;
+    std::vector<TensorContentsPtr> interior;
+};
+
+struct TensorContents : std::enable_shared_from_this<TensorContents>{
     vDataPtr data;
     bool onGPU = false;
+    dtypeOptions dtype = FLOAT64;
+
+    // Per-channel (last dimension) scales of INT8 data, which holds round(value / scale)
+    vDataPtr scales;
 
     size_t dataLen;
     vDims dims;
 
+    // Element strides of a view into another node's buffer, empty when data is contiguous. A
+    // view's data pointer aliases that buffer at the view's first element.
+    std::vector<size_t> strides;
+
     bool evaluated;
     bool saveGradient;
     bool foundGradient = false;
     std::shared_ptr<Tensor> gradient;
 
+    // Gradient summed from every consumer during the current backward pass, built lazily and
+    // evaluated into gradientData once every node has propagated its gradient
+    std::shared_ptr<Tensor> gradientSum;
+    vDataPtr gradientData;
+
+    // Set for parameters of an Optimizer, whose gradient tensor is a slice of the optimizer's flat
+    // gradient buffer. backward adds into that buffer in place instead of replacing the tensor.
+    bool packedGradient = false;
+
+    // Nodes that take this one as an argument, used to free data once no consumer still needs it
+    std::vector<std::weak_ptr<TensorContents>> consumers;
+
+    // Set by optimize when this node is the root of a fused elementwise chain
+    std::shared_ptr<FusedProgram> fused;
+    bool fusedAway = false;
+
+    // Shared by every node whose data lives in the same buffer and bumped each time the buffer is
+    // overwritten in place. Data computed at a different version than its buffer's is stale.
+    std::shared_ptr<size_t> bufferVersion;
+    size_t dataVersion = 0;
+
+    // Step of the current evaluation plan that computes this node and the last step that reads
+    // its data. Data that outlives the plan is never overwritten in place.
+    size_t planStep = 0, lastUse = 0;
+    bool outlivesPlan = true;
+
+    // Set on the nodes a plan is evaluating, which are computed whole rather than fused into a consumer
+    bool planRoot = false;
+
     virtual ~TensorContents() = default;
 
     virtual operation getOp() {return DATA;}
+    virtual std::vector<Tensor> getArgs() {return {};}
+    virtual double getScalar() {return 0;}
+    virtual uint64_t getRandomKey() {return 0;}
     virtual void eval() {};
     virtual void backward(Tensor) {};
 
@@ -67,43 +155,685 @@ struct TensorContents{
         return dataLen;
     }
 
-    TensorContents(vDims dims, vDataPtr data, bool saveGradient, bool onGPU)
-        : dims(dims), data(data), saveGradient(saveGradient), evaluated(true), dataLen(calculateDataLen(dims)), onGPU(onGPU) {}
+    /**
+     * Strides for reading operands of dims1 and dims2 broadcast to dims, aligned at their trailing
+     * dimensions. Dimensions of size one are dropped and neighbouring dimensions that are laid out
+     * contiguously in both operands are merged.
+     */
+    static BroadcastShape broadcastShape(vDims dims, vDims dims1, vDims dims2){
+        std::vector<size_t> strides1(dims.size(), 0), strides2(dims.size(), 0);
+        size_t stride1 = 1, stride2 = 1;
+        for(size_t i = 0; i < dims.size(); ++i){
+            size_t d = dims.size() - 1 - i;
+            if(i < dims1.size() && dims1[dims1.size() - 1 - i] != 1) strides1[d] = stride1;
+            if(i < dims2.size() && dims2[dims2.size() - 1 - i] != 1) strides2[d] = stride2;
+            if(i < dims1.size()) stride1 *= dims1[dims1.size() - 1 - i];
+            if(i < dims2.size()) stride2 *= dims2[dims2.size() - 1 - i];
+        }
+        return mergeDims(dims, strides1, strides2);
+    }
+
+    /**
+     * Shape of dims read through strides1 and strides2, with dimensions of size one dropped and
+     * neighbouring dimensions that are laid out contiguously in both merged.
+     */
+    static BroadcastShape mergeDims(vDims dims, std::vector<size_t> strides1, std::vector<size_t> strides2){
+        BroadcastShape shape;
+        shape.numDims = 0;
+        for(size_t d = 0; d < dims.size(); ++d){
+            if(dims[d] == 1) continue;
+            size_t last = shape.numDims - 1;
+            if(shape.numDims > 0 && shape.strides1[last] == strides1[d] * dims[d] && shape.strides2[last] == strides2[d] * dims[d]){
+                shape.dims[last] *= dims[d];
+                shape.strides1[last] = strides1[d];
+                shape.strides2[last] = strides2[d];
+                continue;
+            }
+            if(shape.numDims == BROADCASTMAXDIMS) throw std::runtime_error("Too many dimensions to broadcast");
+            shape.dims[shape.numDims] = dims[d];
+            shape.strides1[shape.numDims] = strides1[d];
+            shape.strides2[shape.numDims] = strides2[d];
+            ++shape.numDims;
+        }
+        if(shape.numDims == 0){
+            shape.numDims = 1;
+            shape.dims[0] = 1;
+            shape.strides1[0] = shape.strides2[0] = 0;
+        }
+        return shape;
+    }
+
+    static Tensor sumToShape(Tensor grad, Tensor arg);
+
+    static Tensor broadcastTo(Tensor t, vDims dims);
+
+    static std::vector<size_t> contiguousStrides(vDims dims){
+        std::vector<size_t> ret(dims.size());
+        size_t stride = 1;
+        for(size_t i = dims.size(); i-- > 0;){
+            ret[i] = stride;
+            stride *= dims[i];
+        }
+        return ret;
+    }
+
+    // Whether data read through strides is laid out row-major, strides of size one dimensions are never read
+    static bool isContiguous(vDims dims, std::vector<size_t> strides){
+        if(strides.empty()) return true;
+        size_t stride = 1;
+        for(size_t i = dims.size(); i-- > 0;){
+            if(dims[i] != 1 && strides[i] != stride) return false;
+            stride *= dims[i];
+        }
+        return true;
+    }
+
+    bool isContiguous(){
+        return isContiguous(dims, strides);
+    }
+
+    // Copies the evaluated data of a view into a new row-major buffer on the same device
+    vDataPtr contiguousData(){
+        vDataPtr ret = MAKEDATA;
+        DTYPESWITCH(dtype,
+            CALLFUNC(StridedCopy, (TDATA(ret), TDATA(data), mergeDims(dims, contiguousStrides(dims), strides)));
+        )
+        return ret;
+    }
+
+    // Sets this node's data to the view of p starting offset elements in and read through viewStrides
+    void makeView(vDataPtr p, std::vector<size_t> viewStrides, size_t offset){
+        data = vDataPtr(p, static_cast<char *>(p.get()) + offset * dtypeSize(dtype));
+        strides = viewStrides;
+    }
+
+    static size_t dtypeSize(dtypeOptions dtype){
+        if(dtype == INT8) return sizeof(int8_t);
+        return dtype == FLOAT32 ? sizeof(float) : sizeof(double);
+    }
+
+    // INT8 tensors are dequantized to float32 by every operation except matmul
+    static dtypeOptions computeDtype(dtypeOptions dtype){
+        return dtype == INT8 ? FLOAT32 : dtype;
+    }
+
+    // Mixed float32 and float64 operands are computed in float64
+    static dtypeOptions promoteDtype(dtypeOptions dtype1, dtypeOptions dtype2){
+        return computeDtype(dtype1) == FLOAT64 || computeDtype(dtype2) == FLOAT64 ? FLOAT64 : FLOAT32;
+    }
+
+    TensorContents(vDims dims, vDataPtr data, bool saveGradient, bool onGPU, dtypeOptions dtype)
+        : dims(dims), data(data), saveGradient(saveGradient), evaluated(true), dataLen(calculateDataLen(dims)), onGPU(onGPU), dtype(dtype) {}
+
+    TensorContents(vDims dims, bool saveGradient, bool onGPU, dtypeOptions dtype) : dims(dims), saveGradient(saveGradient), evaluated(false), dataLen(calculateDataLen(dims)), onGPU(onGPU), dtype(dtype) {
+        if(dtype == INT8) throw std::runtime_error("INT8 tensors can only be created by quantize");
+    }
+
+    void addConsumer(TensorContentsPtr consumer){
+        if(getArgs().empty()) return;
+        for(size_t i = 0; i < consumers.size();){
+            if(consumers[i].expired()){
+                consumers[i] = consumers.back();
+                consumers.pop_back();
+            }
+            else ++i;
+        }
+        consumers.push_back(consumer);
+    }
+
+    /**
+     * Drops the data of an evaluated intermediate once every live consumer has been evaluated.
+     * Data is kept if a consumer saves gradients, since its backward reads this node's values.
+     * A released node is marked unevaluated, so it is recomputed if it is read again. Nodes
+     * without arguments (data and fills) are never released, as random fills cannot be recomputed.
+     */
+    void release(){
+        if(getArgs().empty() || !evaluated) return;
+        for(auto& c : consumers){
+            auto consumer = c.lock();
+            if(consumer && ((!consumer->evaluated && !consumer->fusedAway) || consumer->saveGradient)) return;
+        }
+        data.reset();
+        bufferVersion.reset();
+        evaluated = false;
+    }
+
+    bool isStale(){
+        return evaluated && bufferVersion && *bufferVersion != dataVersion && !getArgs().empty();
+    }
+
+    std::shared_ptr<size_t> versionCounter(){
+        if(!bufferVersion){
+            bufferVersion = std::make_shared<size_t>(0);
+            dataVersion = 0;
+        }
+        return bufferVersion;
+    }
+
+    // Called once data is computed, data that aliases the buffer of an input shares its counter
+    void trackVersion(std::vector<Tensor>& inputs){
+        for(auto& arg : inputs){
+            if(bufferVersion) break;
+            vDataPtr& argData = arg.contents->data;
+            if(argData && !data.owner_before(argData) && !argData.owner_before(data))
+                bufferVersion = arg.contents->versionCounter();
+        }
+        dataVersion = *versionCounter();
+    }
+
+    /**
+     * Whether this node may write its output over the data of arg, read by this node as argData.
+     * This must be the last step of the plan to read arg, arg must not be needed afterwards
+     * (which also keeps it for backward), and no other node or view may hold its buffer.
+     */
+    bool canOverwrite(Tensor& arg, const vDataPtr& argData){
+        TensorContentsPtr& a = arg.contents;
+        return !a->outlivesPlan && a->lastUse == planStep && a->evaluated && !a->getArgs().empty()
+            && a->dims == dims && a->dtype == dtype && a->onGPU == onGPU && a->isContiguous()
+            && argData == a->data && a->data.use_count() == 2;
+    }
+
+    // Guards the flags of planned nodes while their steps run concurrently
+    static std::mutex& planLock(){
+        static std::mutex lock;
+        return lock;
+    }
+
+    // Takes over the buffer of arg, which is recomputed if read again
+    vDataPtr takeBuffer(Tensor& arg){
+        std::lock_guard<std::mutex> guard(planLock());
+        TensorContentsPtr& a = arg.contents;
+        vDataPtr ret = a->data;
+        bufferVersion = a->versionCounter();
+        ++*bufferVersion;
+        a->data.reset();
+        a->bufferVersion.reset();
+        a->evaluated = false;
+        return ret;
+    }
+
+    // Buffer for an elementwise output, the buffer of an input when it can be overwritten in place
+    vDataPtr outputBuffer(Tensor arg1, const vDataPtr& data1){
+        if(canOverwrite(arg1, data1)) return takeBuffer(arg1);
+        return MAKEDATA;
+    }
+
+    vDataPtr outputBuffer(Tensor arg1, const vDataPtr& data1, Tensor arg2, const vDataPtr& data2){
+        if(canOverwrite(arg1, data1)) return takeBuffer(arg1);
+        if(canOverwrite(arg2, data2)) return takeBuffer(arg2);
+        return MAKEDATA;
+    }
+
+    /**
+     * Evaluates roots with a static plan. The unevaluated nodes they depend on are ordered so each
+     * follows its inputs, and the last step that reads every input is found before anything is
+     * computed. Intermediates are released after their last reader, so buffers whose lifetimes
+     * do not overlap are handed out again by the memory pool, and an elementwise step that is the
+     * last reader of a same shaped input writes its output over that input. When the thread pool
+     * has workers, steps that do not depend on each other are run concurrently. Steps are recorded
+     * under profileCategory while the profiler is enabled.
+     */
+    static void evaluate(std::vector<TensorContentsPtr> roots, const char * profileCategory = "eval"){
+        std::vector<TensorContentsPtr> order;
+        std::vector<std::vector<Tensor>> inputs;
+        std::map<TensorContents *, bool> planned;
+        std::vector<TensorContents *> read;
+
+        // Clears the marks of the plan even if a step throws
+        struct PlanScope{
+            std::vector<TensorContentsPtr>& roots;
+            std::vector<TensorContents *>& read;
+
+            PlanScope(std::vector<TensorContentsPtr>& roots, std::vector<TensorContents *>& read) : roots(roots), read(read) {
+                for(auto& root : roots) root->planRoot = true;
+            }
+            ~PlanScope(){
+                for(auto a : read) a->outlivesPlan = true;
+                for(auto& root : roots) root->planRoot = false;
+            }
+        } scope(roots, read);
+
+        // Nodes are optimized from the roots down, so a fused chain is planned as one step
+        std::vector<std::pair<TensorContentsPtr, bool>> stack;
+        for(size_t i = roots.size(); i-- > 0;) stack.push_back({roots[i], false});
+        while(!stack.empty()){
+            auto top = stack.back();
+            stack.pop_back();
+            TensorContentsPtr node = top.first;
+            if(top.second){
+                node->planStep = order.size();
+                order.push_back(node);
+                inputs.push_back(node->fused ? node->fused->inputs : node->getArgs());
+                continue;
+            }
+            if(planned.count(node.get())) continue;
+            if(node->isStale()){
+                node->data.reset();
+                node->bufferVersion.reset();
+                node->evaluated = false;
+            }
+            if(node->evaluated) continue;
+
+            planned[node.get()] = true;
+            node->optimize();
+            if(node->fused) for(auto& interior : node->fused->interior) planned[interior.get()] = true;
+            stack.push_back({node, true});
+            for(auto& arg : node->fused ? node->fused->inputs : node->getArgs())
+                stack.push_back({arg.contents, false});
+        }
+
+        // Inputs that were evaluated before the plan may also be overwritten at their last use
+        std::map<TensorContents *, bool> isRead;
+        for(size_t step = 0; step < order.size(); ++step){
+            for(auto& arg : inputs[step]){
+                TensorContents * a = arg.contents.get();
+                if(!isRead[a]) read.push_back(a);
+                isRead[a] = true;
+                a->lastUse = step;
+            }
+        }
+        for(auto a : read){
+            a->outlivesPlan = a->planRoot;
+            for(auto& c : a->consumers){
+                auto consumer = c.lock();
+                if(consumer && (consumer->saveGradient || (!consumer->evaluated && !consumer->fusedAway && !planned.count(consumer.get()))))
+                    a->outlivesPlan = true;
+            }
+        }
+
+        if(order.size() > 1 && TensorThreadPool::getNumWorkers() > 0){
+            runConcurrently(order, inputs, read, profileCategory);
+            return;
+        }
+        for(size_t step = 0; step < order.size(); ++step){
+            runStep(order[step], inputs[step], profileCategory);
+            finishStep(order[step], inputs[step]);
+        }
+    }
+
+    static void evaluate(TensorContentsPtr root){
+        evaluate(std::vector<TensorContentsPtr>{root});
+    }
+
+    // Computes a step, recorded with its shapes while the profiler is enabled
+    static void runStep(TensorContentsPtr& node, std::vector<Tensor>& stepInputs, const char * profileCategory){
+        std::unique_ptr<TensorProfiler::Scope> scope;
+        if(TensorProfiler::isEnabled()){
+            std::vector<vDims> shapes = {node->dims};
+            for(auto& arg : stepInputs) shapes.push_back(arg.contents->dims);
+            scope.reset(new TensorProfiler::Scope(profileCategory, std::string(node->fused ? "FUSED " : "") + opName(node->getOp()), shapes));
+        }
+        if(node->fused) node->evalFused();
+        else node->eval();
+    }
+
+    // Marks a computed step evaluated and releases the inputs it was the last reader of
+    static void finishStep(TensorContentsPtr& node, std::vector<Tensor>& stepInputs){
+        if(node->fused) for(auto& interior : node->fused->interior) interior->fusedAway = true;
+        node->fused.reset();
+        node->evaluated = true;
+        node->trackVersion(stepInputs);
+
+        for(auto& arg : stepInputs)
+            if(!arg.contents->planRoot) arg.contents->release();
+    }
+
+    // Whether a step is worth splitting over OpenMP threads rather than run on one pool worker
+    bool isLargeStep(std::vector<Tensor>& stepInputs){
+        if(onGPU) return true;
+        bool matmul = getOp() == MATMUL || getOp() == MATMULGRADLEFT || getOp() == MATMULGRADRIGHT;
+        size_t work = dataLen;
+        for(auto& arg : stepInputs){
+            size_t argWork = matmul ? dataLen * arg.contents->dims.back() : arg.contents->dataLen;
+            if(argWork > work) work = argWork;
+        }
+        return work >= INTRAOPMINWORK;
+    }
+
+    /**
+     * Runs the steps of a plan as soon as the steps computing their inputs finish. Small steps are
+     * handed to the thread pool, so independent branches of the graph run side by side, while large
+     * and GPU steps run on this thread and are split over OpenMP threads by their kernels. An input
+     * is overwritten in place only by a reader that starts after every other reader has finished,
+     * and the flags of planned nodes are only changed under planLock.
+     */
+    static void runConcurrently(std::vector<TensorContentsPtr>& order, std::vector<std::vector<Tensor>>& inputs, std::vector<TensorContents *>& read, const char * profileCategory){
+        size_t numSteps = order.size();
+        std::vector<std::vector<size_t>> dependents(numSteps);
+        std::vector<std::vector<TensorContents *>> reads(numSteps);
+        std::vector<size_t> waiting(numSteps, 0);
+        std::map<TensorContents *, size_t> readersLeft;
+
+        for(auto a : read){
+            a->lastUse = SIZE_MAX;
+            if(a->evaluated) a->versionCounter();
+        }
+        for(size_t step = 0; step < numSteps; ++step){
+            std::set<TensorContents *> distinct;
+            for(auto& arg : inputs[step]){
+                TensorContents * a = arg.contents.get();
+                if(!distinct.insert(a).second) continue;
+                reads[step].push_back(a);
+                ++readersLeft[a];
+                if(a->planStep < numSteps && order[a->planStep].get() == a){
+                    dependents[a->planStep].push_back(step);
+                    ++waiting[step];
+                }
+            }
+        }
+
+        std::vector<size_t> ready;
+        size_t running = 0, finished = 0;
+        std::exception_ptr error;
+        std::condition_variable stepDone;
+        std::function<void(size_t)> launch;
+        std::function<void(size_t, std::exception_ptr)> complete;
+
+        // Both are called with planLock held
+        launch = [&](size_t step){
+            for(auto a : reads[step])
+                if(readersLeft[a] == 1) a->lastUse = step;
+            ++running;
+            if(order[step]->isLargeStep(inputs[step])){
+                ready.push_back(step);
+                stepDone.notify_all();
+                return;
+            }
+            TensorThreadPool::submit([&, step]{
+                std::exception_ptr stepError;
+                try{
+                    runStep(order[step], inputs[step], profileCategory);
+                }
+                catch(...){
+                    stepError = std::current_exception();
+                }
+                std::lock_guard<std::mutex> guard(planLock());
+                complete(step, stepError);
+            });
+        };
+        complete = [&](size_t step, std::exception_ptr stepError){
+            for(auto a : reads[step]) --readersLeft[a];
+            --running;
+            ++finished;
+            if(stepError){
+                if(!error) error = stepError;
+            }
+            else{
+                finishStep(order[step], inputs[step]);
+                if(!error)
+                    for(auto d : dependents[step])
+                        if(--waiting[d] == 0) launch(d);
+            }
+            stepDone.notify_all();
+        };
+
+        std::unique_lock<std::mutex> guard(planLock());
+        for(size_t step = 0; step < numSteps; ++step)
+            if(waiting[step] == 0) launch(step);
+        while(true){
+            // After an error, steps that have not started are dropped and running ones are waited for
+            if(error){
+                running -= ready.size();
+                ready.clear();
+                if(running == 0) break;
+            }
+            else if(finished == numSteps) break;
+
+            if(ready.empty()){
+                stepDone.wait(guard);
+                continue;
+            }
+            size_t step = ready.back();
+            ready.pop_back();
+            guard.unlock();
+            std::exception_ptr stepError;
+            try{
+                runStep(order[step], inputs[step], profileCategory);
+            }
+            catch(...){
+                stepError = std::current_exception();
+            }
+            guard.lock();
+            complete(step, stepError);
+        }
+        if(error) std::rethrow_exception(error);
+    }
+
+    /**
+     * Adds grad to this node's gradient for the current backward pass. The sum is built lazily,
+     * and the gradients of every node are evaluated in one plan at the end of the pass, so
+     * independent branches of the backward graph are evaluated concurrently.
+     */
+    void accumulateGradient(Tensor grad){
+        if(grad.contents->dims != dims) throw std::runtime_error("Dimenions of grad and tensor must match in backward");
+        if(grad.contents->dtype != dtype || grad.contents->onGPU != onGPU) grad = grad.cast(dtype, false, onGPU ? GPU : CPU);
+
+        if(!gradientSum) gradientSum = std::make_shared<Tensor>(grad);
+        else gradientSum = std::make_shared<Tensor>(gradientSum->add(grad));
+    }
+
+    // Adds the gradient of the current backward pass into the gradient buffer packed by an Optimizer
+    void addPackedGradient(){
+        vDataPtr g = gradient->contents->data;
+        DTYPESWITCH(dtype,
+            CALLFUNC(Add, (TDATA(g), TDATA(g), TDATA(gradientData), dataLen));
+        )
+        ++*gradient->contents->versionCounter();
+    }
+
+    static void addGradient(Tensor arg, Tensor grad){
+        if(arg.contents->saveGradient) arg.contents->accumulateGradient(grad);
+    }
 
-    TensorContents(vDims dims, bool saveGradient, bool onGPU) : dims(dims), saveGradient(saveGradient), evaluated(false), dataLen(calculateDataLen(dims)), onGPU(onGPU) {}
+    // Wraps a node built inside a backward function, since only TensorContents can construct Tensors from nodes
+    static Tensor makeTensor(TensorContentsPtr ptr){
+        return Tensor(ptr);
+    }
+
+    static bool isFusable(operation op){
+        switch(op){
+            case NEG: case ADD: case ADDSCALAR: case SUBTRACT: case SUBTRACTSCALAR:
+            case ELEMENTWISEMULT: case ELEMENTWISEMULTSCALAR: case ELEMENTWISEDIVISION:
+            case ELEMENTWISEDIVISIONSCALAR: case POW: case RELU: case BINARIZE: case DROPOUT:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Whether this node can be computed inside the fused loop of consumer rather than
+     * materialized. It must be unevaluated, the same shape and dtype as the loop, and read only
+     * by consumer.
+     */
+    bool canFuseInto(TensorContents * consumer){
+        if(evaluated || planRoot || onGPU || dims != consumer->dims || dtype != consumer->dtype || !isFusable(getOp())) return false;
+        for(auto& arg : getArgs())
+            if(arg.contents->dims != dims && calculateDataLen(arg.contents->dims) != 1) return false;
+        for(auto& c : consumers){
+            auto p = c.lock();
+            if(p && (p.get() != consumer || p->saveGradient)) return false;
+        }
+        return true;
+    }
+
+    /**
+     * Graph optimizer run before a node is evaluated. If this node ends a chain of elementwise
+     * nodes, the chain is compiled into a FusedProgram that makes one pass over memory instead
+     * of allocating and filling a buffer per node.
+     */
+    void optimize(){
+        if(onGPU || !isFusable(getOp())) return;
+        for(auto& arg : getArgs())
+            if(arg.contents->dims != dims && calculateDataLen(arg.contents->dims) != 1) return;
+
+        auto program = std::make_shared<FusedProgram>();
+        std::map<TensorContents *, size_t> registers;
+        std::vector<std::pair<bool, size_t>> refs;
+        std::vector<FusedInstruction> instructions;
+        fuseNode(this, nullptr, *program, registers, refs, instructions);
+        if(instructions.size() < 2) return;
+
+        // Operands refer to inputs or earlier instructions, inputs are numbered first
+        size_t numInputs = program->inputs.size();
+        for(auto& ins : instructions){
+            ins.arg1 = refs[ins.arg1].first ? refs[ins.arg1].second : numInputs + refs[ins.arg1].second;
+            ins.arg2 = refs[ins.arg2].first ? refs[ins.arg2].second : numInputs + refs[ins.arg2].second;
+        }
+        program->instructions = instructions;
+        fused = program;
+    }
+
+    static size_t fuseNode(TensorContents * node, TensorContents * consumer, FusedProgram& program,
+            std::map<TensorContents *, size_t>& registers, std::vector<std::pair<bool, size_t>>& refs,
+            std::vector<FusedInstruction>& instructions){
+        auto found = registers.find(node);
+        if(found != registers.end()) return found->second;
+
+        size_t ref = refs.size();
+        if(consumer && !node->canFuseInto(consumer)){
+            for(auto& arg : consumer->getArgs()){
+                if(arg.contents.get() == node){
+                    program.inputs.push_back(arg);
+                    break;
+                }
+            }
+            refs.push_back({true, program.inputs.size() - 1});
+            registers[node] = ref;
+            return ref;
+        }
+
+        std::vector<Tensor> args = node->getArgs();
+        size_t arg1 = fuseNode(args[0].contents.get(), node, program, registers, refs, instructions);
+        size_t arg2 = args.size() > 1 ? fuseNode(args[1].contents.get(), node, program, registers, refs, instructions) : arg1;
+
+        fusedOperation op;
+        switch(node->getOp()){
+            case NEG: op = FUSEDNEG; break;
+            case ADD: op = FUSEDADD; break;
+            case ADDSCALAR: op = FUSEDADDSCALAR; break;
+            case SUBTRACT: op = FUSEDSUBTRACT; break;
+            case SUBTRACTSCALAR: op = FUSEDSUBTRACTSCALAR; break;
+            case ELEMENTWISEMULT: op = FUSEDMULT; break;
+            case ELEMENTWISEMULTSCALAR: op = FUSEDMULTSCALAR; break;
+            case ELEMENTWISEDIVISION: op = FUSEDDIVISION; break;
+            case ELEMENTWISEDIVISIONSCALAR: op = FUSEDDIVISIONSCALAR; break;
+            case POW: op = FUSEDPOW; break;
+            case RELU: op = FUSEDRELU; break;
+            case DROPOUT: op = FUSEDDROPOUT; break;
+            default: op = FUSEDBINARIZE; break;
+        }
+
+        ref = refs.size();
+        refs.push_back({false, instructions.size()});
+        instructions.push_back({op, arg1, arg2, node->getScalar(), node->getRandomKey()});
+        registers[node] = ref;
+        if(consumer) program.interior.push_back(node->shared_from_this());
+        return ref;
+    }
+
+    void evalFused(){
+        std::vector<vDataPtr> inputData;
+        std::vector<size_t> inputStrides;
+        for(auto& t : fused->inputs){
+            inputData.push_back(evalTensor(t));
+            inputStrides.push_back(t.contents->dataLen == 1 ? 0 : 1);
+        }
+
+        data = nullptr;
+        for(size_t i = 0; i < inputData.size() && !data; ++i)
+            if(canOverwrite(fused->inputs[i], inputData[i])) data = takeBuffer(fused->inputs[i]);
+        if(!data) data = MAKEDATA;
+        DTYPESWITCH(dtype,
+            std::vector<T *> inputs;
+            for(auto& p : inputData) inputs.push_back(TDATA(p));
+            cpuFusedElementwise<T>(TDATA(data), inputs.data(), inputStrides.data(), inputs.size(),
+                    fused->instructions.data(), fused->instructions.size(), dataLen);
+        )
+
+    }
 
-     vDataPtr evalTensor(Tensor t){
+    /**
+     * Evaluates t and returns its data on this node's device and in this node's dtype, copying
+     * and converting it if either differs. INT8 data is dequantized with its scales.
+     */
+    vDataPtr evalTensor(Tensor t){
         vDataPtr p =  t.eval();
+        if(!t.contents->isContiguous()) p = t.contents->contiguousData();
+        if(t.contents->dtype == INT8){
+            vDataPtr ret = TensorMemoryPool::allocate(t.contents->dataLen * dtypeSize(dtype));
+            size_t channels = t.contents->dims.back();
+            DTYPESWITCH(dtype,
+                cpuDequantize<T>(TDATA(ret), static_cast<int8_t *>(p.get()), static_cast<float *>(t.contents->scales.get()),
+                        t.contents->dataLen / channels, channels);
+            )
+            p = ret;
+        }
+        else if(dtype != t.contents->dtype) p = convertData(p, t.contents->dtype, dtype, t.contents->dataLen, t.contents->onGPU);
+
         if(onGPU != t.contents->onGPU){
             #ifdef CUDA
-                p = TensorGPUUtility::convert(p, onGPU, dataLen);
+                p = TensorGPUUtility::convert(p, onGPU, t.contents->dataLen * dtypeSize(dtype));
             #else
                 throw std::runtime_error("Cannot select GPU since not compiled with CUDA");
             #endif
         }
         return p;
     }
+
+    /**
+     * Like evalTensor, but returns the data of a view in place when it is already on this node's
+     * device and in its dtype. argStrides is set to the element strides the returned data is read with.
+     */
+    vDataPtr evalStrided(Tensor t, std::vector<size_t>& argStrides){
+        vDataPtr p = t.eval();
+        if(t.contents->dtype == dtype && t.contents->onGPU == onGPU){
+            argStrides = t.contents->strides.empty() ? contiguousStrides(t.contents->dims) : t.contents->strides;
+            return p;
+        }
+        argStrides = contiguousStrides(t.contents->dims);
+        return evalTensor(t);
+    }
+
+    static vDataPtr convertData(vDataPtr p, dtypeOptions from, dtypeOptions dtype, size_t dataLen, bool onGPU){
+        if(from == dtype) return p;
+        vDataPtr ret = MAKEDATA;
+        #ifdef CUDA
+            if(onGPU){
+                if(dtype == FLOAT32) gpuSConvert(static_cast<float *>(ret.get()), static_cast<double *>(p.get()), dataLen);
+                else gpuSConvert(static_cast<double *>(ret.get()), static_cast<float *>(p.get()), dataLen);
+                return ret;
+            }
+        #else
+            (void) onGPU;
+        #endif
+        if(dtype == FLOAT32) cpuConvert(static_cast<float *>(ret.get()), static_cast<double *>(p.get()), dataLen);
+        else cpuConvert(static_cast<double *>(ret.get()), static_cast<float *>(p.get()), dataLen);
+        return ret;
+    }
 };
 
 class TensorNeg : public TensorContents{
     Tensor arg1;
 
     public:
-        TensorNeg(vDims dims, bool saveGradient, Tensor arg1, bool onGPU)
-            : arg1(arg1), TensorContents(dims, saveGradient, onGPU) {}
+        TensorNeg(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return NEG;}
+        std::vector<Tensor> getArgs() {return {arg1};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            data = MAKEDATA;
-            double * ret = data.get();
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
 
-            CALLFUNC(Neg, (ret, data1, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(Neg, (TDATA(data), TDATA(data1), dataLen));
+            )
         }
 
         void backward(Tensor gradient){
-            arg1.backward(gradient.neg());
+            addGradient(arg1, gradient.neg());
         }
 };
 
@@ -111,27 +841,29 @@ class TensorAdd : public TensorContents{
     Tensor arg1, arg2;
     
     public:
-        TensorAdd(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU)
-            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU) {}
+        TensorAdd(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return ADD;}
+        std::vector<Tensor> getArgs() {return {arg1, arg2};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            double * data2 = evalTensor(arg2).get();
-            data = MAKEDATA;
-            double * ret = data.get();
-
-            if(ISSCALAR(arg1)) {CALLFUNC(AddScalar, (ret, data2, data1[0], dataLen));}
-            else if(ISSCALAR(arg2)) {CALLFUNC(AddScalar, (ret, data1, data2[0], dataLen));}
-            else {CALLFUNC(Add, (ret, data1, data2, dataLen));}
+            auto data1 = evalTensor(arg1);
+            auto data2 = evalTensor(arg2);
+            data = outputBuffer(arg1, data1, arg2, data2);
+
+            DTYPESWITCH(dtype,
+                if(ISSCALAR(arg1)) {CALLFUNC(AddScalar, (TDATA(data), TDATA(data2), TDATA(data1)[0], dataLen));}
+                else if(ISSCALAR(arg2)) {CALLFUNC(AddScalar, (TDATA(data), TDATA(data1), TDATA(data2)[0], dataLen));}
+                else if(arg1.getDims() != arg2.getDims())
+                    {CALLFUNC(AddBroadcast, (TDATA(data), TDATA(data1), TDATA(data2), broadcastShape(dims, arg1.getDims(), arg2.getDims())));}
+                else {CALLFUNC(Add, (TDATA(data), TDATA(data1), TDATA(data2), dataLen));}
+            )
         }
 
         void backward(Tensor gradient){
-            if(ISSCALAR(arg1)) arg1.backward(gradient.reduceSum());
-            else arg1.backward(gradient);
-            if(ISSCALAR(arg2)) arg2.backward(gradient.reduceSum());
-            else arg2.backward(gradient);
+            addGradient(arg1, sumToShape(gradient, arg1));
+            addGradient(arg2, sumToShape(gradient, arg2));
         }
 };
 
@@ -140,21 +872,24 @@ class TensorAddScalar : public TensorContents{
     double n;
     
     public:
-        TensorAddScalar(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU)
-            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU) {}
+        TensorAddScalar(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return ADDSCALAR;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+        double getScalar() {return n;}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            data = MAKEDATA;
-            double * ret = data.get();
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
 
-            CALLFUNC(AddScalar, (ret, data1, n, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(AddScalar, (TDATA(data), TDATA(data1), n, dataLen));
+            )
         }
 
         void backward(Tensor gradient){
-            arg1.backward(gradient);
+            addGradient(arg1, gradient);
         }
 };
 
@@ -162,27 +897,29 @@ class TensorSubtract : public TensorContents{
     Tensor arg1, arg2;
     
     public:
-        TensorSubtract(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU)
-            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU) {}
+        TensorSubtract(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return SUBTRACT;}
+        std::vector<Tensor> getArgs() {return {arg1, arg2};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            double * data2 = evalTensor(arg2).get();
-            data = MAKEDATA;
-            double * ret = data.get();
-
-            if(ISSCALAR(arg1)) {CALLFUNC(ScalarSubtract, (ret, data2, data1[0], dataLen));}
-            else if(ISSCALAR(arg2)) {CALLFUNC(SubtractScalar, (ret, data1, data2[0], dataLen));}
-            else {CALLFUNC(Subtract, (ret, data1, data2, dataLen));}
+            auto data1 = evalTensor(arg1);
+            auto data2 = evalTensor(arg2);
+            data = outputBuffer(arg1, data1, arg2, data2);
+
+            DTYPESWITCH(dtype,
+                if(ISSCALAR(arg1)) {CALLFUNC(ScalarSubtract, (TDATA(data), TDATA(data2), TDATA(data1)[0], dataLen));}
+                else if(ISSCALAR(arg2)) {CALLFUNC(SubtractScalar, (TDATA(data), TDATA(data1), TDATA(data2)[0], dataLen));}
+                else if(arg1.getDims() != arg2.getDims())
+                    {CALLFUNC(SubtractBroadcast, (TDATA(data), TDATA(data1), TDATA(data2), broadcastShape(dims, arg1.getDims(), arg2.getDims())));}
+                else {CALLFUNC(Subtract, (TDATA(data), TDATA(data1), TDATA(data2), dataLen));}
+            )
         }
 
         void backward(Tensor gradient){
-            if(ISSCALAR(arg1)) arg1.backward(gradient.reduceSum());
-            else arg1.backward(gradient);
-            if(ISSCALAR(arg2)) arg2.backward(gradient.reduceSum().neg());
-            else arg2.backward(gradient.neg());
+            addGradient(arg1, sumToShape(gradient, arg1));
+            addGradient(arg2, sumToShape(gradient, arg2).neg());
         }
 };
 
@@ -191,21 +928,24 @@ class TensorSubtractScalar : public TensorContents{
     double n;
     
     public:
-        TensorSubtractScalar(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU)
-            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU) {}
+        TensorSubtractScalar(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return SUBTRACTSCALAR;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+        double getScalar() {return n;}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            data = MAKEDATA;
-            double * ret = data.get();
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
 
-            CALLFUNC(SubtractScalar, (ret, data1, n, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(SubtractScalar, (TDATA(data), TDATA(data1), n, dataLen));
+            )
         }
 
         void backward(Tensor gradient){
-            arg1.backward(gradient);
+            addGradient(arg1, gradient);
         }
 };
 
@@ -214,21 +954,24 @@ class TensorPow : public TensorContents{
     double n;
     
     public:
-        TensorPow(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU)
-            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU) {}
+        TensorPow(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return POW;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+        double getScalar() {return n;}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            data = MAKEDATA;
-            double * ret = data.get();
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
 
-            CALLFUNC(Pow, (ret, data1, n, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(Pow, (TDATA(data), TDATA(data1), n, dataLen));
+            )
         }
 
         void backward(Tensor gradient){
-            arg1.backward(gradient * n * (arg1.pow(n - 1)));
+            addGradient(arg1, gradient * n * (arg1.pow(n - 1)));
         }
 };
 
@@ -236,36 +979,300 @@ class TensorReduceSum : public TensorContents{
     Tensor arg1;
     
     public:
-        TensorReduceSum(vDims dims, bool saveGradient, Tensor arg1, bool onGPU)
-            : arg1(arg1), TensorContents(dims, saveGradient, onGPU) {}
+        TensorReduceSum(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return REDUCESUM;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+
+        void eval(){
+            auto data1 = evalTensor(arg1);
+            data = MAKEDATA;
+
+            DTYPESWITCH(dtype,
+                CALLFUNC(ReduceSum, (TDATA(data), TDATA(data1), arg1.contents->dataLen));
+            )
+        }
+
+        void backward(Tensor gradient){
+            addGradient(arg1, broadcastTo(gradient, arg1.getDims()));
+        }
+};
+
+class TensorSumToShape : public TensorContents{
+    Tensor arg1;
+
+    public:
+        TensorSumToShape(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return SUMTOSHAPE;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+
+        void eval(){
+            auto data1 = evalTensor(arg1);
+            data = MAKEDATA;
+
+            vDims data1Dims = arg1.getDims();
+            DTYPESWITCH(dtype,
+                CALLFUNC(SumToShape, (TDATA(data), TDATA(data1), broadcastShape(data1Dims, dims, data1Dims), dataLen));
+            )
+        }
+};
+
+// Sums grad over the dimensions that were broadcast to produce it, giving a gradient shaped like arg
+inline Tensor TensorContents::sumToShape(Tensor grad, Tensor arg){
+    if(grad.contents->dims == arg.contents->dims) return grad;
+    if(ISSCALAR(arg)) return grad.reduceSum();
+    return makeTensor(std::make_shared<TensorSumToShape>(arg.contents->dims, false, grad, grad.contents->onGPU, grad.contents->dtype));
+}
+
+// arg1 copied along its dimensions of size one to dims, aligned at their trailing dimensions
+class TensorBroadcast : public TensorContents{
+    Tensor arg1;
+
+    public:
+        TensorBroadcast(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return BROADCAST;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+
+        void eval(){
+            auto data1 = evalTensor(arg1);
+            data = MAKEDATA;
+
+            DTYPESWITCH(dtype,
+                CALLFUNC(StridedCopy, (TDATA(data), TDATA(data1), broadcastShape(dims, dims, arg1.getDims())));
+            )
+        }
+
+        void backward(Tensor gradient){
+            addGradient(arg1, sumToShape(gradient, arg1));
+        }
+};
+
+// Copies t along its dimensions of size one to dims, on t's device
+inline Tensor TensorContents::broadcastTo(Tensor t, vDims dims){
+    if(t.contents->dims == dims) return t;
+    return makeTensor(std::make_shared<TensorBroadcast>(dims, false, t, t.contents->onGPU, t.contents->dtype));
+}
+
+// One where arg1 equals arg2, broadcast to dims, and zero elsewhere
+class TensorEqual : public TensorContents{
+    Tensor arg1, arg2;
+
+    public:
+        TensorEqual(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return EQUAL;}
+        std::vector<Tensor> getArgs() {return {arg1, arg2};}
+
+        void eval(){
+            auto data1 = evalTensor(arg1);
+            auto data2 = evalTensor(arg2);
+            data = MAKEDATA;
+
+            DTYPESWITCH(dtype,
+                CALLFUNC(EqualBroadcast, (TDATA(data), TDATA(data1), TDATA(data2), broadcastShape(dims, arg1.getDims(), arg2.getDims())));
+            )
+        }
+};
+
+/**
+ * Sum (scaled by scale, so means are sums scaled by one over the count) or maximum over axes of
+ * arg1, which must be consecutive dimensions. dims is arg1's dims with axes removed or set to one.
+ */
+class TensorReduce : public TensorContents{
+    Tensor arg1;
+    std::vector<size_t> axes;
+    reductionOperation reduction;
+    double scale;
+
+    public:
+        TensorReduce(vDims dims, bool saveGradient, Tensor arg1, std::vector<size_t> axes, reductionOperation reduction, double scale, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), axes(axes), reduction(reduction), scale(scale), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return REDUCE;}
+        std::vector<Tensor> getArgs() {return {arg1};}
 
         void eval(){
-            auto dataV1 = evalTensor(arg1);
-            double * data1 = dataV1.get();
+            std::vector<size_t> strides1;
+            vDims argDims = arg1.getDims();
+            auto data1 = evalStrided(arg1, strides1);
+            if(!isContiguous(argDims, strides1)) data1 = evalTensor(arg1);
             data = MAKEDATA;
-            double * ret = data.get();
 
-            CALLFUNC(ReduceSum, (ret, data1, arg1.contents->dataLen));
+            size_t outer = 1, reduceLen = 1, inner = 1;
+            for(size_t d = 0; d < argDims.size(); ++d){
+                if(d < axes.front()) outer *= argDims[d];
+                else if(d <= axes.back()) reduceLen *= argDims[d];
+                else inner *= argDims[d];
+            }
+            DTYPESWITCH(dtype,
+                CALLFUNC(Reduce, (TDATA(data), TDATA(data1), outer, reduceLen, inner, reduction, (T) scale));
+            )
         }
 
         void backward(Tensor gradient){
-            arg1.backward(Tensor::ones(arg1.getDims()) * gradient);
+            vDims keptDims = arg1.getDims();
+            for(auto a : axes) keptDims[a] = 1;
+            Tensor grad = gradient.reshape(keptDims);
+
+            if(reduction == REDUCTIONSUM){
+                addGradient(arg1, broadcastTo(scale == 1 ? grad : grad * scale, arg1.getDims()));
+                return;
+            }
+
+            // The gradient of a maximum is split evenly between the elements equal to it
+            Tensor max = makeTensor(shared_from_this()).reshape(keptDims);
+            Tensor mask = makeTensor(std::make_shared<TensorEqual>(arg1.getDims(), false, arg1, max, onGPU, dtype));
+            addGradient(arg1, mask * (grad / mask.sum(axes, true)));
+        }
+};
+
+class TensorSoftmaxGrad : public TensorContents{
+    Tensor gradient, out;
+
+    public:
+        TensorSoftmaxGrad(vDims dims, bool saveGradient, Tensor gradient, Tensor out, bool onGPU, dtypeOptions dtype)
+            : gradient(gradient), out(out), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return SOFTMAXGRAD;}
+        std::vector<Tensor> getArgs() {return {gradient, out};}
+
+        void eval(){
+            auto dataG = evalTensor(gradient);
+            auto dataOut = evalTensor(out);
+            data = MAKEDATA;
+
+            DTYPESWITCH(dtype,
+                CALLFUNC(SoftmaxBackward, (TDATA(data), TDATA(dataG), TDATA(dataOut), dataLen / dims.back(), dims.back()));
+            )
+        }
+};
+
+// Softmax over the last dimension, computed per row in a single kernel
+class TensorSoftmax : public TensorContents{
+    Tensor arg1;
+
+    public:
+        TensorSoftmax(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return SOFTMAX;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+
+        void eval(){
+            auto data1 = evalTensor(arg1);
+            data = MAKEDATA;
+
+            DTYPESWITCH(dtype,
+                CALLFUNC(Softmax, (TDATA(data), TDATA(data1), dataLen / dims.back(), dims.back()));
+            )
+        }
+
+        void backward(Tensor gradient){
+            addGradient(arg1, makeTensor(std::make_shared<TensorSoftmaxGrad>(dims, false, gradient, makeTensor(shared_from_this()), onGPU, dtype)));
+        }
+};
+
+class TensorCrossEntropyGrad : public TensorContents{
+    Tensor gradient, logits, labels;
+
+    public:
+        TensorCrossEntropyGrad(vDims dims, bool saveGradient, Tensor gradient, Tensor logits, Tensor labels, bool onGPU, dtypeOptions dtype)
+            : gradient(gradient), logits(logits), labels(labels), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return CROSSENTROPYGRAD;}
+        std::vector<Tensor> getArgs() {return {gradient, logits, labels};}
+
+        void eval(){
+            auto dataG = evalTensor(gradient);
+            auto dataLogits = evalTensor(logits);
+            auto dataLabels = evalTensor(labels);
+            data = MAKEDATA;
+
+            DTYPESWITCH(dtype,
+                CALLFUNC(CrossEntropyBackward, (TDATA(data), TDATA(dataG), TDATA(dataLogits), TDATA(dataLabels),
+                        dataLen / dims.back(), dims.back(), labels.getDims() != dims));
+            )
+        }
+};
+
+/**
+ * Mean over rows of the cross entropy between softmax(logits) over the last dimension and the
+ * labels, which are class indices or, when shaped like logits, target distributions.
+ */
+class TensorCrossEntropy : public TensorContents{
+    Tensor logits, labels;
+
+    public:
+        TensorCrossEntropy(vDims dims, bool saveGradient, Tensor logits, Tensor labels, bool onGPU, dtypeOptions dtype)
+            : logits(logits), labels(labels), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return CROSSENTROPY;}
+        std::vector<Tensor> getArgs() {return {logits, labels};}
+
+        void eval(){
+            auto dataLogits = evalTensor(logits);
+            auto dataLabels = evalTensor(labels);
+            data = MAKEDATA;
+
+            vDims logitDims = logits.getDims();
+            size_t cols = logitDims.back();
+            size_t rows = calculateDataLen(logitDims) / cols;
+            bool indexLabels = labels.getDims() != logitDims;
+            DTYPESWITCH(dtype,
+                if(indexLabels && !onGPU){
+                    T * l = TDATA(dataLabels);
+                    for(size_t r = 0; r < rows; ++r)
+                        if(!(l[r] >= 0 && l[r] < cols) || l[r] != (size_t) l[r]) throw std::runtime_error("Labels of crossEntropy must be class indices");
+                }
+                CALLFUNC(CrossEntropy, (TDATA(data), TDATA(dataLogits), TDATA(dataLabels), rows, cols, indexLabels));
+            )
+        }
+
+        void backward(Tensor gradient){
+            addGradient(logits, makeTensor(std::make_shared<TensorCrossEntropyGrad>(logits.getDims(), false, gradient, logits, labels, onGPU, dtype)));
+        }
+};
+
+// Index of the largest element of each row of the last dimension, which has no gradient
+class TensorArgmax : public TensorContents{
+    Tensor arg1;
+
+    public:
+        TensorArgmax(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return ARGMAX;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+
+        void eval(){
+            auto data1 = evalTensor(arg1);
+            data = MAKEDATA;
+
+            size_t cols = arg1.getDims().back();
+            DTYPESWITCH(dtype,
+                CALLFUNC(Argmax, (TDATA(data), TDATA(data1), dataLen, cols));
+            )
         }
 };
 
 class TensorZeroes : public TensorContents{
     public:
-        TensorZeroes(vDims dims, bool saveGradient, bool onGPU) : TensorContents(dims, saveGradient, onGPU) {}
+        TensorZeroes(vDims dims, bool saveGradient, bool onGPU, dtypeOptions dtype) : TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return ZEROES;}
 
         void eval(){
             data = MAKEDATA;
-            double * ret = data.get();
 
-            CALLFUNC(Zeroes, (ret, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(Zeroes, (TDATA(data), dataLen));
+            )
         }
 
         void backward(Tensor gradient){
@@ -275,15 +1282,16 @@ class TensorZeroes : public TensorContents{
 
 class TensorOnes : public TensorContents{
     public:
-        TensorOnes(vDims dims, bool saveGradient, bool onGPU) : TensorContents(dims, saveGradient, onGPU) {}
+        TensorOnes(vDims dims, bool saveGradient, bool onGPU, dtypeOptions dtype) : TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return ONES;}
 
         void eval(){
             data = MAKEDATA;
-            double * ret = data.get();
 
-            CALLFUNC(Ones, (ret, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(Ones, (TDATA(data), dataLen));
+            )
         }
 
         void backward(Tensor gradient){
@@ -295,15 +1303,16 @@ class TensorFill : public TensorContents{
     double n;
 
     public:
-        TensorFill(vDims dims, bool saveGradient, double n, bool onGPU) : TensorContents(dims, saveGradient, onGPU), n(n) {}
+        TensorFill(vDims dims, bool saveGradient, double n, bool onGPU, dtypeOptions dtype) : TensorContents(dims, saveGradient, onGPU, dtype), n(n) {}
 
         operation getOp() {return FILL;}
 
         void eval(){
             data = MAKEDATA;
-            double * ret = data.get();
 
-            CALLFUNC(Fill, (ret, n, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(Fill, (TDATA(data), n, dataLen));
+            )
         }
 
         void backward(Tensor gradient){
@@ -315,27 +1324,29 @@ class TensorElementwiseMult : public TensorContents{
     Tensor arg1, arg2;
     
     public:
-        TensorElementwiseMult(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU)
-            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU) {}
+        TensorElementwiseMult(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return ELEMENTWISEMULT;}
+        std::vector<Tensor> getArgs() {return {arg1, arg2};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            double * data2 = evalTensor(arg2).get();
-            data = MAKEDATA;
-            double * ret = data.get();
-
-            if(ISSCALAR(arg1)) {CALLFUNC(ElementwiseMultScalar, (ret, data2, data1[0], dataLen));}
-            else if(ISSCALAR(arg2)) {CALLFUNC(ElementwiseMultScalar, (ret, data1, data2[0], dataLen));}
-            else {CALLFUNC(ElementwiseMult, (ret, data1, data2, dataLen));}
+            auto data1 = evalTensor(arg1);
+            auto data2 = evalTensor(arg2);
+            data = outputBuffer(arg1, data1, arg2, data2);
+
+            DTYPESWITCH(dtype,
+                if(ISSCALAR(arg1)) {CALLFUNC(ElementwiseMultScalar, (TDATA(data), TDATA(data2), TDATA(data1)[0], dataLen));}
+                else if(ISSCALAR(arg2)) {CALLFUNC(ElementwiseMultScalar, (TDATA(data), TDATA(data1), TDATA(data2)[0], dataLen));}
+                else if(arg1.getDims() != arg2.getDims())
+                    {CALLFUNC(ElementwiseMultBroadcast, (TDATA(data), TDATA(data1), TDATA(data2), broadcastShape(dims, arg1.getDims(), arg2.getDims())));}
+                else {CALLFUNC(ElementwiseMult, (TDATA(data), TDATA(data1), TDATA(data2), dataLen));}
+            )
         }
 
         void backward(Tensor gradient){
-            if(ISSCALAR(arg1)) arg1.backward((arg2 * gradient).reduceSum());
-            else arg1.backward(arg2 * gradient);
-            if(ISSCALAR(arg2)) arg2.backward((arg1 * gradient).reduceSum());
-            else arg2.backward(arg1 * gradient);
+            addGradient(arg1, sumToShape(arg2 * gradient, arg1));
+            addGradient(arg2, sumToShape(arg1 * gradient, arg2));
         }
 };
 
@@ -344,21 +1355,24 @@ class TensorElementwiseMultScalar : public TensorContents{
     double n;
     
     public:
-        TensorElementwiseMultScalar(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU)
-            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU) {}
+        TensorElementwiseMultScalar(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return ELEMENTWISEMULTSCALAR;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+        double getScalar() {return n;}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            data = MAKEDATA;
-            double * ret = data.get();
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
 
-            CALLFUNC(ElementwiseMultScalar, (ret, data1, n, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(ElementwiseMultScalar, (TDATA(data), TDATA(data1), n, dataLen));
+            )
         }
 
         void backward(Tensor gradient){
-            arg1.backward(gradient * n);
+            addGradient(arg1, gradient * n);
         }
 };
 
@@ -366,21 +1380,52 @@ class TensorRelu : public TensorContents{
     Tensor arg1;
     
     public:
-        TensorRelu(vDims dims, bool saveGradient, Tensor arg1, bool onGPU)
-            : arg1(arg1), TensorContents(dims, saveGradient, onGPU) {}
+        TensorRelu(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return RELU;}
+        std::vector<Tensor> getArgs() {return {arg1};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            data = MAKEDATA;
-            double * ret = data.get();
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
+
+            DTYPESWITCH(dtype,
+                CALLFUNC(Relu, (TDATA(data), TDATA(data1), dataLen));
+            )
+        }
+
+        void backward(Tensor gradient){
+            addGradient(arg1, arg1.binarize() * gradient);
+        }
+};
+
+class TensorDropout : public TensorContents{
+    Tensor arg1;
+    double p;
+    uint64_t key;
+
+    public:
+        TensorDropout(vDims dims, bool saveGradient, Tensor arg1, double p, uint64_t key, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), p(p), key(key), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return DROPOUT;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+        double getScalar() {return p;}
+        uint64_t getRandomKey() {return key;}
 
-            CALLFUNC(Relu, (ret, data1, dataLen));
+        void eval(){
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
+
+            DTYPESWITCH(dtype,
+                CALLFUNC(Dropout, (TDATA(data), TDATA(data1), p, key, dataLen));
+            )
         }
 
+        // The same key keeps and scales the same elements of the gradient
         void backward(Tensor gradient){
-            arg1.backward(arg1.binarize() * gradient);
+            addGradient(arg1, makeTensor(std::make_shared<TensorDropout>(dims, false, gradient, p, key, onGPU, dtype)));
         }
 };
 
@@ -388,22 +1433,101 @@ class TensorBinarize : public TensorContents{
     Tensor arg1;
     
     public:
-        TensorBinarize(vDims dims, bool saveGradient, Tensor arg1, bool onGPU)
-            : arg1(arg1), TensorContents(dims, saveGradient, onGPU) {}
+        TensorBinarize(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return BINARIZE;}
+        std::vector<Tensor> getArgs() {return {arg1};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            data = MAKEDATA;
-            double * ret = data.get();
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
 
-            CALLFUNC(Binarize, (ret, data1, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(Binarize, (TDATA(data), TDATA(data1), dataLen));
+            )
         }
 
         void backward(Tensor gradient){
             (void) gradient;
-            arg1.backward(Tensor::zeroes(dims));
+            addGradient(arg1, Tensor::zeroes(dims, false, DEFAULTDEVICE, dtype));
+        }
+};
+
+/**
+ * Shape of a (batched) matrix product of a [batch, m, k] or [m, k] left operand with a
+ * [batch, k, n] or [k, n] right operand, read through the element strides of each operand.
+ * An operand without a batch, or with a batch of one, is broadcast across the batch and has a
+ * batch stride of zero.
+ */
+struct MatmulShape{
+    size_t batch, m, n, k;
+    MatmulStrides strides;
+
+    MatmulShape(vDims dims1, vDims dims2, std::vector<size_t> strides1 = {}, std::vector<size_t> strides2 = {}){
+        size_t batch1 = dims1.size() == 3 ? dims1[0] : 1;
+        size_t batch2 = dims2.size() == 3 ? dims2[0] : 1;
+        batch = batch1 > batch2 ? batch1 : batch2;
+        m = dims1[dims1.size() - 2];
+        k = dims1[dims1.size() - 1];
+        n = dims2[dims2.size() - 1];
+
+        if(strides1.empty()) strides1 = TensorContents::contiguousStrides(dims1);
+        if(strides2.empty()) strides2 = TensorContents::contiguousStrides(dims2);
+        strides.batch1 = batch1 == batch && batch > 1 ? strides1[0] : 0;
+        strides.row1 = strides1[dims1.size() - 2];
+        strides.col1 = strides1[dims1.size() - 1];
+        strides.batch2 = batch2 == batch && batch > 1 ? strides2[0] : 0;
+        strides.row2 = strides2[dims2.size() - 2];
+        strides.col2 = strides2[dims2.size() - 1];
+    }
+};
+
+class TensorMatmulGradLeft : public TensorContents{
+    Tensor gradient, arg2;
+
+    public:
+        TensorMatmulGradLeft(vDims dims, bool saveGradient, Tensor gradient, Tensor arg2, bool onGPU, dtypeOptions dtype)
+            : gradient(gradient), arg2(arg2), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return MATMULGRADLEFT;}
+        std::vector<Tensor> getArgs() {return {gradient, arg2};}
+
+        void eval(){
+            std::vector<size_t> strides2;
+            auto dataG = evalTensor(gradient);
+            auto data2 = evalStrided(arg2, strides2);
+            data = MAKEDATA;
+
+            MatmulShape shape(dims, arg2.getDims(), {}, strides2);
+            DTYPESWITCH(dtype,
+                cpuMatmulGradLeft<T>(TDATA(data), TDATA(dataG), TDATA(data2), shape.batch, shape.m, shape.n, shape.k,
+                        shape.strides, shape.strides.batch1 == 0 && shape.batch > 1);
+            )
+        }
+};
+
+class TensorMatmulGradRight : public TensorContents{
+    Tensor arg1, gradient;
+
+    public:
+        TensorMatmulGradRight(vDims dims, bool saveGradient, Tensor arg1, Tensor gradient, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), gradient(gradient), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return MATMULGRADRIGHT;}
+        std::vector<Tensor> getArgs() {return {arg1, gradient};}
+
+        void eval(){
+            std::vector<size_t> strides1;
+            auto data1 = evalStrided(arg1, strides1);
+            auto dataG = evalTensor(gradient);
+            data = MAKEDATA;
+
+            MatmulShape shape(arg1.getDims(), dims, strides1, {});
+            DTYPESWITCH(dtype,
+                cpuMatmulGradRight<T>(TDATA(data), TDATA(data1), TDATA(dataG), shape.batch, shape.m, shape.n, shape.k,
+                        shape.strides, shape.strides.batch2 == 0 && shape.batch > 1);
+            )
         }
 };
 
@@ -411,61 +1535,171 @@ class TensorMatmul : public TensorContents{
     Tensor arg1, arg2;
     
     public:
-        TensorMatmul(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU)
-            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU) {}
+        TensorMatmul(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return MATMUL;}
+        std::vector<Tensor> getArgs() {return {arg1, arg2};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            double * data2 = evalTensor(arg2).get();
-            data = MAKEDATA;
-            double * ret = data.get();
-
             vDims data1Dims = arg1.getDims();
             vDims data2Dims = arg2.getDims();
 
-            if(dims.size() == 2)
-                {CALLFUNC(Matmul2d, (ret, data1, data2, dims[0], dims[1], data1Dims[1], data2Dims[1]));}
-            else
-                {CALLFUNC(Matmul3d, (ret, data1, data2, dims[0], dims[1], dims[2], data1Dims[1], data1Dims[2], data2Dims[1]));}
+            // Quantized right operands are multiplied in int8 and dequantized by the kernel
+            if(arg2.contents->dtype == INT8 && !onGPU){
+                auto data1 = evalTensor(arg1);
+                auto data2 = arg2.eval();
+                data = MAKEDATA;
+
+                MatmulShape shape(data1Dims, data2Dims);
+                DTYPESWITCH(dtype,
+                    cpuMatmulInt8<T>(TDATA(data), TDATA(data1), static_cast<int8_t *>(data2.get()),
+                            static_cast<float *>(arg2.contents->scales.get()), shape.batch, shape.m, shape.n, shape.k,
+                            shape.strides.batch1, shape.strides.batch2);
+                )
+                return;
+            }
+
+            if(onGPU){
+                auto data1 = evalTensor(arg1);
+                auto data2 = evalTensor(arg2);
+                data = MAKEDATA;
+
+                DTYPESWITCH(dtype,
+                    if(dims.size() == 2)
+                        {CALLFUNC(Matmul2d, (TDATA(data), TDATA(data1), TDATA(data2), dims[0], dims[1], data1Dims[1], data2Dims[1]));}
+                    else if(data1Dims.size() == 3 && data2Dims.size() == 2)
+                        {CALLFUNC(Matmul3d, (TDATA(data), TDATA(data1), TDATA(data2), dims[0], dims[1], dims[2], data1Dims[1], data1Dims[2], data2Dims[1]));}
+                    else throw std::runtime_error("Batched right operands of matmul are not available on GPU");
+                )
+                return;
+            }
+
+            // Transposed and sliced operands are read in place through their strides
+            std::vector<size_t> strides1, strides2;
+            auto data1 = evalStrided(arg1, strides1);
+            auto data2 = evalStrided(arg2, strides2);
+            data = MAKEDATA;
+
+            MatmulShape shape(data1Dims, data2Dims, strides1, strides2);
+            DTYPESWITCH(dtype,
+                cpuMatmulBatched<T>(TDATA(data), TDATA(data1), TDATA(data2), shape.batch, shape.m, shape.n, shape.k, shape.strides);
+            )
         }
 
         void backward(Tensor gradient){
-            if(dims.size() == 2){
-                arg1.backward(gradient.matmul(arg2.transpose()));
-                arg2.backward(arg1.transpose().matmul(gradient));
-            }
-            else{
-                throw std::runtime_error("Backwards not yet implemented for batched tenor multiplication :(");
-                //arg1.backward(gradient.matmul(arg2.transpose()));
-                //arg2.backward();
+            if(onGPU){
+                if(dims.size() != 2) throw std::runtime_error("Backwards of batched matmul is not available on GPU");
+                addGradient(arg1, gradient.matmul(arg2.transpose()));
+                addGradient(arg2, arg1.transpose().matmul(gradient));
+                return;
             }
+
+            // Operands broadcast across the batch get their gradient summed over the batch by the kernels
+            addGradient(arg1, makeTensor(std::make_shared<TensorMatmulGradLeft>(arg1.getDims(), false, gradient, arg2, onGPU, dtype)));
+            addGradient(arg2, makeTensor(std::make_shared<TensorMatmulGradRight>(arg2.getDims(), false, arg1, gradient, onGPU, dtype)));
         }
 };
 
+// A view of arg1 with its last two dimensions swapped
 class TensorTranspose : public TensorContents{
     Tensor arg1;
     
     public:
-        TensorTranspose(vDims dims, bool saveGradient, Tensor arg1, bool onGPU)
-            : arg1(arg1), TensorContents(dims, saveGradient, onGPU) {}
+        TensorTranspose(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return TRANSPOSE;}
+        std::vector<Tensor> getArgs() {return {arg1};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
+            std::vector<size_t> strides1;
+            auto data1 = evalStrided(arg1, strides1);
+            std::swap(strides1[dims.size() - 2], strides1[dims.size() - 1]);
+            makeView(data1, strides1, 0);
+        }
+
+        void backward(Tensor gradient){
+            addGradient(arg1, gradient.transpose());
+        }
+};
+
+// A view of arg1 whose dimension i is dimension order[i] of arg1
+class TensorPermute : public TensorContents{
+    Tensor arg1;
+    std::vector<size_t> order;
+
+    public:
+        TensorPermute(vDims dims, bool saveGradient, Tensor arg1, std::vector<size_t> order, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), order(order), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return PERMUTE;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+
+        void eval(){
+            std::vector<size_t> strides1;
+            auto data1 = evalStrided(arg1, strides1);
+            std::vector<size_t> viewStrides(order.size());
+            for(size_t i = 0; i < order.size(); ++i) viewStrides[i] = strides1[order[i]];
+            makeView(data1, viewStrides, 0);
+        }
+
+        void backward(Tensor gradient){
+            std::vector<size_t> inverse(order.size());
+            for(size_t i = 0; i < order.size(); ++i) inverse[order[i]] = i;
+            addGradient(arg1, gradient.permute(inverse));
+        }
+};
+
+// Scatters gradient into zeroes of dims at the elements a TensorSlice with the same arguments reads
+class TensorSliceGrad : public TensorContents{
+    Tensor gradient;
+    size_t dim, start, step;
+
+    public:
+        TensorSliceGrad(vDims dims, bool saveGradient, Tensor gradient, size_t dim, size_t start, size_t step, bool onGPU, dtypeOptions dtype)
+            : gradient(gradient), dim(dim), start(start), step(step), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return SLICEGRAD;}
+        std::vector<Tensor> getArgs() {return {gradient};}
+
+        void eval(){
+            auto dataG = evalTensor(gradient);
             data = MAKEDATA;
-            double * ret = data.get();
 
-            if(dims.size() == 2)
-                {CALLFUNC(Transpose2d, (ret, data1, dims[0], dims[1]));}
-            else
-                {CALLFUNC(Transpose3d, (ret, data1, dims[0], dims[1], dims[2]));}
+            vDims gradDims = gradient.getDims();
+            std::vector<size_t> retStrides = contiguousStrides(dims);
+            size_t offset = start * retStrides[dim];
+            retStrides[dim] *= step;
+            DTYPESWITCH(dtype,
+                CALLFUNC(Zeroes, (TDATA(data), dataLen));
+                CALLFUNC(StridedCopy, (TDATA(data) + offset, TDATA(dataG), mergeDims(gradDims, retStrides, contiguousStrides(gradDims))));
+            )
+        }
+};
+
+// A view of every step-th index of dimension dim of arg1, starting at start
+class TensorSlice : public TensorContents{
+    Tensor arg1;
+    size_t dim, start, step;
+
+    public:
+        TensorSlice(vDims dims, bool saveGradient, Tensor arg1, size_t dim, size_t start, size_t step, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), dim(dim), start(start), step(step), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return SLICE;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+
+        void eval(){
+            std::vector<size_t> strides1;
+            auto data1 = evalStrided(arg1, strides1);
+            size_t offset = start * strides1[dim];
+            strides1[dim] *= step;
+            makeView(data1, strides1, offset);
         }
 
         void backward(Tensor gradient){
-            arg1.backward(gradient.transpose());
+            addGradient(arg1, makeTensor(std::make_shared<TensorSliceGrad>(arg1.getDims(), false, gradient, dim, start, step, onGPU, dtype)));
         }
 };
 
@@ -473,17 +1707,37 @@ class TensorReshape : public TensorContents{
     Tensor arg1;
     
     public:
-        TensorReshape(vDims dims, bool saveGradient, Tensor arg1, bool onGPU)
-            : arg1(arg1), TensorContents(dims, saveGradient, onGPU) {}
+        TensorReshape(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return RESHAPE;}
+        std::vector<Tensor> getArgs() {return {arg1};}
 
         void eval(){
             data = evalTensor(arg1);
         }
 
         void backward(Tensor gradient){
-            arg1.backward(gradient.reshape(arg1.getDims()));
+            addGradient(arg1, gradient.reshape(arg1.getDims()));
+        }
+};
+
+class TensorCast : public TensorContents{
+    Tensor arg1;
+
+    public:
+        TensorCast(vDims dims, bool saveGradient, Tensor arg1, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), TensorContents(dims, saveGradient, onGPU, dtype) {}
+
+        operation getOp() {return CAST;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+
+        void eval(){
+            data = evalTensor(arg1);
+        }
+
+        void backward(Tensor gradient){
+            addGradient(arg1, gradient.cast(arg1.getDtype()));
         }
 };
 
@@ -491,27 +1745,29 @@ class TensorElementwiseDivision : public TensorContents{
     Tensor arg1, arg2;
     
     public:
-        TensorElementwiseDivision(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU)
-            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU) {}
+        TensorElementwiseDivision(vDims dims, bool saveGradient, Tensor arg1, Tensor arg2, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), arg2(arg2), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return ELEMENTWISEDIVISION;}
+        std::vector<Tensor> getArgs() {return {arg1, arg2};}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            double * data2 = evalTensor(arg2).get();
-            data = MAKEDATA;
-            double * ret = data.get();
-
-            if(ISSCALAR(arg1)) {CALLFUNC(ElementwiseDivisionScalar2, (ret, data2, data1[0], dataLen));}
-            else if(ISSCALAR(arg2)) {CALLFUNC(ElementwiseDivisionScalar, (ret, data1, data2[0], dataLen));}
-            else {CALLFUNC(ElementwiseDivision, (ret, data1, data2, dataLen));}
+            auto data1 = evalTensor(arg1);
+            auto data2 = evalTensor(arg2);
+            data = outputBuffer(arg1, data1, arg2, data2);
+
+            DTYPESWITCH(dtype,
+                if(ISSCALAR(arg1)) {CALLFUNC(ElementwiseDivisionScalar2, (TDATA(data), TDATA(data2), TDATA(data1)[0], dataLen));}
+                else if(ISSCALAR(arg2)) {CALLFUNC(ElementwiseDivisionScalar, (TDATA(data), TDATA(data1), TDATA(data2)[0], dataLen));}
+                else if(arg1.getDims() != arg2.getDims())
+                    {CALLFUNC(ElementwiseDivisionBroadcast, (TDATA(data), TDATA(data1), TDATA(data2), broadcastShape(dims, arg1.getDims(), arg2.getDims())));}
+                else {CALLFUNC(ElementwiseDivision, (TDATA(data), TDATA(data1), TDATA(data2), dataLen));}
+            )
         }
 
         void backward(Tensor gradient){
-            if(ISSCALAR(arg1)) arg1.backward((gradient / arg2).reduceSum());
-            else arg1.backward(gradient / arg2);
-            if(ISSCALAR(arg2)) arg2.backward((gradient.neg() * arg1 / arg2.pow(2)).reduceSum());
-            else arg2.backward(gradient.neg() * arg1 / arg2.pow(2));
+            addGradient(arg1, sumToShape(gradient / arg2, arg1));
+            addGradient(arg2, sumToShape(gradient.neg() * arg1 / arg2.pow(2), arg2));
         }
 };
 
@@ -520,40 +1776,48 @@ class TensorElementwiseDivisionScalar : public TensorContents{
     double n;
     
     public:
-        TensorElementwiseDivisionScalar(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU)
-            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU) {}
+        TensorElementwiseDivisionScalar(vDims dims, bool saveGradient, Tensor arg1, double n, bool onGPU, dtypeOptions dtype)
+            : arg1(arg1), n(n), TensorContents(dims, saveGradient, onGPU, dtype) {}
 
         operation getOp() {return ELEMENTWISEDIVISIONSCALAR;}
+        std::vector<Tensor> getArgs() {return {arg1};}
+        double getScalar() {return n;}
 
         void eval(){
-            double * data1 = evalTensor(arg1).get();
-            data = MAKEDATA;
-            double * ret = data.get();
+            auto data1 = evalTensor(arg1);
+            data = outputBuffer(arg1, data1);
 
-            CALLFUNC(ElementwiseDivisionScalar, (ret, data1, n, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(ElementwiseDivisionScalar, (TDATA(data), TDATA(data1), n, dataLen));
+            )
         }
 
         void backward(Tensor gradient){
-            arg1.backward(gradient / n);
+            addGradient(arg1, gradient / n);
         }
 };
 
 class TensorFillRandom : public TensorContents{
     double mean, stddev;
+    uint64_t key;
 
     public:
-        TensorFillRandom(vDims dims, bool saveGradient, double mean, double stddev, bool onGPU) : TensorContents(dims, saveGradient, onGPU), mean(mean), stddev(stddev) {}
+        TensorFillRandom(vDims dims, bool saveGradient, double mean, double stddev, uint64_t key, bool onGPU, dtypeOptions dtype)
+            : TensorContents(dims, saveGradient, onGPU, dtype), mean(mean), stddev(stddev), key(key) {}
 
         operation getOp() {return FILLRANDOM;}
 
         void eval(){
             data = MAKEDATA;
-            double * ret = data.get();
 
-            CALLFUNC(FillRandom, (ret, mean, stddev, dataLen));
+            DTYPESWITCH(dtype,
+                CALLFUNC(FillRandom, (TDATA(data), mean, stddev, key, dataLen));
+            )
         }
 
         void backward(Tensor gradient){
             (void) gradient;
         }
 };
+
+#endif
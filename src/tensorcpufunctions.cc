@@ -6,193 +6,1217 @@
  * @date November 2024
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <cmath>
-#include <random>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
+#include "tensorautotune.h"
 #include "tensorcpufunctions.h"
+#include "tensormemorypool.h"
+#include "tensorsimd.h"
 
-std::mt19937 generator(7);
+#ifdef OMP
+    #include <omp.h>
+#endif
 
-void cpuNeg(double * ret, double * data1, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = -data1[i];
+#define FUSEDBLOCKSIZE 512
+
+// Elementwise kernels split their data between threads in blocks of this many elements, a
+// multiple of every vector size so each block starts with the alignment of the buffer
+#define SIMDBLOCKSIZE 4096
+#define TWOPI 6.283185307179586
+
+// Rows longer than this are reduced in blocks by separate threads when there are too few rows
+// to occupy every thread
+#define REDUCTIONBLOCKSIZE 8192
+
+// GEMM register block (GEMMMR x GEMMNR, GEMMNR a multiple of every vector width), L1 sized depth
+// (GEMMKC), L2 sized row block (GEMMMC) and column block (GEMMNC). Row blocks are packed
+// GEMMMCCHUNK at a time and each parallel tile covers GEMMNBLOCK column panels. The depth and row
+// block are defaults the autotuner may replace.
+#define GEMMMR 4
+#define GEMMNR 16
+#define GEMMKC 256
+#define GEMMMC 64
+#define GEMMNC 2048
+#define GEMMMCCHUNK 16
+#define GEMMNBLOCK 4
+#define GEMMSMALL (16 * 16 * 16)
+
+// Products up to this size may be tuned to skip packing, and each size is capped at
+// GEMMTUNEMAXDIM when timing candidates
+#define GEMMTUNEMAXUNPACKED (256 * 256 * 256)
+#define GEMMTUNEMAXDIM 512
+
+// Depth block of the int8 GEMM, whose int16 panels fill as much of L1 as GEMMKC floats
+#define INT8KC 512
+
+static simdLevel detectSimdLevel(){
+    #ifdef SIMDX86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SIMDAVX512;
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMDAVX2;
+        return SIMDSSE;
+    #else
+        return SIMDNONE;
+    #endif
+}
+
+static const simdLevel supportedSimdLevel = detectSimdLevel();
+static simdLevel selectedSimdLevel = supportedSimdLevel;
+
+simdLevel cpuGetSimdLevel(){
+    return selectedSimdLevel;
+}
+
+void cpuSetSimdLevel(simdLevel level){
+    selectedSimdLevel = level < supportedSimdLevel ? level : supportedSimdLevel;
+}
+
+// Runs the elementwise kernel of the selected instruction set on one block
+template<simdOperation OP, typename T>
+static void simdElementwise(T * ret, const T * a, const T * b, T n, size_t len){
+    switch(selectedSimdLevel){
+        #ifdef SIMDX86
+            case SIMDAVX512: SimdAvx512::simdElementwise<OP, T>(ret, a, b, n, len); return;
+            case SIMDAVX2: SimdAvx2::simdElementwise<OP, T>(ret, a, b, n, len); return;
+            case SIMDSSE: SimdSse::simdElementwise<OP, T>(ret, a, b, n, len); return;
+        #endif
+        default: SimdScalar::simdElementwise<OP, T>(ret, a, b, n, len); return;
     }
 }
 
-void cpuAdd(double * ret, double * data1, double * data2, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] + data2[i];
+template<typename T>
+static T simdReduce(const T * a, size_t len, reductionOperation op){
+    switch(selectedSimdLevel){
+        #ifdef SIMDX86
+            case SIMDAVX512: return SimdAvx512::simdReduce<T>(a, len, op);
+            case SIMDAVX2: return SimdAvx2::simdReduce<T>(a, len, op);
+            case SIMDSSE: return SimdSse::simdReduce<T>(a, len, op);
+        #endif
+        default: return SimdScalar::simdReduce<T>(a, len, op);
     }
 }
 
-void cpuAddScalar(double * ret, double * data1, double n, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] + n;
+template<typename T>
+static T simdMaxAbs(const T * a, size_t len){
+    switch(selectedSimdLevel){
+        #ifdef SIMDX86
+            case SIMDAVX512: return SimdAvx512::simdMaxAbs<T>(a, len);
+            case SIMDAVX2: return SimdAvx2::simdMaxAbs<T>(a, len);
+            case SIMDSSE: return SimdSse::simdMaxAbs<T>(a, len);
+        #endif
+        default: return SimdScalar::simdMaxAbs<T>(a, len);
     }
 }
 
-void cpuSubtract(double * ret, double * data1, double * data2, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] - data2[i];
+// Threads OpenMP would start here, one inside a parallel region
+static size_t maxThreads(){
+    #ifdef OMP
+        return omp_in_parallel() ? 1 : (size_t) omp_get_max_threads();
+    #else
+        return 1;
+    #endif
+}
+
+/**
+ * Whether kernels can be timed here. Not inside a parallel region, and not on a thread pool
+ * worker (which runs with one OpenMP thread on a machine with more), since there every kernel
+ * would look fastest serial. One kernel is tuned at a time, others use their defaults meanwhile.
+ */
+static bool canTune(){
+    #ifdef OMP
+        if(omp_in_parallel() || (omp_get_max_threads() == 1 && omp_get_num_procs() > 1)) return false;
+    #endif
+    return true;
+}
+
+static std::mutex tuningLock;
+
+// Shapes are tuned by class, the power of two a size rounds up to
+static std::string sizeClass(size_t n){
+    size_t c = 0;
+    while(((size_t) 1 << c) < n) ++c;
+    return std::to_string(c);
+}
+
+template<typename T>
+static std::string typeName(){
+    return sizeof(T) == sizeof(float) ? "float32" : "float64";
+}
+
+// Fastest of three runs after a warm up run, in seconds
+template<typename F>
+static double benchmark(F run){
+    run();
+    double best = std::numeric_limits<double>::infinity();
+    for(int rep = 0; rep < 3; ++rep){
+        auto start = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
     }
+    return best;
 }
 
-void cpuSubtractScalar(double * ret, double * data1, double n, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] - n;
+// Thread counts tried for a kernel: all of them, half and one
+static std::vector<size_t> threadCandidates(){
+    size_t threads = maxThreads();
+    std::vector<size_t> ret = {threads};
+    if(threads / 2 > 1) ret.push_back(threads / 2);
+    if(threads > 1) ret.push_back(1);
+    return ret;
+}
+
+template<simdOperation OP, typename T>
+static void runElementwise(T * ret, const T * data1, const T * data2, T n, size_t dataLen, size_t numThreads){
+    size_t numBlocks = (dataLen + SIMDBLOCKSIZE - 1) / SIMDBLOCKSIZE;
+    #pragma omp parallel for num_threads(numThreads) if(numThreads > 1)
+    for(size_t b = 0; b < numBlocks; ++b){
+        size_t start = b * SIMDBLOCKSIZE;
+        size_t len = std::min((size_t) SIMDBLOCKSIZE, dataLen - start);
+        simdElementwise<OP, T>(ret + start, data1 ? data1 + start : nullptr, data2 ? data2 + start : nullptr, n, len);
     }
+    #ifndef OMP
+        (void) numThreads;
+    #endif
 }
 
-void cpuScalarSubtract(double * ret, double * data1, double n, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = n - data1[i];
+// Threads an elementwise operation of dataLen elements runs on, which is what sets the size below which it runs serially
+template<simdOperation OP, typename T>
+static size_t elementwiseThreads(size_t dataLen){
+    size_t threads = maxThreads();
+    if(threads == 1 || dataLen <= SIMDBLOCKSIZE || !TensorAutotune::isEnabled()) return threads;
+
+    std::string key = "elementwise " + std::to_string((int) OP) + " " + typeName<T>() + " " + sizeClass(dataLen);
+    std::vector<size_t> values;
+    if(TensorAutotune::lookup(key, values)) return std::min(std::max(values[0], (size_t) 1), threads);
+    if(!canTune()) return threads;
+    std::unique_lock<std::mutex> guard(tuningLock, std::try_to_lock);
+    if(!guard.owns_lock()) return threads;
+
+    std::vector<T> a(dataLen, 1), b(dataLen, 1), r(dataLen);
+    size_t best = threads;
+    double bestTime = std::numeric_limits<double>::infinity();
+    for(auto t : threadCandidates()){
+        double time = benchmark([&]{runElementwise<OP, T>(r.data(), a.data(), b.data(), 1, dataLen, t);});
+        if(time < bestTime){
+            bestTime = time;
+            best = t;
+        }
     }
+    TensorAutotune::store(key, {best});
+    return best;
+}
+
+template<simdOperation OP, typename T>
+static void parallelElementwise(T * ret, const T * data1, const T * data2, T n, size_t dataLen){
+    runElementwise<OP, T>(ret, data1, data2, n, dataLen, elementwiseThreads<OP, T>(dataLen));
+}
+
+template<typename T>
+void cpuCopy(T * ret, T * data1, size_t dataLen){
+    parallelElementwise<SIMDCOPY, T>(ret, data1, nullptr, 0, dataLen);
+}
+
+template<typename T>
+void cpuNeg(T * ret, T * data1, size_t dataLen){
+    parallelElementwise<SIMDNEG, T>(ret, data1, nullptr, 0, dataLen);
+}
+
+template<typename T>
+void cpuAdd(T * ret, T * data1, T * data2, size_t dataLen){
+    parallelElementwise<SIMDADD, T>(ret, data1, data2, 0, dataLen);
+}
+
+template<typename T>
+void cpuAddScalar(T * ret, T * data1, T n, size_t dataLen){
+    parallelElementwise<SIMDADDSCALAR, T>(ret, data1, nullptr, n, dataLen);
+}
+
+template<typename T>
+void cpuSubtract(T * ret, T * data1, T * data2, size_t dataLen){
+    parallelElementwise<SIMDSUBTRACT, T>(ret, data1, data2, 0, dataLen);
+}
+
+template<typename T>
+void cpuSubtractScalar(T * ret, T * data1, T n, size_t dataLen){
+    parallelElementwise<SIMDSUBTRACTSCALAR, T>(ret, data1, nullptr, n, dataLen);
+}
+
+template<typename T>
+void cpuScalarSubtract(T * ret, T * data1, T n, size_t dataLen){
+    parallelElementwise<SIMDSCALARSUBTRACT, T>(ret, data1, nullptr, n, dataLen);
 }
 
-void cpuPow(double * ret, double * data1, double n, size_t dataLen){
+// Powers with a vector equivalent avoid std::pow
+template<typename T>
+void cpuPow(T * ret, T * data1, T n, size_t dataLen){
+    if(n == 1) return parallelElementwise<SIMDCOPY, T>(ret, data1, nullptr, 0, dataLen);
+    if(n == 2) return parallelElementwise<SIMDSQUARE, T>(ret, data1, nullptr, 0, dataLen);
+    if(n == 0.5) return parallelElementwise<SIMDSQRT, T>(ret, data1, nullptr, 0, dataLen);
+    if(n == -1) return parallelElementwise<SIMDSCALARDIVISION, T>(ret, data1, nullptr, 1, dataLen);
+
     #pragma omp parallel for
     for(size_t i = 0; i < dataLen; ++i){
         ret[i] = std::pow(data1[i], n);
     }
 }
 
-void cpuZeroes(double * ret, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = 0;
+template<typename T>
+void cpuZeroes(T * ret, size_t dataLen){
+    parallelElementwise<SIMDFILL, T>(ret, nullptr, nullptr, 0, dataLen);
+}
+
+template<typename T>
+void cpuOnes(T * ret, size_t dataLen){
+    parallelElementwise<SIMDFILL, T>(ret, nullptr, nullptr, 1, dataLen);
+}
+
+template<typename T>
+void cpuFill(T * ret, T n, size_t dataLen){
+    parallelElementwise<SIMDFILL, T>(ret, nullptr, nullptr, n, dataLen);
+}
+
+template<typename T>
+void cpuElementwiseMult(T * ret, T * data1, T * data2, size_t dataLen){
+    parallelElementwise<SIMDMULT, T>(ret, data1, data2, 0, dataLen);
+}
+
+template<typename T>
+void cpuElementwiseMultScalar(T * ret, T * data1, T n, size_t dataLen){
+    parallelElementwise<SIMDMULTSCALAR, T>(ret, data1, nullptr, n, dataLen);
+}
+
+template<typename T>
+void cpuElementwiseDivision(T * ret, T * data1, T * data2, size_t dataLen){
+    parallelElementwise<SIMDDIVISION, T>(ret, data1, data2, 0, dataLen);
+}
+
+template<typename T>
+void cpuElementwiseDivisionScalar(T * ret, T * data1, T n, size_t dataLen){
+    parallelElementwise<SIMDDIVISIONSCALAR, T>(ret, data1, nullptr, n, dataLen);
+}
+
+template<typename T>
+void cpuElementwiseDivisionScalar2(T * ret, T * data1, T n, size_t dataLen){
+    parallelElementwise<SIMDSCALARDIVISION, T>(ret, data1, nullptr, n, dataLen);
+}
+
+// Offsets of the first element of a row (all dimensions but the last) in each operand
+static void broadcastRowOffsets(const BroadcastShape& shape, size_t row, size_t& offset1, size_t& offset2){
+    offset1 = offset2 = 0;
+    for(size_t d = shape.numDims - 1; d-- > 0;){
+        size_t index = row % shape.dims[d];
+        row /= shape.dims[d];
+        offset1 += index * shape.strides1[d];
+        offset2 += index * shape.strides2[d];
     }
 }
 
-void cpuOnes(double * ret, size_t dataLen){
+template<typename T, typename F>
+static void broadcastBinary(T * ret, T * data1, T * data2, const BroadcastShape& shape, F f){
+    // After merging dimensions the last stride of each operand is one, or zero if broadcast
+    size_t last = shape.numDims - 1;
+    size_t inner = shape.dims[last];
+    size_t rows = 1;
+    for(size_t d = 0; d < last; ++d) rows *= shape.dims[d];
+
     #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = 1;
+    for(size_t row = 0; row < rows; ++row){
+        size_t offset1, offset2;
+        broadcastRowOffsets(shape, row, offset1, offset2);
+        T * r = ret + row * inner;
+        T * a = data1 + offset1;
+        T * b = data2 + offset2;
+        if(shape.strides1[last] && shape.strides2[last]) for(size_t j = 0; j < inner; ++j) r[j] = f(a[j], b[j]);
+        else if(shape.strides1[last]) for(size_t j = 0; j < inner; ++j) r[j] = f(a[j], b[0]);
+        else if(shape.strides2[last]) for(size_t j = 0; j < inner; ++j) r[j] = f(a[0], b[j]);
+        else for(size_t j = 0; j < inner; ++j) r[j] = f(a[0], b[0]);
     }
 }
 
-void cpuFill(double * ret, double n, size_t dataLen){
+// broadcastBinary for operations with vector kernels. OPRIGHT is OP with a scalar right operand n
+// and OPLEFT is OP with a scalar left operand n, applied to the right operand.
+template<simdOperation OP, simdOperation OPRIGHT, simdOperation OPLEFT, typename T>
+static void broadcastBinarySimd(T * ret, T * data1, T * data2, const BroadcastShape& shape){
+    size_t last = shape.numDims - 1;
+    size_t inner = shape.dims[last];
+    size_t rows = 1;
+    for(size_t d = 0; d < last; ++d) rows *= shape.dims[d];
+
     #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = n;
+    for(size_t row = 0; row < rows; ++row){
+        size_t offset1, offset2;
+        broadcastRowOffsets(shape, row, offset1, offset2);
+        T * r = ret + row * inner;
+        T * a = data1 + offset1;
+        T * b = data2 + offset2;
+        if(shape.strides1[last] && shape.strides2[last]) simdElementwise<OP, T>(r, a, b, 0, inner);
+        else if(shape.strides1[last]) simdElementwise<OPRIGHT, T>(r, a, nullptr, b[0], inner);
+        else if(shape.strides2[last]) simdElementwise<OPLEFT, T>(r, b, nullptr, a[0], inner);
+        else simdElementwise<SIMDFILL, T>(r, nullptr, nullptr, simdScalarApply<OP, T>(a[0], b[0], 0), inner);
     }
 }
 
-void cpuElementwiseMult(double * ret, double * data1, double * data2, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] * data2[i];
+template<typename T>
+void cpuAddBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape){
+    broadcastBinarySimd<SIMDADD, SIMDADDSCALAR, SIMDADDSCALAR>(ret, data1, data2, shape);
+}
+
+template<typename T>
+void cpuSubtractBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape){
+    broadcastBinarySimd<SIMDSUBTRACT, SIMDSUBTRACTSCALAR, SIMDSCALARSUBTRACT>(ret, data1, data2, shape);
+}
+
+template<typename T>
+void cpuElementwiseMultBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape){
+    broadcastBinarySimd<SIMDMULT, SIMDMULTSCALAR, SIMDMULTSCALAR>(ret, data1, data2, shape);
+}
+
+template<typename T>
+void cpuElementwiseDivisionBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape){
+    broadcastBinarySimd<SIMDDIVISION, SIMDDIVISIONSCALAR, SIMDSCALARDIVISION>(ret, data1, data2, shape);
+}
+
+template<typename T>
+void cpuSumToShape(T * ret, T * data1, BroadcastShape shape, size_t retLen){
+    // shape holds the dimensions of data1, strides1 are the strides of ret (zero along summed
+    // dimensions) and strides2 the contiguous strides of data1
+    size_t last = shape.numDims - 1;
+    size_t inner = shape.dims[last];
+    size_t rows = 1;
+    bool distinctRows = true;
+    for(size_t d = 0; d < last; ++d){
+        rows *= shape.dims[d];
+        if(shape.strides1[d] == 0) distinctRows = false;
+    }
+    #ifndef OMP
+        (void) distinctRows;
+    #endif
+
+    cpuZeroes(ret, retLen);
+
+    // Rows can only be split across threads when no two of them are summed into the same place
+    #pragma omp parallel for if(distinctRows)
+    for(size_t row = 0; row < rows; ++row){
+        size_t offset1, offset2;
+        broadcastRowOffsets(shape, row, offset1, offset2);
+        T * r = ret + offset1;
+        T * a = data1 + row * inner;
+        if(shape.strides1[last]) for(size_t j = 0; j < inner; ++j) r[j] += a[j];
+        else{
+            T sum = 0;
+            for(size_t j = 0; j < inner; ++j) sum += a[j];
+            r[0] += sum;
+        }
     }
 }
 
-void cpuElementwiseMultScalar(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+void cpuStridedCopy(T * ret, T * data1, BroadcastShape shape){
+    size_t last = shape.numDims - 1;
+    size_t inner = shape.dims[last];
+    size_t rows = 1;
+    for(size_t d = 0; d < last; ++d) rows *= shape.dims[d];
+
     #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] * n;
+    for(size_t row = 0; row < rows; ++row){
+        size_t offset1, offset2;
+        broadcastRowOffsets(shape, row, offset1, offset2);
+        T * r = ret + offset1;
+        T * a = data1 + offset2;
+        if(shape.strides1[last] == 1 && shape.strides2[last] == 1) for(size_t j = 0; j < inner; ++j) r[j] = a[j];
+        else for(size_t j = 0; j < inner; ++j) r[j * shape.strides1[last]] = a[j * shape.strides2[last]];
     }
 }
 
-void cpuElementwiseDivision(double * ret, double * data1, double * data2, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] / data2[i];
+template<typename T>
+void cpuRelu(T * ret, T * data1, size_t dataLen){
+    parallelElementwise<SIMDRELU, T>(ret, data1, nullptr, 0, dataLen);
+}
+
+template<typename T>
+void cpuBinarize(T * ret, T * data1, size_t dataLen){
+    parallelElementwise<SIMDBINARIZE, T>(ret, data1, nullptr, 0, dataLen);
+}
+
+/**
+ * Packs rows [0, mc) x cols [0, kc) of a into panels of GEMMMR rows stored column by column. With
+ * PAIR two, as the int8 GEMM packs its int16 panels, columns are stored two at a time with the
+ * pair of each row next to each other, and an odd kc is padded with a column of zeros.
+ */
+template<size_t PAIR = 1, typename T, typename S>
+static void packA(T * packed, S * a, size_t mc, size_t kc, size_t rowStride, size_t colStride){
+    size_t kcPadded = (kc + PAIR - 1) / PAIR * PAIR;
+    for(size_t r = 0; r < mc; r += GEMMMR){
+        T * panel = packed + r * kcPadded;
+        size_t rows = mc - r < GEMMMR ? mc - r : GEMMMR;
+        for(size_t p = 0; p < kcPadded; ++p){
+            T * step = panel + (p / PAIR) * GEMMMR * PAIR + p % PAIR;
+            size_t valid = p < kc ? rows : 0;
+            for(size_t i = 0; i < valid; ++i) step[i * PAIR] = a[(r + i) * rowStride + p * colStride];
+            for(size_t i = valid; i < GEMMMR; ++i) step[i * PAIR] = 0;
+        }
     }
 }
 
-void cpuElementwiseDivisionScalar(double * ret, double * data1, double n, size_t dataLen){
-    #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] / n;
+// Packs rows [0, kc) x cols [0, nc) of b into panels of GEMMNR columns stored row by row, or by pairs of rows like packA
+template<size_t PAIR = 1, typename T, typename S>
+static void packB(T * packed, S * b, size_t kc, size_t nc, size_t rowStride, size_t colStride, size_t numThreads){
+    size_t kcPadded = (kc + PAIR - 1) / PAIR * PAIR;
+    size_t numPanels = (nc + GEMMNR - 1) / GEMMNR;
+    #pragma omp parallel for num_threads(numThreads) if(numThreads > 1)
+    for(size_t c = 0; c < numPanels; ++c){
+        T * panel = packed + c * GEMMNR * kcPadded;
+        size_t cols = nc - c * GEMMNR < GEMMNR ? nc - c * GEMMNR : GEMMNR;
+        for(size_t p = 0; p < kcPadded; ++p){
+            T * step = panel + (p / PAIR) * GEMMNR * PAIR + p % PAIR;
+            size_t valid = p < kc ? cols : 0;
+            for(size_t j = 0; j < valid; ++j) step[j * PAIR] = b[p * rowStride + (c * GEMMNR + j) * colStride];
+            for(size_t j = valid; j < GEMMNR; ++j) step[j * PAIR] = 0;
+        }
+    }
+    #ifndef OMP
+        (void) numThreads;
+    #endif
+}
+
+// Computes a GEMMMR x GEMMNR block of ret from one packed panel of a and b with the selected instruction set
+template<typename T>
+static void gemmMicrokernel(T * ret, T * a, T * b, size_t kc, size_t ldr, size_t rows, size_t cols, bool accumulate){
+    switch(selectedSimdLevel){
+        #ifdef SIMDX86
+            case SIMDAVX512: SimdAvx512::simdGemmMicrokernel<T, GEMMMR, GEMMNR>(ret, a, b, kc, ldr, rows, cols, accumulate); return;
+            case SIMDAVX2: SimdAvx2::simdGemmMicrokernel<T, GEMMMR, GEMMNR>(ret, a, b, kc, ldr, rows, cols, accumulate); return;
+            case SIMDSSE: SimdSse::simdGemmMicrokernel<T, GEMMMR, GEMMNR>(ret, a, b, kc, ldr, rows, cols, accumulate); return;
+        #endif
+        default: SimdScalar::simdGemmMicrokernel<T, GEMMMR, GEMMNR>(ret, a, b, kc, ldr, rows, cols, accumulate); return;
+    }
+}
+
+// Computes a GEMMMR x GEMMNR block of the int8 product from int16 panels with the selected instruction set
+template<typename T>
+static void gemmInt8Microkernel(T * ret, int16_t * a, int16_t * b, size_t kp, size_t ldr, size_t rows, size_t cols, float * rowScales, float * colScales, bool accumulate){
+    switch(selectedSimdLevel){
+        #ifdef SIMDX86
+            case SIMDAVX512: SimdAvx512::simdGemmInt8Microkernel<T, GEMMMR, GEMMNR>(ret, a, b, kp, ldr, rows, cols, rowScales, colScales, accumulate); return;
+            case SIMDAVX2: SimdAvx2::simdGemmInt8Microkernel<T, GEMMMR, GEMMNR>(ret, a, b, kp, ldr, rows, cols, rowScales, colScales, accumulate); return;
+            case SIMDSSE: SimdSse::simdGemmInt8Microkernel<T, GEMMMR, GEMMNR>(ret, a, b, kp, ldr, rows, cols, rowScales, colScales, accumulate); return;
+        #endif
+        default: SimdScalar::simdGemmInt8Microkernel<T, GEMMMR, GEMMNR>(ret, a, b, kp, ldr, rows, cols, rowScales, colScales, accumulate); return;
+    }
+}
+
+// Tile sizes and threads of one product, and whether it is packed at all
+struct GemmConfig{
+    size_t kc, mc, numThreads;
+    bool packed;
+};
+
+template<typename T>
+static void gemmUnpacked(T * ret, T * a, T * b, size_t m, size_t n, size_t k, size_t aRowStride, size_t aColStride, size_t bRowStride, size_t bColStride, bool accumulate, size_t numThreads){
+    #pragma omp parallel for num_threads(numThreads) if(m > 1 && numThreads > 1)
+    for(size_t i = 0; i < m; ++i){
+        T * r = ret + i * n;
+        if(!accumulate) for(size_t j = 0; j < n; ++j) r[j] = 0;
+        for(size_t p = 0; p < k; ++p){
+            T ai = a[i * aRowStride + p * aColStride];
+            T * bp = b + p * bRowStride;
+            for(size_t j = 0; j < n; ++j) r[j] += ai * bp[j * bColStride];
+        }
+    }
+    #ifndef OMP
+        (void) numThreads;
+    #endif
+}
+
+template<typename T>
+static void gemmPacked(T * ret, T * a, T * b, size_t m, size_t n, size_t k, size_t aRowStride, size_t aColStride, size_t bRowStride, size_t bColStride, bool accumulate, GemmConfig config){
+    size_t numThreads = config.numThreads;
+    size_t chunkRows = config.mc * GEMMMCCHUNK;
+    std::unique_ptr<T[]> packedB(new T[((GEMMNC + GEMMNR - 1) / GEMMNR) * GEMMNR * config.kc]);
+    std::unique_ptr<T[]> packedA(new T[chunkRows * config.kc]);
+
+    for(size_t pc = 0; pc < k; pc += config.kc){
+        size_t kc = k - pc < config.kc ? k - pc : config.kc;
+        bool acc = accumulate || pc > 0;
+
+        for(size_t jc = 0; jc < n; jc += GEMMNC){
+            size_t nc = n - jc < GEMMNC ? n - jc : GEMMNC;
+            packB(packedB.get(), b + pc * bRowStride + jc * bColStride, kc, nc, bRowStride, bColStride, numThreads);
+            size_t numJPanels = (nc + GEMMNR - 1) / GEMMNR;
+
+            for(size_t ic = 0; ic < m; ic += chunkRows){
+                size_t rowsInChunk = m - ic < chunkRows ? m - ic : chunkRows;
+                size_t numIBlocks = (rowsInChunk + config.mc - 1) / config.mc;
+
+                #pragma omp parallel for num_threads(numThreads) if(numThreads > 1)
+                for(size_t ib = 0; ib < numIBlocks; ++ib){
+                    size_t mc = rowsInChunk - ib * config.mc < config.mc ? rowsInChunk - ib * config.mc : config.mc;
+                    packA(packedA.get() + ib * config.mc * kc, a + (ic + ib * config.mc) * aRowStride + pc * aColStride, mc, kc, aRowStride, aColStride);
+                }
+
+                // Tiles of rows and column panels are split across threads in both dimensions
+                #pragma omp parallel for collapse(2) schedule(dynamic) num_threads(numThreads) if(numThreads > 1)
+                for(size_t ib = 0; ib < numIBlocks; ++ib){
+                    for(size_t jb = 0; jb < numJPanels; jb += GEMMNBLOCK){
+                        size_t mc = rowsInChunk - ib * config.mc < config.mc ? rowsInChunk - ib * config.mc : config.mc;
+                        size_t jEnd = jb + GEMMNBLOCK < numJPanels ? jb + GEMMNBLOCK : numJPanels;
+                        for(size_t jr = jb; jr < jEnd; ++jr){
+                            size_t cols = nc - jr * GEMMNR < GEMMNR ? nc - jr * GEMMNR : GEMMNR;
+                            for(size_t ir = 0; ir < mc; ir += GEMMMR){
+                                size_t rows = mc - ir < GEMMMR ? mc - ir : GEMMMR;
+                                T * r = ret + (ic + ib * config.mc + ir) * n + jc + jr * GEMMNR;
+                                gemmMicrokernel(r, packedA.get() + ib * config.mc * kc + ir * kc, packedB.get() + jr * GEMMNR * kc,
+                                        kc, n, rows, cols, acc);
+                            }
+                        }
+                    }
+                }
+            }
+        }
     }
 }
 
-void cpuElementwiseDivisionScalar2(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+static void runGemm(T * ret, T * a, T * b, size_t m, size_t n, size_t k, size_t aRowStride, size_t aColStride, size_t bRowStride, size_t bColStride, bool accumulate, GemmConfig config){
+    if(config.packed) gemmPacked(ret, a, b, m, n, k, aRowStride, aColStride, bRowStride, bColStride, accumulate, config);
+    else gemmUnpacked(ret, a, b, m, n, k, aRowStride, aColStride, bRowStride, bColStride, accumulate, config.numThreads);
+}
+
+/**
+ * Configuration of an m x n x k product. Tuning first picks the thread count and whether to pack
+ * with the default tiles, then the depth and row block with that thread count, timing each on
+ * contiguous scratch operands of the product's shape with every size capped at GEMMTUNEMAXDIM.
+ */
+template<typename T>
+static GemmConfig gemmConfig(size_t m, size_t n, size_t k){
+    // Small products are cheaper without packing
+    size_t threads = maxThreads();
+    GemmConfig config = {GEMMKC, GEMMMC, threads, m * n * k > GEMMSMALL};
+    if(!TensorAutotune::isEnabled()) return config;
+
+    std::string key = "gemm " + typeName<T>() + " " + sizeClass(m) + " " + sizeClass(n) + " " + sizeClass(k);
+    std::vector<size_t> values;
+    if(TensorAutotune::lookup(key, values) && values.size() == 4 && values[0] > 0 && values[1] > 0 && values[1] % GEMMMR == 0)
+        return {values[0], values[1], std::min(std::max(values[2], (size_t) 1), threads), values[3] != 0};
+    if(!canTune()) return config;
+    std::unique_lock<std::mutex> guard(tuningLock, std::try_to_lock);
+    if(!guard.owns_lock()) return config;
+
+    size_t tm = std::min(m, (size_t) GEMMTUNEMAXDIM), tn = std::min(n, (size_t) GEMMTUNEMAXDIM), tk = std::min(k, (size_t) GEMMTUNEMAXDIM);
+    std::vector<T> a(tm * tk, 1), b(tk * tn, 1), r(tm * tn);
+    double bestTime = std::numeric_limits<double>::infinity();
+    auto consider = [&](GemmConfig candidate){
+        double time = benchmark([&]{runGemm(r.data(), a.data(), b.data(), tm, tn, tk, tk, 1, tn, 1, false, candidate);});
+        if(time < bestTime){
+            bestTime = time;
+            config = candidate;
+        }
+    };
+
+    for(auto t : threadCandidates()){
+        consider({GEMMKC, GEMMMC, t, true});
+        if(m * n * k <= GEMMTUNEMAXUNPACKED) consider({GEMMKC, GEMMMC, t, false});
+    }
+    if(config.packed){
+        size_t t = config.numThreads;
+        for(size_t kc : {128, 256, 512})
+            for(size_t mc : {32, 64, 128})
+                if(kc != GEMMKC || mc != GEMMMC) consider({kc, mc, t, true});
+    }
+
+    TensorAutotune::store(key, {config.kc, config.mc, config.numThreads, config.packed});
+    return config;
+}
+
+template<typename T>
+void cpuGemm(T * ret, T * a, T * b, size_t m, size_t n, size_t k, size_t aRowStride, size_t aColStride, size_t bRowStride, size_t bColStride, bool accumulate){
+    if(k == 0){
+        if(!accumulate) cpuZeroes(ret, m * n);
+        return;
+    }
+    runGemm(ret, a, b, m, n, k, aRowStride, aColStride, bRowStride, bColStride, accumulate, gemmConfig<T>(m, n, k));
+}
+
+template<typename T>
+void cpuMatmul2d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1){
+    cpuGemm(ret, data1, data2, retDims0, retDims1, data1Dims1, data1Dims1, 1, data2Dims1, 1, false);
+}
+
+template<typename T>
+void cpuMatmul3d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1){
+    // Batches of a contiguous left operand against a shared right operand are one tall product
+    (void) data1Dims1;
+    cpuGemm(ret, data1, data2, retDims0 * retDims1, retDims2, data1Dims2, data1Dims2, 1, data2Dims1, 1, false);
+}
+
+// Batches run in parallel only when there are enough of them to occupy every thread,
+// otherwise each product is parallelized internally
+static bool parallelOverBatch(size_t batch){
+    #ifdef OMP
+        return batch >= (size_t) omp_get_max_threads();
+    #else
+        (void) batch;
+        return false;
+    #endif
+}
+
+template<typename T>
+void cpuMatmulBatched(T * ret, T * data1, T * data2, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides){
+    if(strides.batch2 == 0 && (batch == 1 || strides.batch1 == m * strides.row1)){
+        // The batch folds into the rows of one product
+        cpuGemm(ret, data1, data2, batch * m, n, k, strides.row1, strides.col1, strides.row2, strides.col2, false);
+        return;
+    }
+
+    #pragma omp parallel for if(parallelOverBatch(batch))
+    for(size_t b = 0; b < batch; ++b){
+        cpuGemm(ret + b * m * n, data1 + b * strides.batch1, data2 + b * strides.batch2, m, n, k,
+                strides.row1, strides.col1, strides.row2, strides.col2, false);
+    }
+}
+
+template<typename T>
+void cpuMatmulGradLeft(T * ret, T * grad, T * data2, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides, bool reduceBatch){
+    // ret = grad * data2^T, read through the strides of data2 without transposing it
+    if(reduceBatch){
+        for(size_t b = 0; b < batch; ++b)
+            cpuGemm(ret, grad + b * m * n, data2 + b * strides.batch2, m, k, n, n, 1, strides.col2, strides.row2, b > 0);
+    }
+    else if(strides.batch2 == 0){
+        cpuGemm(ret, grad, data2, batch * m, k, n, n, 1, strides.col2, strides.row2, false);
+    }
+    else{
+        #pragma omp parallel for if(parallelOverBatch(batch))
+        for(size_t b = 0; b < batch; ++b)
+            cpuGemm(ret + b * m * k, grad + b * m * n, data2 + b * strides.batch2, m, k, n, n, 1, strides.col2, strides.row2, false);
+    }
+}
+
+template<typename T>
+void cpuMatmulGradRight(T * ret, T * data1, T * grad, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides, bool reduceBatch){
+    // ret = data1^T * grad, read through the strides of data1 without transposing it
+    if(reduceBatch && strides.batch1 == m * strides.row1){
+        // Summing over the batch is one product with the batch folded into the inner dimension
+        cpuGemm(ret, data1, grad, k, n, batch * m, strides.col1, strides.row1, n, 1, false);
+    }
+    else if(reduceBatch){
+        for(size_t b = 0; b < batch; ++b)
+            cpuGemm(ret, data1 + b * strides.batch1, grad + b * m * n, k, n, m, strides.col1, strides.row1, n, 1, b > 0);
+    }
+    else{
+        #pragma omp parallel for if(parallelOverBatch(batch))
+        for(size_t b = 0; b < batch; ++b)
+            cpuGemm(ret + b * k * n, data1 + b * strides.batch1, grad + b * m * n, k, n, m, strides.col1, strides.row1, n, 1, false);
+    }
+}
+
+template<typename T>
+void cpuQuantize(int8_t * ret, float * scales, T * data1, size_t rows, size_t channels){
+    // Symmetric per-channel scales, so that the largest magnitude in each channel maps to 127
+    std::vector<T> maxAbs(channels, 0);
+    for(size_t i = 0; i < rows; ++i){
+        T * row = data1 + i * channels;
+        for(size_t j = 0; j < channels; ++j) maxAbs[j] = std::max(maxAbs[j], (T) std::fabs(row[j]));
+    }
+
+    std::vector<float> inverse(channels);
+    for(size_t j = 0; j < channels; ++j){
+        scales[j] = (float) maxAbs[j] / 127;
+        inverse[j] = maxAbs[j] > 0 ? 127 / (float) maxAbs[j] : 0;
+    }
+
     #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = n / data1[i];
+    for(size_t i = 0; i < rows; ++i){
+        for(size_t j = 0; j < channels; ++j){
+            float q = std::nearbyint((float) data1[i * channels + j] * inverse[j]);
+            ret[i * channels + j] = (int8_t) std::max(-127.0f, std::min(127.0f, q));
+        }
     }
 }
 
-void cpuRelu(double * ret, double * data1, size_t dataLen){
+template<typename T>
+void cpuDequantize(T * ret, int8_t * data1, float * scales, size_t rows, size_t channels){
     #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] > 0 ? data1[i] : 0;
+    for(size_t i = 0; i < rows; ++i){
+        for(size_t j = 0; j < channels; ++j) ret[i * channels + j] = (T) (data1[i * channels + j] * scales[j]);
+    }
+}
+
+// std::nearbyint for |x| below 2^22, adding and removing 1.5 * 2^23 so the rounding is done by the
+// addition, which vectorizes where nearbyint is a libm call without SSE4.1
+static inline float roundToNearest(float x){
+    const float magic = 12582912.0f;
+    return (x + magic) - magic;
+}
+
+/**
+ * ret = a * b scaled by rowScales[i] * colScales[j], for row-major int8 a of m x k and b of k x n.
+ * Blocked like gemmPacked with the default row block, with the int8 values packed into int16
+ * panels of pairs of depth steps, the layout the int16 multiply-adds read.
+ */
+template<typename T>
+static void gemmInt8Packed(T * ret, int8_t * a, int8_t * b, size_t m, size_t n, size_t k, float * rowScales, float * colScales, size_t numThreads){
+    size_t chunkRows = GEMMMC * GEMMMCCHUNK;
+    auto packedB = TensorMemoryPool::allocate(((GEMMNC + GEMMNR - 1) / GEMMNR) * GEMMNR * INT8KC * sizeof(int16_t));
+    auto packedA = TensorMemoryPool::allocate(chunkRows * INT8KC * sizeof(int16_t));
+    int16_t * pb = static_cast<int16_t *>(packedB.get());
+    int16_t * pa = static_cast<int16_t *>(packedA.get());
+
+    for(size_t pc = 0; pc < k; pc += INT8KC){
+        size_t kc = k - pc < INT8KC ? k - pc : INT8KC;
+        size_t kp = (kc + 1) / 2;
+
+        for(size_t jc = 0; jc < n; jc += GEMMNC){
+            size_t nc = n - jc < GEMMNC ? n - jc : GEMMNC;
+            packB<2>(pb, b + pc * n + jc, kc, nc, n, 1, numThreads);
+            size_t numJPanels = (nc + GEMMNR - 1) / GEMMNR;
+
+            for(size_t ic = 0; ic < m; ic += chunkRows){
+                size_t rowsInChunk = m - ic < chunkRows ? m - ic : chunkRows;
+                size_t numIBlocks = (rowsInChunk + GEMMMC - 1) / GEMMMC;
+
+                #pragma omp parallel for num_threads(numThreads) if(numThreads > 1)
+                for(size_t ib = 0; ib < numIBlocks; ++ib){
+                    size_t mc = rowsInChunk - ib * GEMMMC < GEMMMC ? rowsInChunk - ib * GEMMMC : GEMMMC;
+                    packA<2>(pa + ib * GEMMMC * 2 * kp, a + (ic + ib * GEMMMC) * k + pc, mc, kc, k, 1);
+                }
+
+                #pragma omp parallel for collapse(2) schedule(dynamic) num_threads(numThreads) if(numThreads > 1)
+                for(size_t ib = 0; ib < numIBlocks; ++ib){
+                    for(size_t jb = 0; jb < numJPanels; jb += GEMMNBLOCK){
+                        size_t mc = rowsInChunk - ib * GEMMMC < GEMMMC ? rowsInChunk - ib * GEMMMC : GEMMMC;
+                        size_t jEnd = jb + GEMMNBLOCK < numJPanels ? jb + GEMMNBLOCK : numJPanels;
+                        for(size_t jr = jb; jr < jEnd; ++jr){
+                            size_t cols = nc - jr * GEMMNR < GEMMNR ? nc - jr * GEMMNR : GEMMNR;
+                            for(size_t ir = 0; ir < mc; ir += GEMMMR){
+                                size_t rows = mc - ir < GEMMMR ? mc - ir : GEMMMR;
+                                size_t i0 = ic + ib * GEMMMC + ir, j0 = jc + jr * GEMMNR;
+                                gemmInt8Microkernel(ret + i0 * n + j0, pa + (ib * GEMMMC + ir) * 2 * kp, pb + jr * GEMMNR * 2 * kp,
+                                        kp, n, rows, cols, rowScales + i0, colScales + j0, pc > 0);
+                            }
+                        }
+                    }
+                }
+            }
+        }
     }
+    #ifndef OMP
+        (void) numThreads;
+    #endif
 }
 
-void cpuBinarize(double * ret, double * data1, size_t dataLen){
+template<typename T>
+void cpuMatmulInt8(T * ret, T * data1, int8_t * data2, float * scales2, size_t batch, size_t m, size_t n, size_t k, size_t data1BatchStride, size_t data2BatchStride){
+    if(k == 0){
+        cpuZeroes(ret, batch * m * n);
+        return;
+    }
+
+    // Rows of data1 are quantized with one scale per row, so each output is acc * rowScale * columnScale
+    size_t rows1 = (data1BatchStride == 0 ? 1 : batch) * m;
+    auto quantizedData = TensorMemoryPool::allocate(rows1 * k * sizeof(int8_t));
+    auto scalesData = TensorMemoryPool::allocate(rows1 * sizeof(float));
+    int8_t * quantized1 = static_cast<int8_t *>(quantizedData.get());
+    float * scales1 = static_cast<float *>(scalesData.get());
+
     #pragma omp parallel for
-    for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = data1[i] > 0 ? 1 : 0;
+    for(size_t i = 0; i < rows1; ++i){
+        T * row = data1 + i * k;
+        T maxAbs = simdMaxAbs(row, k);
+        float inverse = maxAbs > 0 ? 127 / (float) maxAbs : 0;
+        scales1[i] = (float) maxAbs / 127;
+        for(size_t p = 0; p < k; ++p) quantized1[i * k + p] = (int8_t) roundToNearest((float) row[p] * inverse);
+    }
+
+    if(data2BatchStride == 0 && data1BatchStride != 0){
+        // The batch folds into the rows of one product
+        gemmInt8Packed(ret, quantized1, data2, batch * m, n, k, scales1, scales2, maxThreads());
+        return;
+    }
+
+    #pragma omp parallel for if(parallelOverBatch(batch))
+    for(size_t b = 0; b < batch; ++b){
+        size_t row1 = data1BatchStride == 0 ? 0 : b * m;
+        gemmInt8Packed(ret + b * m * n, quantized1 + row1 * k, data2 + b * data2BatchStride, m, n, k, scales1 + row1, scales2, maxThreads());
     }
 }
 
-void cpuMatmul2d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1){
+template<typename T>
+void cpuTranspose2d(T * ret, T * data1, size_t retDims0, size_t retDims1){
     #pragma omp parallel for
     for(size_t i = 0; i < retDims0; ++i){
         for(size_t j = 0; j < retDims1; ++j){
-            ret[i * retDims0 + j] = 0;
-            for(size_t k = 0; k < data1Dims1; ++k){
-                ret[i * retDims1 + j] += data1[i * data1Dims1 + k] * data2[k * data2Dims1 + j];
-            }
+            ret[i * retDims1 + j] = data1[j * retDims0 + i];
         }
     }
 }
 
-void cpuMatmul3d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1){
+template<typename T>
+void cpuTranspose3d(T * ret, T * data1, size_t retDims0, size_t retDims1, size_t retDims2){
     #pragma omp parallel for
     for(size_t b = 0; b < retDims0; ++b){
         for(size_t i = 0; i < retDims1; ++i){
             for(size_t j = 0; j < retDims2; ++j){
-                ret[b * retDims2 * retDims1 + i * retDims1 + j] = 0;
-                for(size_t k = 0; k < data1Dims2; ++k){
-                    ret[b * retDims2 * retDims1 + i * retDims2 + j] += data1[b * data1Dims2 * data1Dims1 + i * data1Dims2 + k] * data2[k * data2Dims1 + j];
+                ret[b * retDims1 * retDims2 + i * retDims2 + j] = data1[b * retDims1 * retDims2 + j * retDims1 + i];
+            }
+        }
+    }
+}
+
+template<typename T>
+void cpuReduceSum(T * ret, T * data1, size_t dataLen){
+    cpuReduce(ret, data1, 1, dataLen, 1, REDUCTIONSUM, (T) 1);
+}
+
+// Reduces a contiguous row with the vector kernel of the selected instruction set
+template<typename T>
+static T reduceRow(T * a, size_t len, reductionOperation op){
+    return simdReduce<T>(a, len, op);
+}
+
+template<typename T>
+void cpuReduce(T * ret, T * data1, size_t outer, size_t reduceLen, size_t inner, reductionOperation op, T scale){
+    // data1 is [outer, reduceLen, inner] and ret is [outer, inner]
+    if(inner == 1){
+        size_t numBlocks = (reduceLen + REDUCTIONBLOCKSIZE - 1) / REDUCTIONBLOCKSIZE;
+        if(numBlocks > 1 && !parallelOverBatch(outer)){
+            std::vector<T> partial(outer * numBlocks);
+            #pragma omp parallel for collapse(2)
+            for(size_t o = 0; o < outer; ++o){
+                for(size_t b = 0; b < numBlocks; ++b){
+                    size_t start = b * REDUCTIONBLOCKSIZE;
+                    size_t len = std::min((size_t) REDUCTIONBLOCKSIZE, reduceLen - start);
+                    partial[o * numBlocks + b] = reduceRow(data1 + o * reduceLen + start, len, op);
                 }
             }
+            for(size_t o = 0; o < outer; ++o) ret[o] = reduceRow(partial.data() + o * numBlocks, numBlocks, op) * scale;
+            return;
+        }
+
+        #pragma omp parallel for
+        for(size_t o = 0; o < outer; ++o){
+            ret[o] = reduceRow(data1 + o * reduceLen, reduceLen, op) * scale;
+        }
+        return;
+    }
+
+    // Reduced rows are accumulated a whole inner row at a time, which keeps the loads contiguous
+    size_t numBlocks = (inner + FUSEDBLOCKSIZE - 1) / FUSEDBLOCKSIZE;
+    #pragma omp parallel for collapse(2)
+    for(size_t o = 0; o < outer; ++o){
+        for(size_t b = 0; b < numBlocks; ++b){
+            size_t start = b * FUSEDBLOCKSIZE;
+            size_t len = std::min((size_t) FUSEDBLOCKSIZE, inner - start);
+            T * r = ret + o * inner + start;
+            T * a = data1 + o * reduceLen * inner + start;
+            simdElementwise<SIMDCOPY, T>(r, a, nullptr, 0, len);
+            for(size_t j = 1; j < reduceLen; ++j){
+                T * row = a + j * inner;
+                if(op == REDUCTIONSUM) simdElementwise<SIMDADD, T>(r, r, row, 0, len);
+                else simdElementwise<SIMDMAX, T>(r, row, r, 0, len);
+            }
+            if(scale != 1) simdElementwise<SIMDMULTSCALAR, T>(r, r, nullptr, scale, len);
         }
     }
 }
 
-void cpuTranspose2d(double * ret, double * data1, size_t retDims0, size_t retDims1){
+template<typename T>
+void cpuEqualBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape){
+    broadcastBinary(ret, data1, data2, shape, [](T a, T b) {return a == b ? (T) 1 : (T) 0;});
+}
+
+template<typename T>
+void cpuSoftmax(T * ret, T * data1, size_t rows, size_t cols){
+    // The row maximum is subtracted before exponentiating so large inputs do not overflow
     #pragma omp parallel for
-    for(size_t i = 0; i < retDims0; ++i){
-        for(size_t j = 0; j < retDims1; ++j){
-            ret[j * retDims0 + i] = data1[i * retDims1 + j];
+    for(size_t r = 0; r < rows; ++r){
+        T * a = data1 + r * cols;
+        T * out = ret + r * cols;
+        T max = reduceRow(a, cols, REDUCTIONMAX);
+        T sum = 0;
+        for(size_t j = 0; j < cols; ++j){
+            out[j] = std::exp(a[j] - max);
+            sum += out[j];
         }
+        T scale = 1 / sum;
+        for(size_t j = 0; j < cols; ++j) out[j] *= scale;
     }
 }
 
-void cpuTranspose3d(double * ret, double * data1, size_t retDims0, size_t retDims1, size_t retDims2){
+template<typename T>
+void cpuSoftmaxBackward(T * ret, T * grad, T * out, size_t rows, size_t cols){
     #pragma omp parallel for
-    for(size_t b = 0; b < retDims0; ++b){
-        for(size_t i = 0; i < retDims1; ++i){
-            for(size_t j = 0; j < retDims2; ++j){
-                ret[b * retDims1 * retDims2 + j * retDims1 + i] = data1[b * retDims1 * retDims2 + i * retDims2 + j];
+    for(size_t r = 0; r < rows; ++r){
+        T * g = grad + r * cols;
+        T * y = out + r * cols;
+        T dot = 0;
+        for(size_t j = 0; j < cols; ++j) dot += g[j] * y[j];
+        for(size_t j = 0; j < cols; ++j) ret[r * cols + j] = y[j] * (g[j] - dot);
+    }
+}
+
+template<typename T>
+void cpuArgmax(T * ret, T * data1, size_t rows, size_t cols){
+    #pragma omp parallel for
+    for(size_t r = 0; r < rows; ++r){
+        T * a = data1 + r * cols;
+        size_t index = 0;
+        for(size_t j = 1; j < cols; ++j) if(a[j] > a[index]) index = j;
+        ret[r] = (T) index;
+    }
+}
+
+// Log of the sum of the exponentials of a row, taken relative to the row maximum so it cannot overflow
+template<typename T>
+static T logSumExp(T * a, size_t len){
+    T max = reduceRow(a, len, REDUCTIONMAX);
+    T sum = 0;
+    for(size_t j = 0; j < len; ++j) sum += std::exp(a[j] - max);
+    return max + std::log(sum);
+}
+
+template<typename T>
+void cpuCrossEntropy(T * ret, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels){
+    // labels hold a class index per row, or a target distribution per row shaped like logits
+    T total = 0;
+    #pragma omp parallel for reduction(+:total)
+    for(size_t r = 0; r < rows; ++r){
+        T * x = logits + r * cols;
+        T lse = logSumExp(x, cols);
+        if(indexLabels) total += lse - x[(size_t) labels[r]];
+        else{
+            T * t = labels + r * cols;
+            for(size_t j = 0; j < cols; ++j) total += t[j] * (lse - x[j]);
+        }
+    }
+    ret[0] = total / rows;
+}
+
+template<typename T>
+void cpuCrossEntropyBackward(T * ret, T * grad, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels){
+    // softmax(logits) * sum(target) - target, scaled by the loss gradient over the number of rows
+    T scale = grad[0] / rows;
+    #pragma omp parallel for
+    for(size_t r = 0; r < rows; ++r){
+        T * x = logits + r * cols;
+        T * out = ret + r * cols;
+        T lse = logSumExp(x, cols);
+        if(indexLabels){
+            for(size_t j = 0; j < cols; ++j) out[j] = std::exp(x[j] - lse) * scale;
+            out[(size_t) labels[r]] -= scale;
+        }
+        else{
+            T * t = labels + r * cols;
+            T targetSum = 0;
+            for(size_t j = 0; j < cols; ++j) targetSum += t[j];
+            for(size_t j = 0; j < cols; ++j) out[j] = (std::exp(x[j] - lse) * targetSum - t[j]) * scale;
+        }
+    }
+}
+
+// Box-Muller transform of one Philox output gives elements 2j and 2j + 1. Values are computed in
+// double, so a float tensor holds the rounded values of the double tensor with the same key.
+template<typename T>
+void cpuFillRandom(T * ret, T mean, T stddev, uint64_t key, size_t dataLen){
+    #pragma omp parallel for
+    for(size_t j = 0; j < (dataLen + 1) / 2; ++j){
+        uint32_t words[4];
+        philox(words, j, key);
+        double r = std::sqrt(-2 * std::log(1 - philoxUniform(words[0], words[1])));
+        double theta = TWOPI * philoxUniform(words[2], words[3]);
+        ret[2 * j] = (T) (mean + stddev * r * std::cos(theta));
+        if(2 * j + 1 < dataLen) ret[2 * j + 1] = (T) (mean + stddev * r * std::sin(theta));
+    }
+}
+
+// Scales kept elements by 1 / (1 - p) and zeroes the rest, element i being start + j. The mask
+// is regenerated from key wherever it is needed rather than stored.
+template<typename T>
+static void dropoutRange(T * ret, T * data1, size_t start, size_t len, double p, uint64_t key){
+    T scale = (T) (1 / (1 - p));
+    uint32_t words[4];
+    for(size_t j = 0; j < len; ++j){
+        size_t i = start + j;
+        if(j == 0 || i % 4 == 0) philox(words, i / 4, key);
+        ret[j] = dropoutKeep(words[i % 4], p) ? data1[j] * scale : 0;
+    }
+}
+
+template<typename T>
+void cpuDropout(T * ret, T * data1, double p, uint64_t key, size_t dataLen){
+    size_t numBlocks = (dataLen + FUSEDBLOCKSIZE - 1) / FUSEDBLOCKSIZE;
+    #pragma omp parallel for
+    for(size_t b = 0; b < numBlocks; ++b){
+        size_t start = b * FUSEDBLOCKSIZE;
+        size_t len = dataLen - start < FUSEDBLOCKSIZE ? dataLen - start : FUSEDBLOCKSIZE;
+        dropoutRange(ret + start, data1 + start, start, len, p, key);
+    }
+}
+
+
+template<typename T>
+void cpuFusedElementwise(T * ret, T ** inputs, size_t * inputStrides, size_t numInputs, FusedInstruction * instructions, size_t numInstructions, size_t dataLen){
+    size_t numBlocks = (dataLen + FUSEDBLOCKSIZE - 1) / FUSEDBLOCKSIZE;
+    size_t numRegisters = numInputs + numInstructions;
+
+    #pragma omp parallel
+    {
+        // Each thread runs the whole program over one cache sized block at a time
+        std::vector<T> scratch(numRegisters * FUSEDBLOCKSIZE);
+        std::vector<T *> registers(numRegisters);
+
+        for(size_t i = 0; i < numInputs; ++i){
+            if(inputStrides[i] == 0){
+                registers[i] = scratch.data() + i * FUSEDBLOCKSIZE;
+                for(size_t j = 0; j < FUSEDBLOCKSIZE; ++j) registers[i][j] = inputs[i][0];
+            }
+        }
+
+        #pragma omp for
+        for(size_t b = 0; b < numBlocks; ++b){
+            size_t start = b * FUSEDBLOCKSIZE;
+            size_t len = dataLen - start < FUSEDBLOCKSIZE ? dataLen - start : FUSEDBLOCKSIZE;
+
+            for(size_t i = 0; i < numInputs; ++i)
+                if(inputStrides[i] != 0) registers[i] = inputs[i] + start;
+
+            for(size_t k = 0; k < numInstructions; ++k){
+                FusedInstruction& ins = instructions[k];
+                T * out = k == numInstructions - 1 ? ret + start : scratch.data() + (numInputs + k) * FUSEDBLOCKSIZE;
+                T * a = registers[ins.arg1];
+                T * c = registers[ins.arg2];
+                T n = (T) ins.n;
+                registers[numInputs + k] = out;
+
+                switch(ins.op){
+                    case FUSEDNEG: simdElementwise<SIMDNEG, T>(out, a, nullptr, 0, len); break;
+                    case FUSEDADD: simdElementwise<SIMDADD, T>(out, a, c, 0, len); break;
+                    case FUSEDADDSCALAR: simdElementwise<SIMDADDSCALAR, T>(out, a, nullptr, n, len); break;
+                    case FUSEDSUBTRACT: simdElementwise<SIMDSUBTRACT, T>(out, a, c, 0, len); break;
+                    case FUSEDSUBTRACTSCALAR: simdElementwise<SIMDSUBTRACTSCALAR, T>(out, a, nullptr, n, len); break;
+                    case FUSEDMULT: simdElementwise<SIMDMULT, T>(out, a, c, 0, len); break;
+                    case FUSEDMULTSCALAR: simdElementwise<SIMDMULTSCALAR, T>(out, a, nullptr, n, len); break;
+                    case FUSEDDIVISION: simdElementwise<SIMDDIVISION, T>(out, a, c, 0, len); break;
+                    case FUSEDDIVISIONSCALAR: simdElementwise<SIMDDIVISIONSCALAR, T>(out, a, nullptr, n, len); break;
+                    case FUSEDPOW:
+                        if(n == 2) simdElementwise<SIMDSQUARE, T>(out, a, nullptr, 0, len);
+                        else for(size_t j = 0; j < len; ++j) out[j] = std::pow(a[j], n);
+                        break;
+                    case FUSEDRELU: simdElementwise<SIMDRELU, T>(out, a, nullptr, 0, len); break;
+                    case FUSEDBINARIZE: simdElementwise<SIMDBINARIZE, T>(out, a, nullptr, 0, len); break;
+                    case FUSEDDROPOUT: dropoutRange(out, a, start, len, ins.n, ins.key); break;
+                }
             }
         }
     }
 }
 
-void cpuReduceSum(double * ret, double * data1, size_t dataLen){
-    ret[0] = 0;
-    #pragma omp parallel for reduction(+:ret[0])
+// Optimizer updates run in place over a flat buffer holding every parameter of one dtype and device,
+// with gradients and optimizer state in the same layout
+
+template<typename T>
+void cpuSgdStep(T * params, T * grads, T learningRate, size_t dataLen){
+    #pragma omp parallel for
     for(size_t i = 0; i < dataLen; ++i){
-        ret[0] += data1[i];
+        params[i] -= learningRate * grads[i];
     }
 }
 
-void cpuFillRandom(double * ret, double mean, double stddev, size_t dataLen){
-    std::normal_distribution<double> dist(mean, stddev);
+template<typename T>
+void cpuMomentumStep(T * params, T * grads, T * velocity, T learningRate, T momentum, size_t dataLen){
+    #pragma omp parallel for
+    for(size_t i = 0; i < dataLen; ++i){
+        velocity[i] = momentum * velocity[i] + grads[i];
+        params[i] -= learningRate * velocity[i];
+    }
+}
+
+// step counts from 1 and corrects the bias of the moment estimates towards zero
+template<typename T>
+void cpuAdamStep(T * params, T * grads, T * m, T * v, T learningRate, T beta1, T beta2, T epsilon, size_t step, size_t dataLen){
+    T stepSize = learningRate / (1 - std::pow(beta1, (T) step));
+    T correction2 = 1 / (1 - std::pow(beta2, (T) step));
+    #pragma omp parallel for
+    for(size_t i = 0; i < dataLen; ++i){
+        T g = grads[i];
+        m[i] = beta1 * m[i] + (1 - beta1) * g;
+        v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+        params[i] -= stepSize * m[i] / (std::sqrt(v[i] * correction2) + epsilon);
+    }
+}
 
+template<typename T, typename U>
+void cpuConvert(T * ret, U * data1, size_t dataLen){
     #pragma omp parallel for
     for(size_t i = 0; i < dataLen; ++i){
-        ret[i] = dist(generator);
+        ret[i] = (T) data1[i];
     }
 }
 
+template void cpuConvert<float, double>(float * ret, double * data1, size_t dataLen);
+template void cpuConvert<double, float>(double * ret, float * data1, size_t dataLen);
+
+// Every kernel is compiled for each supported element type
+#define INSTANTIATECPUFUNCTIONS(TYPE) \
+    template void cpuCopy<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void cpuNeg<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void cpuAdd<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t dataLen); \
+    template void cpuAddScalar<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void cpuSubtract<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t dataLen); \
+    template void cpuSubtractScalar<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void cpuScalarSubtract<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void cpuPow<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void cpuZeroes<TYPE>(TYPE * ret, size_t dataLen); \
+    template void cpuOnes<TYPE>(TYPE * ret, size_t dataLen); \
+    template void cpuFill<TYPE>(TYPE * ret, TYPE n, size_t dataLen); \
+    template void cpuElementwiseMult<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t dataLen); \
+    template void cpuElementwiseMultScalar<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void cpuElementwiseDivision<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t dataLen); \
+    template void cpuElementwiseDivisionScalar<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void cpuElementwiseDivisionScalar2<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void cpuAddBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void cpuSubtractBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void cpuElementwiseMultBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void cpuElementwiseDivisionBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void cpuSumToShape<TYPE>(TYPE * ret, TYPE * data1, BroadcastShape shape, size_t retLen); \
+    template void cpuStridedCopy<TYPE>(TYPE * ret, TYPE * data1, BroadcastShape shape); \
+    template void cpuRelu<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void cpuBinarize<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void cpuGemm<TYPE>(TYPE * ret, TYPE * a, TYPE * b, size_t m, size_t n, size_t k, size_t aRowStride, size_t aColStride, size_t bRowStride, size_t bColStride, bool accumulate); \
+    template void cpuMatmul2d<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1); \
+    template void cpuMatmul3d<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1); \
+    template void cpuMatmulBatched<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides); \
+    template void cpuMatmulGradLeft<TYPE>(TYPE * ret, TYPE * grad, TYPE * data2, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides, bool reduceBatch); \
+    template void cpuMatmulGradRight<TYPE>(TYPE * ret, TYPE * data1, TYPE * grad, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides, bool reduceBatch); \
+    template void cpuQuantize<TYPE>(int8_t * ret, float * scales, TYPE * data1, size_t rows, size_t channels); \
+    template void cpuDequantize<TYPE>(TYPE * ret, int8_t * data1, float * scales, size_t rows, size_t channels); \
+    template void cpuMatmulInt8<TYPE>(TYPE * ret, TYPE * data1, int8_t * data2, float * scales2, size_t batch, size_t m, size_t n, size_t k, size_t data1BatchStride, size_t data2BatchStride); \
+    template void cpuTranspose2d<TYPE>(TYPE * ret, TYPE * data1, size_t retDims0, size_t retDims1); \
+    template void cpuTranspose3d<TYPE>(TYPE * ret, TYPE * data1, size_t retDims0, size_t retDims1, size_t retDims2); \
+    template void cpuReduceSum<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void cpuReduce<TYPE>(TYPE * ret, TYPE * data1, size_t outer, size_t reduceLen, size_t inner, reductionOperation op, TYPE scale); \
+    template void cpuEqualBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void cpuSoftmax<TYPE>(TYPE * ret, TYPE * data1, size_t rows, size_t cols); \
+    template void cpuSoftmaxBackward<TYPE>(TYPE * ret, TYPE * grad, TYPE * out, size_t rows, size_t cols); \
+    template void cpuArgmax<TYPE>(TYPE * ret, TYPE * data1, size_t rows, size_t cols); \
+    template void cpuCrossEntropy<TYPE>(TYPE * ret, TYPE * logits, TYPE * labels, size_t rows, size_t cols, bool indexLabels); \
+    template void cpuCrossEntropyBackward<TYPE>(TYPE * ret, TYPE * grad, TYPE * logits, TYPE * labels, size_t rows, size_t cols, bool indexLabels); \
+    template void cpuSgdStep<TYPE>(TYPE * params, TYPE * grads, TYPE learningRate, size_t dataLen); \
+    template void cpuMomentumStep<TYPE>(TYPE * params, TYPE * grads, TYPE * velocity, TYPE learningRate, TYPE momentum, size_t dataLen); \
+    template void cpuAdamStep<TYPE>(TYPE * params, TYPE * grads, TYPE * m, TYPE * v, TYPE learningRate, TYPE beta1, TYPE beta2, TYPE epsilon, size_t step, size_t dataLen); \
+    template void cpuFillRandom<TYPE>(TYPE * ret, TYPE mean, TYPE stddev, uint64_t key, size_t dataLen); \
+    template void cpuDropout<TYPE>(TYPE * ret, TYPE * data1, double p, uint64_t key, size_t dataLen); \
+    template void cpuFusedElementwise<TYPE>(TYPE * ret, TYPE ** inputs, size_t * inputStrides, size_t numInputs, FusedInstruction * instructions, size_t numInstructions, size_t dataLen);
+
+INSTANTIATECPUFUNCTIONS(float)
+INSTANTIATECPUFUNCTIONS(double)
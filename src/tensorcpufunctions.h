@@ -9,31 +9,157 @@
 #ifndef TENSORCPUFUNCTIONH
 #define TENSORCPUFUNCTIONH
 
+#include <cstdint>
 #include <cstdlib>
 
-void cpuNeg(double * ret, double * data1, size_t dataLen);
-void cpuAdd(double * ret, double * data1, double * data2, size_t dataLen);
-void cpuAddScalar(double * ret, double * data1, double n, size_t dataLen);
-void cpuSubtract(double * ret, double * data1, double * data2, size_t dataLen);
-void cpuSubtractScalar(double * ret, double * data1, double n, size_t dataLen);
-void cpuScalarSubtract(double * ret, double * data1, double n, size_t dataLen);
-void cpuPow(double * ret, double * data1, double n, size_t dataLen);
-void cpuZeroes(double * ret, size_t dataLen);
-void cpuOnes(double * ret, size_t dataLen);
-void cpuFill(double * ret, double n, size_t dataLen);
-void cpuElementwiseMult(double * ret, double * data1, double * data2, size_t dataLen);
-void cpuElementwiseMultScalar(double * ret, double * data1, double n, size_t dataLen);
-void cpuElementwiseDivision(double * ret, double * data1, double * data2, size_t dataLen);
-void cpuElementwiseDivisionScalar(double * ret, double * data1, double n, size_t dataLen);
-void cpuElementwiseDivisionScalar2(double * ret, double * data1, double n, size_t dataLen);
-void cpuRelu(double * ret, double * data1, size_t dataLen);
-void cpuBinarize(double * ret, double * data1, size_t dataLen);
-void cpuMatmul2d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1);
-void cpuMatmul3d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1);
-void cpuTranspose2d(double * ret, double * data1, size_t retDims0, size_t retDims1);
-void cpuTranspose3d(double * ret, double * data1, size_t retDims0, size_t retDims1, size_t retDims2);
-void cpuReduceSum(double * ret, double * data1, size_t dataLen);
-void cpuFillRandom(double * ret, double mean, double stddev, size_t dataLen);
+enum fusedOperation {FUSEDNEG, FUSEDADD, FUSEDADDSCALAR, FUSEDSUBTRACT, FUSEDSUBTRACTSCALAR,
+    FUSEDMULT, FUSEDMULTSCALAR, FUSEDDIVISION, FUSEDDIVISIONSCALAR, FUSEDPOW, FUSEDRELU, FUSEDBINARIZE,
+    FUSEDDROPOUT};
+
+/**
+ * One step of a fused elementwise program. Registers 0 to numInputs - 1 hold the inputs and
+ * instruction k writes register numInputs + k. Scalar instructions read n instead of arg2.
+ * Dropout reads its probability from n and its random key from key.
+ */
+struct FusedInstruction{
+    fusedOperation op;
+    size_t arg1, arg2;
+    double n;
+    uint64_t key;
+};
+
+#ifdef __CUDACC__
+    #define HOSTDEVICE __host__ __device__
+#else
+    #define HOSTDEVICE
+#endif
+
+#define PHILOXM0 0xD2511F53u
+#define PHILOXM1 0xCD9E8D57u
+#define PHILOXW0 0x9E3779B9u
+#define PHILOXW1 0xBB67AE85u
+
+/**
+ * Philox4x32-10 counter-based generator (Salmon et al., "Parallel random numbers: as easy as
+ * 1, 2, 3"). Writes four random words that depend only on counter and key, so element i of a
+ * random tensor is computed from i and the tensor's key alone and the result is the same for
+ * any number of threads and on either device.
+ */
+HOSTDEVICE inline void philox(uint32_t * out, uint64_t counter, uint64_t key){
+    uint32_t c0 = (uint32_t) counter, c1 = (uint32_t) (counter >> 32), c2 = 0, c3 = 0;
+    uint32_t k0 = (uint32_t) key, k1 = (uint32_t) (key >> 32);
+    for(int round = 0; round < 10; ++round){
+        uint64_t p0 = (uint64_t) PHILOXM0 * c0;
+        uint64_t p1 = (uint64_t) PHILOXM1 * c2;
+        c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t) p1;
+        c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t) p0;
+        k0 += PHILOXW0;
+        k1 += PHILOXW1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// Uniform in [0, 1) with 53 random bits taken from two words
+HOSTDEVICE inline double philoxUniform(uint32_t hi, uint32_t lo){
+    return ((((uint64_t) hi << 32) | lo) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Dropout keeps element i when word i % 4 of philox(i / 4, key), as a fraction of 2^32, is at least p
+HOSTDEVICE inline bool dropoutKeep(uint32_t word, double p){
+    return word * (1.0 / 4294967296.0) >= p;
+}
+
+enum reductionOperation {REDUCTIONSUM, REDUCTIONMAX};
+
+// Instruction sets the vectorized CPU kernels are compiled for, SIMDAVX2 also needs FMA and SIMDAVX512 needs AVX512BW
+enum simdLevel {SIMDNONE, SIMDSSE, SIMDAVX2, SIMDAVX512};
+
+// The set in use, at startup the best one CPUID reports
+simdLevel cpuGetSimdLevel();
+
+// Selects a set for testing or benchmarking, clamped to the best one the CPU supports
+void cpuSetSimdLevel(simdLevel level);
+
+#define BROADCASTMAXDIMS 8
+
+/**
+ * Shape of an operation over two strided operands, with adjacent dimensions merged where possible.
+ * For broadcast binary operations the strides of an operand are zero along the dimensions it is
+ * broadcast over, so broadcast operands are never expanded in memory. Strided copies write
+ * through strides1 and read through strides2.
+ */
+struct BroadcastShape{
+    size_t numDims;
+    size_t dims[BROADCASTMAXDIMS];
+    size_t strides1[BROADCASTMAXDIMS], strides2[BROADCASTMAXDIMS];
+};
+
+/**
+ * Element strides of the two operands of a batched matrix product. A batch stride of zero
+ * broadcasts the operand over the batch, and row and column strides let transposed views be
+ * read in place.
+ */
+struct MatmulStrides{
+    size_t batch1, row1, col1;
+    size_t batch2, row2, col2;
+};
+
+// Kernels are templated on the element type and instantiated for float and double.
+template<typename T> void cpuCopy(T * ret, T * data1, size_t dataLen);
+template<typename T> void cpuNeg(T * ret, T * data1, size_t dataLen);
+template<typename T> void cpuAdd(T * ret, T * data1, T * data2, size_t dataLen);
+template<typename T> void cpuAddScalar(T * ret, T * data1, T n, size_t dataLen);
+template<typename T> void cpuSubtract(T * ret, T * data1, T * data2, size_t dataLen);
+template<typename T> void cpuSubtractScalar(T * ret, T * data1, T n, size_t dataLen);
+template<typename T> void cpuScalarSubtract(T * ret, T * data1, T n, size_t dataLen);
+template<typename T> void cpuPow(T * ret, T * data1, T n, size_t dataLen);
+template<typename T> void cpuZeroes(T * ret, size_t dataLen);
+template<typename T> void cpuOnes(T * ret, size_t dataLen);
+template<typename T> void cpuFill(T * ret, T n, size_t dataLen);
+template<typename T> void cpuElementwiseMult(T * ret, T * data1, T * data2, size_t dataLen);
+template<typename T> void cpuElementwiseMultScalar(T * ret, T * data1, T n, size_t dataLen);
+template<typename T> void cpuElementwiseDivision(T * ret, T * data1, T * data2, size_t dataLen);
+template<typename T> void cpuElementwiseDivisionScalar(T * ret, T * data1, T n, size_t dataLen);
+template<typename T> void cpuElementwiseDivisionScalar2(T * ret, T * data1, T n, size_t dataLen);
+template<typename T> void cpuAddBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
+template<typename T> void cpuSubtractBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
+template<typename T> void cpuElementwiseMultBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
+template<typename T> void cpuElementwiseDivisionBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
+template<typename T> void cpuSumToShape(T * ret, T * data1, BroadcastShape shape, size_t retLen);
+template<typename T> void cpuStridedCopy(T * ret, T * data1, BroadcastShape shape);
+template<typename T> void cpuRelu(T * ret, T * data1, size_t dataLen);
+template<typename T> void cpuBinarize(T * ret, T * data1, size_t dataLen);
+template<typename T> void cpuGemm(T * ret, T * a, T * b, size_t m, size_t n, size_t k, size_t aRowStride, size_t aColStride, size_t bRowStride, size_t bColStride, bool accumulate);
+template<typename T> void cpuMatmul2d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1);
+template<typename T> void cpuMatmul3d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1);
+template<typename T> void cpuMatmulBatched(T * ret, T * data1, T * data2, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides);
+template<typename T> void cpuMatmulGradLeft(T * ret, T * grad, T * data2, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides, bool reduceBatch);
+template<typename T> void cpuMatmulGradRight(T * ret, T * data1, T * grad, size_t batch, size_t m, size_t n, size_t k, MatmulStrides strides, bool reduceBatch);
+template<typename T> void cpuQuantize(int8_t * ret, float * scales, T * data1, size_t rows, size_t channels);
+template<typename T> void cpuDequantize(T * ret, int8_t * data1, float * scales, size_t rows, size_t channels);
+template<typename T> void cpuMatmulInt8(T * ret, T * data1, int8_t * data2, float * scales2, size_t batch, size_t m, size_t n, size_t k, size_t data1BatchStride, size_t data2BatchStride);
+template<typename T> void cpuTranspose2d(T * ret, T * data1, size_t retDims0, size_t retDims1);
+template<typename T> void cpuTranspose3d(T * ret, T * data1, size_t retDims0, size_t retDims1, size_t retDims2);
+template<typename T> void cpuReduceSum(T * ret, T * data1, size_t dataLen);
+template<typename T> void cpuReduce(T * ret, T * data1, size_t outer, size_t reduceLen, size_t inner, reductionOperation op, T scale);
+template<typename T> void cpuEqualBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
+template<typename T> void cpuSoftmax(T * ret, T * data1, size_t rows, size_t cols);
+template<typename T> void cpuSoftmaxBackward(T * ret, T * grad, T * out, size_t rows, size_t cols);
+template<typename T> void cpuArgmax(T * ret, T * data1, size_t rows, size_t cols);
+template<typename T> void cpuCrossEntropy(T * ret, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels);
+template<typename T> void cpuCrossEntropyBackward(T * ret, T * grad, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels);
+template<typename T> void cpuSgdStep(T * params, T * grads, T learningRate, size_t dataLen);
+template<typename T> void cpuMomentumStep(T * params, T * grads, T * velocity, T learningRate, T momentum, size_t dataLen);
+template<typename T> void cpuAdamStep(T * params, T * grads, T * m, T * v, T learningRate, T beta1, T beta2, T epsilon, size_t step, size_t dataLen);
+template<typename T> void cpuFillRandom(T * ret, T mean, T stddev, uint64_t key, size_t dataLen);
+template<typename T> void cpuDropout(T * ret, T * data1, double p, uint64_t key, size_t dataLen);
+template<typename T, typename U> void cpuConvert(T * ret, U * data1, size_t dataLen);
+template<typename T> void cpuFusedElementwise(T * ret, T ** inputs, size_t * inputStrides, size_t numInputs, FusedInstruction * instructions, size_t numInstructions, size_t dataLen);
 
 #endif
 
@@ -6,7 +6,10 @@
  * @date November 2024
  */
 
+#include <cmath>
+
 #include "tensorgpufunctions.h"
+#include "tensormemorypool.h"
 
 #define NUMBLOCKS 256
 #define NUMTHREADS 256
@@ -14,6 +17,7 @@
 #define NUMTHREADS2D 16
 #define NUMBLOCKS3D 8
 #define NUMTHREADS3D 8
+#define TWOPI 6.283185307179586
 
 dim3 numblocks2dDIM(NUMBLOCKS2D, NUMBLOCKS2D);
 dim3 numthreads2dDIM(NUMTHREADS2D, NUMTHREADS2D);
@@ -21,112 +25,203 @@ dim3 numblocks3dDIM(NUMBLOCKS3D, NUMBLOCKS3D, NUMBLOCKS3D);
 dim3 numthreads3dDIM(NUMTHREADS3D, NUMTHREADS3D, NUMTHREADS3D);
 
 
-__global__ void gpuNeg(double * ret, double * data1, size_t dataLen){
+template<typename T>
+__global__ void gpuCopy(T * ret, T * data1, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        ret[i] = data1[i];
+    }
+}
+
+template<typename T>
+__global__ void gpuNeg(T * ret, T * data1, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = -data1[i];
     }
 }
 
-__global__ void gpuAdd(double * ret, double * data1, double * data2, size_t dataLen){
+template<typename T>
+__global__ void gpuAdd(T * ret, T * data1, T * data2, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] + data2[i];
     }
 }
 
-__global__ void gpuAddScalar(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+__global__ void gpuAddScalar(T * ret, T * data1, T n, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] + n;
     }
 }
 
-__global__ void gpuSubtract(double * ret, double * data1, double * data2, size_t dataLen){
+template<typename T>
+__global__ void gpuSubtract(T * ret, T * data1, T * data2, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] - data2[i];
     }
 }
 
-__global__ void gpuSubtractScalar(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+__global__ void gpuSubtractScalar(T * ret, T * data1, T n, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] - n;
     }
 }
 
-__global__ void gpuScalarSubtract(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+__global__ void gpuScalarSubtract(T * ret, T * data1, T n, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = n - data1[i];
     }
 }
 
-__global__ void gpuPow(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+__global__ void gpuPow(T * ret, T * data1, T n, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = pow(data1[i], n);
     }
 }
 
-__global__ void gpuZeroes(double * ret, size_t dataLen){
+template<typename T>
+__global__ void gpuZeroes(T * ret, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = 0;
     }
 }
 
-__global__ void gpuOnes(double * ret, size_t dataLen){
+template<typename T>
+__global__ void gpuOnes(T * ret, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = 1;
     }
 }
 
-__global__ void gpuFill(double * ret, double n, size_t dataLen){
+template<typename T>
+__global__ void gpuFill(T * ret, T n, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = n;
     }
 }
 
-__global__ void gpuElementwiseMult(double * ret, double * data1, double * data2, size_t dataLen){
+template<typename T>
+__global__ void gpuElementwiseMult(T * ret, T * data1, T * data2, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] * data2[i];
     }
 }
 
-__global__ void gpuElementwiseMultScalar(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+__global__ void gpuElementwiseMultScalar(T * ret, T * data1, T n, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] * n;
     }
 }
 
-__global__ void gpuRelu(double * ret, double * data1, size_t dataLen){
+template<typename T>
+__global__ void gpuRelu(T * ret, T * data1, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] > 0 ? data1[i] : 0;
     }
 }
 
-__global__ void gpuElementwiseDivision(double * ret, double * data1, double * data2, size_t dataLen){
+template<typename T>
+__global__ void gpuElementwiseDivision(T * ret, T * data1, T * data2, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] / data2[i];
     }
 }
 
-__global__ void gpuElementwiseDivisionScalar(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+__global__ void gpuElementwiseDivisionScalar(T * ret, T * data1, T n, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] / n;
     }
 }
 
-__global__ void gpuElementwiseDivisionScalar2(double * ret, double * data1, double n, size_t dataLen){
+template<typename T>
+__global__ void gpuElementwiseDivisionScalar2(T * ret, T * data1, T n, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = n / data1[i];
     }
 }
 
-__global__ void gpuBinarize(double * ret, double * data1, size_t dataLen){
+__device__ void gpuBroadcastOffsets(const BroadcastShape& shape, size_t i, size_t& offset1, size_t& offset2){
+    offset1 = offset2 = 0;
+    for(size_t d = shape.numDims; d-- > 0;){
+        size_t index = i % shape.dims[d];
+        i /= shape.dims[d];
+        offset1 += index * shape.strides1[d];
+        offset2 += index * shape.strides2[d];
+    }
+}
+
+template<typename T>
+__global__ void gpuAddBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        size_t offset1, offset2;
+        gpuBroadcastOffsets(shape, i, offset1, offset2);
+        ret[i] = data1[offset1] + data2[offset2];
+    }
+}
+
+template<typename T>
+__global__ void gpuSubtractBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        size_t offset1, offset2;
+        gpuBroadcastOffsets(shape, i, offset1, offset2);
+        ret[i] = data1[offset1] - data2[offset2];
+    }
+}
+
+template<typename T>
+__global__ void gpuElementwiseMultBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        size_t offset1, offset2;
+        gpuBroadcastOffsets(shape, i, offset1, offset2);
+        ret[i] = data1[offset1] * data2[offset2];
+    }
+}
+
+template<typename T>
+__global__ void gpuElementwiseDivisionBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        size_t offset1, offset2;
+        gpuBroadcastOffsets(shape, i, offset1, offset2);
+        ret[i] = data1[offset1] / data2[offset2];
+    }
+}
+
+template<typename T>
+__global__ void gpuSumToShape(T * ret, T * data1, BroadcastShape shape, size_t dataLen, size_t retLen){
+    // kernel must be started with <<<1,1>>>
+    for(size_t i = 0; i < retLen; ++i) ret[i] = 0;
+    for(size_t i = 0; i < dataLen; ++i){
+        size_t offset1, offset2;
+        gpuBroadcastOffsets(shape, i, offset1, offset2);
+        ret[offset1] += data1[i];
+    }
+}
+
+template<typename T>
+__global__ void gpuStridedCopy(T * ret, T * data1, BroadcastShape shape, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        size_t offset1, offset2;
+        gpuBroadcastOffsets(shape, i, offset1, offset2);
+        ret[offset1] = data1[offset2];
+    }
+}
+
+template<typename T>
+__global__ void gpuBinarize(T * ret, T * data1, size_t dataLen){
     for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
         ret[i] = data1[i] > 0 ? 1 : 0;
     }
 }
 
-__global__ void gpuMatmul2d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1){
+template<typename T>
+__global__ void gpuMatmul2d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1){
     for(size_t i = blockIdx.x  * blockDim.x + threadIdx.x; i < retDims0; i += NUMBLOCKS2D * NUMTHREADS2D){
         for(size_t j = blockIdx.y * blockDim.y + threadIdx.y; j < retDims1; j += NUMBLOCKS2D * NUMTHREADS2D){
-            ret[i * retDims0 + j] = 0;
+            ret[i * retDims1 + j] = 0;
             for(size_t k = 0; k < data1Dims1; ++k){
                 ret[i * retDims1 + j] += data1[i * data1Dims1 + k] * data2[k * data2Dims1 + j];
             }
@@ -134,11 +229,12 @@ __global__ void gpuMatmul2d(double * ret, double * data1, double * data2, size_t
     }
 }
 
-__global__ void gpuMatmul3d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1){
+template<typename T>
+__global__ void gpuMatmul3d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1){
     for(size_t b = blockIdx.x * blockDim.x + threadIdx.x; b < retDims0; b += NUMBLOCKS3D * NUMTHREADS3D){
         for(size_t i = blockIdx.y * blockDim.y + threadIdx.y; i < retDims1; i += NUMBLOCKS3D * NUMTHREADS3D){
             for(size_t j = blockIdx.z * blockDim.z + threadIdx.z; j < retDims2; j += NUMBLOCKS3D * NUMTHREADS3D){
-                ret[b * retDims2 * retDims1 + i * retDims1 + j] = 0;
+                ret[b * retDims2 * retDims1 + i * retDims2 + j] = 0;
                 for(size_t k = 0; k < data1Dims2; ++k){
                     ret[b * retDims2 * retDims1 + i * retDims2 + j] += data1[b * data1Dims2 * data1Dims1 + i * data1Dims2 + k] * data2[k * data2Dims1 + j];
                 }
@@ -147,25 +243,35 @@ __global__ void gpuMatmul3d(double * ret, double * data1, double * data2, size_t
     }
 }
 
-__global__ void gpuTranspose2d(double * ret, double * data1, size_t retDims0, size_t retDims1){
+template<typename T>
+__global__ void gpuTranspose2d(T * ret, T * data1, size_t retDims0, size_t retDims1){
     for(size_t i = blockIdx.x  * blockDim.x + threadIdx.x; i < retDims0; i += NUMBLOCKS2D * NUMTHREADS2D){
         for(size_t j = blockIdx.y * blockDim.y + threadIdx.y; j < retDims1; j += NUMBLOCKS2D * NUMTHREADS2D){
-            ret[j * retDims0 + i] = data1[i * retDims1 + j];
+            ret[i * retDims1 + j] = data1[j * retDims0 + i];
         }
     }
 }
 
-__global__ void gpuTranspose3d(double * ret, double * data1, size_t retDims0, size_t retDims1, size_t retDims2){
+template<typename T>
+__global__ void gpuTranspose3d(T * ret, T * data1, size_t retDims0, size_t retDims1, size_t retDims2){
     for(size_t b = blockIdx.x * blockDim.x + threadIdx.x; b < retDims0; b += NUMBLOCKS3D * NUMTHREADS3D){
         for(size_t i = blockIdx.y * blockDim.y + threadIdx.y; i < retDims1; i += NUMBLOCKS3D * NUMTHREADS3D){
             for(size_t j = blockIdx.z * blockDim.z + threadIdx.z; j < retDims2; j += NUMBLOCKS3D * NUMTHREADS3D){
-                ret[b * retDims1 * retDims2 + j * retDims1 + i] = data1[b * retDims1 * retDims2 + i * retDims2 + j];
+                ret[b * retDims1 * retDims2 + i * retDims2 + j] = data1[b * retDims1 * retDims2 + j * retDims1 + i];
             }
         }
     }
 }
 
-__global__ void gpuReduceSum(double * ret, double * data1, size_t dataLen){
+template<typename T, typename U>
+__global__ void gpuConvert(T * ret, U * data1, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        ret[i] = (T) data1[i];
+    }
+}
+
+template<typename T>
+__global__ void gpuReduceSum(T * ret, T * data1, size_t dataLen){
     // kernel must be started with <<<1,1>>>
     ret[0] = 0;
     for(size_t i = 0; i < dataLen; ++i){
@@ -173,68 +279,380 @@ __global__ void gpuReduceSum(double * ret, double * data1, size_t dataLen){
     }
 }
 
-void gpuSNeg(double * ret, double * data1, size_t dataLen)
+template<typename T>
+__global__ void gpuReduce(T * ret, T * data1, size_t outer, size_t reduceLen, size_t inner, reductionOperation op, T scale){
+    // one thread per element of ret, which is [outer, inner] while data1 is [outer, reduceLen, inner]
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < outer * inner; i += NUMBLOCKS * NUMTHREADS){
+        T * a = data1 + (i / inner) * reduceLen * inner + i % inner;
+        T acc = a[0];
+        for(size_t j = 1; j < reduceLen; ++j){
+            T x = a[j * inner];
+            acc = op == REDUCTIONSUM ? acc + x : (x > acc ? x : acc);
+        }
+        ret[i] = acc * scale;
+    }
+}
+
+template<typename T>
+__global__ void gpuEqualBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        size_t offset1, offset2;
+        gpuBroadcastOffsets(shape, i, offset1, offset2);
+        ret[i] = data1[offset1] == data2[offset2] ? 1 : 0;
+    }
+}
+
+template<typename T>
+__global__ void gpuSoftmax(T * ret, T * data1, size_t rows, size_t cols){
+    for(size_t r = blockIdx.x * blockDim.x + threadIdx.x; r < rows; r += NUMBLOCKS * NUMTHREADS){
+        T * a = data1 + r * cols;
+        T * out = ret + r * cols;
+        T max = a[0];
+        for(size_t j = 1; j < cols; ++j) max = a[j] > max ? a[j] : max;
+        T sum = 0;
+        for(size_t j = 0; j < cols; ++j){
+            out[j] = exp(a[j] - max);
+            sum += out[j];
+        }
+        for(size_t j = 0; j < cols; ++j) out[j] /= sum;
+    }
+}
+
+template<typename T>
+__global__ void gpuSoftmaxBackward(T * ret, T * grad, T * out, size_t rows, size_t cols){
+    for(size_t r = blockIdx.x * blockDim.x + threadIdx.x; r < rows; r += NUMBLOCKS * NUMTHREADS){
+        T dot = 0;
+        for(size_t j = 0; j < cols; ++j) dot += grad[r * cols + j] * out[r * cols + j];
+        for(size_t j = 0; j < cols; ++j) ret[r * cols + j] = out[r * cols + j] * (grad[r * cols + j] - dot);
+    }
+}
+
+template<typename T>
+__global__ void gpuArgmax(T * ret, T * data1, size_t rows, size_t cols){
+    for(size_t r = blockIdx.x * blockDim.x + threadIdx.x; r < rows; r += NUMBLOCKS * NUMTHREADS){
+        size_t index = 0;
+        for(size_t j = 1; j < cols; ++j) if(data1[r * cols + j] > data1[r * cols + index]) index = j;
+        ret[r] = (T) index;
+    }
+}
+
+template<typename T>
+__device__ T gpuLogSumExp(T * a, size_t len){
+    T max = a[0];
+    for(size_t j = 1; j < len; ++j) max = a[j] > max ? a[j] : max;
+    T sum = 0;
+    for(size_t j = 0; j < len; ++j) sum += exp(a[j] - max);
+    return max + log(sum);
+}
+
+template<typename T>
+__global__ void gpuCrossEntropy(T * ret, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels){
+    // one thread per row, ret holds the loss of each row and is then summed by gpuReduce
+    for(size_t r = blockIdx.x * blockDim.x + threadIdx.x; r < rows; r += NUMBLOCKS * NUMTHREADS){
+        T * x = logits + r * cols;
+        T lse = gpuLogSumExp(x, cols);
+        if(indexLabels) ret[r] = lse - x[(size_t) labels[r]];
+        else{
+            T loss = 0;
+            for(size_t j = 0; j < cols; ++j) loss += labels[r * cols + j] * (lse - x[j]);
+            ret[r] = loss;
+        }
+    }
+}
+
+template<typename T>
+__global__ void gpuCrossEntropyBackward(T * ret, T * grad, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels){
+    for(size_t r = blockIdx.x * blockDim.x + threadIdx.x; r < rows; r += NUMBLOCKS * NUMTHREADS){
+        T scale = grad[0] / rows;
+        T * x = logits + r * cols;
+        T lse = gpuLogSumExp(x, cols);
+        T targetSum = 1;
+        if(!indexLabels){
+            targetSum = 0;
+            for(size_t j = 0; j < cols; ++j) targetSum += labels[r * cols + j];
+        }
+        for(size_t j = 0; j < cols; ++j){
+            T target = indexLabels ? (j == (size_t) labels[r] ? 1 : 0) : labels[r * cols + j];
+            ret[r * cols + j] = (exp(x[j] - lse) * targetSum - target) * scale;
+        }
+    }
+}
+
+template<typename T>
+__global__ void gpuFillRandom(T * ret, T mean, T stddev, uint64_t key, size_t dataLen){
+    for(size_t j = blockIdx.x * blockDim.x + threadIdx.x; j < (dataLen + 1) / 2; j += NUMBLOCKS * NUMTHREADS){
+        uint32_t words[4];
+        philox(words, j, key);
+        double r = sqrt(-2 * log(1 - philoxUniform(words[0], words[1])));
+        double theta = TWOPI * philoxUniform(words[2], words[3]);
+        ret[2 * j] = (T) (mean + stddev * r * cos(theta));
+        if(2 * j + 1 < dataLen) ret[2 * j + 1] = (T) (mean + stddev * r * sin(theta));
+    }
+}
+
+template<typename T>
+__global__ void gpuDropout(T * ret, T * data1, double p, uint64_t key, size_t dataLen){
+    T scale = (T) (1 / (1 - p));
+    for(size_t g = blockIdx.x * blockDim.x + threadIdx.x; g < (dataLen + 3) / 4; g += NUMBLOCKS * NUMTHREADS){
+        uint32_t words[4];
+        philox(words, g, key);
+        for(size_t i = 4 * g; i < 4 * g + 4 && i < dataLen; ++i)
+            ret[i] = dropoutKeep(words[i % 4], p) ? data1[i] * scale : 0;
+    }
+}
+
+template<typename T>
+__global__ void gpuSgdStep(T * params, T * grads, T learningRate, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        params[i] -= learningRate * grads[i];
+    }
+}
+
+template<typename T>
+__global__ void gpuMomentumStep(T * params, T * grads, T * velocity, T learningRate, T momentum, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        velocity[i] = momentum * velocity[i] + grads[i];
+        params[i] -= learningRate * velocity[i];
+    }
+}
+
+template<typename T>
+__global__ void gpuAdamStep(T * params, T * grads, T * m, T * v, T stepSize, T beta1, T beta2, T correction2, T epsilon, size_t dataLen){
+    for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < dataLen; i += NUMBLOCKS * NUMTHREADS){
+        T g = grads[i];
+        m[i] = beta1 * m[i] + (1 - beta1) * g;
+        v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+        params[i] -= stepSize * m[i] / (sqrt(v[i] * correction2) + epsilon);
+    }
+}
+
+template<typename T>
+void gpuSCopy(T * ret, T * data1, size_t dataLen)
+{gpuCopy<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, dataLen);}
+
+template<typename T>
+void gpuSNeg(T * ret, T * data1, size_t dataLen)
 {gpuNeg<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, dataLen);}
 
-void gpuSAdd(double * ret, double * data1, double * data2, size_t dataLen)
+template<typename T>
+void gpuSAdd(T * ret, T * data1, T * data2, size_t dataLen)
 {gpuAdd<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, dataLen);}
 
-void gpuSAddScalar(double * ret, double * data1, double n, size_t dataLen)
+template<typename T>
+void gpuSAddScalar(T * ret, T * data1, T n, size_t dataLen)
 {gpuAddScalar<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, n, dataLen);}
 
-void gpuSSubtract(double * ret, double * data1, double * data2, size_t dataLen)
+template<typename T>
+void gpuSSubtract(T * ret, T * data1, T * data2, size_t dataLen)
 {gpuSubtract<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, dataLen);}
 
-void gpuSSubtractScalar(double * ret, double * data1, double n, size_t dataLen)
+template<typename T>
+void gpuSSubtractScalar(T * ret, T * data1, T n, size_t dataLen)
 {gpuSubtractScalar<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, n, dataLen);}
 
-void gpuSScalarSubtract(double * ret, double * data1, double n, size_t dataLen)
+template<typename T>
+void gpuSScalarSubtract(T * ret, T * data1, T n, size_t dataLen)
 {gpuScalarSubtract<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, n, dataLen);}
 
-void gpuSPow(double * ret, double * data1, double n, size_t dataLen)
+template<typename T>
+void gpuSPow(T * ret, T * data1, T n, size_t dataLen)
 {gpuPow<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, n, dataLen);}
 
-void gpuSZeroes(double * ret, size_t dataLen)
+template<typename T>
+void gpuSZeroes(T * ret, size_t dataLen)
 {gpuZeroes<<<NUMBLOCKS, NUMTHREADS>>>(ret, dataLen);}
 
-void gpuSOnes(double * ret, size_t dataLen)
+template<typename T>
+void gpuSOnes(T * ret, size_t dataLen)
 {gpuOnes<<<NUMBLOCKS, NUMTHREADS>>>(ret, dataLen);}
 
-void gpuSFill(double * ret, double n, size_t dataLen)
+template<typename T>
+void gpuSFill(T * ret, T n, size_t dataLen)
 {gpuFill<<<NUMBLOCKS, NUMTHREADS>>>(ret, n, dataLen);}
 
-void gpuSElementwiseMult(double * ret, double * data1, double * data2, size_t dataLen)
+template<typename T>
+void gpuSElementwiseMult(T * ret, T * data1, T * data2, size_t dataLen)
 {gpuElementwiseMult<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, dataLen);}
 
-void gpuSElementwiseMultScalar(double * ret, double * data1, double n, size_t dataLen)
+template<typename T>
+void gpuSElementwiseMultScalar(T * ret, T * data1, T n, size_t dataLen)
 {gpuElementwiseMultScalar<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, n, dataLen);}
 
-void gpuSElementwiseDivision(double * ret, double * data1, double * data2, size_t dataLen)
+template<typename T>
+void gpuSElementwiseDivision(T * ret, T * data1, T * data2, size_t dataLen)
 {gpuElementwiseDivision<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, dataLen);}
 
-void gpuSElementwiseDivisionScalar(double * ret, double * data1, double n, size_t dataLen)
+template<typename T>
+void gpuSElementwiseDivisionScalar(T * ret, T * data1, T n, size_t dataLen)
 {gpuElementwiseDivisionScalar<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, n, dataLen);}
 
-void gpuSElementwiseDivisionScalar2(double * ret, double * data1, double n, size_t dataLen)
+template<typename T>
+void gpuSElementwiseDivisionScalar2(T * ret, T * data1, T n, size_t dataLen)
 {gpuElementwiseDivisionScalar2<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, n, dataLen);}
 
-void gpuSRelu(double * ret, double * data1, size_t dataLen)
+static size_t broadcastLen(BroadcastShape shape){
+    size_t dataLen = 1;
+    for(size_t d = 0; d < shape.numDims; ++d) dataLen *= shape.dims[d];
+    return dataLen;
+}
+
+template<typename T>
+void gpuSAddBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape)
+{gpuAddBroadcast<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, shape, broadcastLen(shape));}
+
+template<typename T>
+void gpuSSubtractBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape)
+{gpuSubtractBroadcast<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, shape, broadcastLen(shape));}
+
+template<typename T>
+void gpuSElementwiseMultBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape)
+{gpuElementwiseMultBroadcast<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, shape, broadcastLen(shape));}
+
+template<typename T>
+void gpuSElementwiseDivisionBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape)
+{gpuElementwiseDivisionBroadcast<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, shape, broadcastLen(shape));}
+
+template<typename T>
+void gpuSSumToShape(T * ret, T * data1, BroadcastShape shape, size_t retLen)
+{gpuSumToShape<<<1, 1>>>(ret, data1, shape, broadcastLen(shape), retLen);}
+
+template<typename T>
+void gpuSStridedCopy(T * ret, T * data1, BroadcastShape shape)
+{gpuStridedCopy<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, shape, broadcastLen(shape));}
+
+template<typename T>
+void gpuSRelu(T * ret, T * data1, size_t dataLen)
 {gpuRelu<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, dataLen);}
 
-void gpuSBinarize(double * ret, double * data1, size_t dataLen)
+template<typename T>
+void gpuSBinarize(T * ret, T * data1, size_t dataLen)
 {gpuBinarize<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, dataLen);}
 
-void gpuSMatmul2d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1)
+template<typename T>
+void gpuSMatmul2d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1)
 {gpuMatmul2d<<<numblocks2dDIM, numthreads2dDIM>>>(ret, data1, data2, retDims0, retDims1, data1Dims1, data2Dims1);}
 
-void gpuSMatmul3d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1)
+template<typename T>
+void gpuSMatmul3d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1)
 {gpuMatmul3d<<<numblocks3dDIM, numthreads3dDIM>>>(ret, data1, data2, retDims0, retDims1, retDims2, data1Dims1, data1Dims2, data2Dims1);}
 
-void gpuSTranspose2d(double * ret, double * data1, size_t retDims0, size_t retDims1)
+template<typename T>
+void gpuSTranspose2d(T * ret, T * data1, size_t retDims0, size_t retDims1)
 {gpuTranspose2d<<<numblocks2dDIM, numthreads2dDIM>>>(ret, data1, retDims0, retDims1);}
 
-void gpuSTranspose3d(double * ret, double * data1, size_t retDims0, size_t retDims1, size_t retDims2)
+template<typename T>
+void gpuSTranspose3d(T * ret, T * data1, size_t retDims0, size_t retDims1, size_t retDims2)
 {gpuTranspose3d<<<numblocks3dDIM, numthreads3dDIM>>>(ret, data1, retDims0, retDims1, retDims2);}
 
-void gpuSReduceSum(double * ret, double * data1, size_t dataLen)
+template<typename T>
+void gpuSReduceSum(T * ret, T * data1, size_t dataLen)
 {gpuReduceSum<<<1, 1>>>(ret, data1, dataLen);}
+
+template<typename T>
+void gpuSReduce(T * ret, T * data1, size_t outer, size_t reduceLen, size_t inner, reductionOperation op, T scale)
+{gpuReduce<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, outer, reduceLen, inner, op, scale);}
+
+template<typename T>
+void gpuSEqualBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape)
+{gpuEqualBroadcast<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, data2, shape, broadcastLen(shape));}
+
+template<typename T>
+void gpuSSoftmax(T * ret, T * data1, size_t rows, size_t cols)
+{gpuSoftmax<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, rows, cols);}
+
+template<typename T>
+void gpuSSoftmaxBackward(T * ret, T * grad, T * out, size_t rows, size_t cols)
+{gpuSoftmaxBackward<<<NUMBLOCKS, NUMTHREADS>>>(ret, grad, out, rows, cols);}
+
+template<typename T>
+void gpuSArgmax(T * ret, T * data1, size_t rows, size_t cols)
+{gpuArgmax<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, rows, cols);}
+
+template<typename T>
+void gpuSCrossEntropy(T * ret, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels)
+{
+    // The pool hands the buffer out again only to kernels queued after these on the same stream
+    auto losses = TensorMemoryPool::allocate(rows * sizeof(T), true);
+    gpuCrossEntropy<<<NUMBLOCKS, NUMTHREADS>>>(static_cast<T *>(losses.get()), logits, labels, rows, cols, indexLabels);
+    gpuReduce<<<1, 1>>>(ret, static_cast<T *>(losses.get()), 1, rows, 1, REDUCTIONSUM, (T) 1 / rows);
+}
+
+template<typename T>
+void gpuSCrossEntropyBackward(T * ret, T * grad, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels)
+{gpuCrossEntropyBackward<<<NUMBLOCKS, NUMTHREADS>>>(ret, grad, logits, labels, rows, cols, indexLabels);}
+
+template<typename T>
+void gpuSFillRandom(T * ret, T mean, T stddev, uint64_t key, size_t dataLen)
+{gpuFillRandom<<<NUMBLOCKS, NUMTHREADS>>>(ret, mean, stddev, key, dataLen);}
+
+template<typename T>
+void gpuSDropout(T * ret, T * data1, double p, uint64_t key, size_t dataLen)
+{gpuDropout<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, p, key, dataLen);}
+
+template<typename T>
+void gpuSSgdStep(T * params, T * grads, T learningRate, size_t dataLen)
+{gpuSgdStep<<<NUMBLOCKS, NUMTHREADS>>>(params, grads, learningRate, dataLen);}
+
+template<typename T>
+void gpuSMomentumStep(T * params, T * grads, T * velocity, T learningRate, T momentum, size_t dataLen)
+{gpuMomentumStep<<<NUMBLOCKS, NUMTHREADS>>>(params, grads, velocity, learningRate, momentum, dataLen);}
+
+// The bias corrections are the same for every element, so they are computed once on the host
+template<typename T>
+void gpuSAdamStep(T * params, T * grads, T * m, T * v, T learningRate, T beta1, T beta2, T epsilon, size_t step, size_t dataLen)
+{gpuAdamStep<<<NUMBLOCKS, NUMTHREADS>>>(params, grads, m, v, learningRate / (1 - std::pow(beta1, (T) step)),
+    beta1, beta2, 1 / (1 - std::pow(beta2, (T) step)), epsilon, dataLen);}
+
+template<typename T, typename U>
+void gpuSConvert(T * ret, U * data1, size_t dataLen)
+{gpuConvert<<<NUMBLOCKS, NUMTHREADS>>>(ret, data1, dataLen);}
+
+template void gpuSConvert<float, double>(float * ret, double * data1, size_t dataLen);
+template void gpuSConvert<double, float>(double * ret, float * data1, size_t dataLen);
+
+// Every kernel is compiled for each supported element type
+#define INSTANTIATEGPUFUNCTIONS(TYPE) \
+    template void gpuSCopy<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void gpuSNeg<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void gpuSAdd<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t dataLen); \
+    template void gpuSAddScalar<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void gpuSSubtract<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t dataLen); \
+    template void gpuSSubtractScalar<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void gpuSScalarSubtract<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void gpuSPow<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void gpuSZeroes<TYPE>(TYPE * ret, size_t dataLen); \
+    template void gpuSOnes<TYPE>(TYPE * ret, size_t dataLen); \
+    template void gpuSFill<TYPE>(TYPE * ret, TYPE n, size_t dataLen); \
+    template void gpuSElementwiseMult<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t dataLen); \
+    template void gpuSElementwiseMultScalar<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void gpuSElementwiseDivision<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t dataLen); \
+    template void gpuSElementwiseDivisionScalar<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void gpuSElementwiseDivisionScalar2<TYPE>(TYPE * ret, TYPE * data1, TYPE n, size_t dataLen); \
+    template void gpuSAddBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void gpuSSubtractBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void gpuSElementwiseMultBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void gpuSElementwiseDivisionBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void gpuSSumToShape<TYPE>(TYPE * ret, TYPE * data1, BroadcastShape shape, size_t retLen); \
+    template void gpuSStridedCopy<TYPE>(TYPE * ret, TYPE * data1, BroadcastShape shape); \
+    template void gpuSRelu<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void gpuSBinarize<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void gpuSMatmul2d<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1); \
+    template void gpuSMatmul3d<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1); \
+    template void gpuSTranspose2d<TYPE>(TYPE * ret, TYPE * data1, size_t retDims0, size_t retDims1); \
+    template void gpuSTranspose3d<TYPE>(TYPE * ret, TYPE * data1, size_t retDims0, size_t retDims1, size_t retDims2); \
+    template void gpuSReduceSum<TYPE>(TYPE * ret, TYPE * data1, size_t dataLen); \
+    template void gpuSReduce<TYPE>(TYPE * ret, TYPE * data1, size_t outer, size_t reduceLen, size_t inner, reductionOperation op, TYPE scale); \
+    template void gpuSEqualBroadcast<TYPE>(TYPE * ret, TYPE * data1, TYPE * data2, BroadcastShape shape); \
+    template void gpuSSoftmax<TYPE>(TYPE * ret, TYPE * data1, size_t rows, size_t cols); \
+    template void gpuSSoftmaxBackward<TYPE>(TYPE * ret, TYPE * grad, TYPE * out, size_t rows, size_t cols); \
+    template void gpuSArgmax<TYPE>(TYPE * ret, TYPE * data1, size_t rows, size_t cols); \
+    template void gpuSCrossEntropy<TYPE>(TYPE * ret, TYPE * logits, TYPE * labels, size_t rows, size_t cols, bool indexLabels); \
+    template void gpuSCrossEntropyBackward<TYPE>(TYPE * ret, TYPE * grad, TYPE * logits, TYPE * labels, size_t rows, size_t cols, bool indexLabels); \
+    template void gpuSFillRandom<TYPE>(TYPE * ret, TYPE mean, TYPE stddev, uint64_t key, size_t dataLen); \
+    template void gpuSDropout<TYPE>(TYPE * ret, TYPE * data1, double p, uint64_t key, size_t dataLen); \
+    template void gpuSSgdStep<TYPE>(TYPE * params, TYPE * grads, TYPE learningRate, size_t dataLen); \
+    template void gpuSMomentumStep<TYPE>(TYPE * params, TYPE * grads, TYPE * velocity, TYPE learningRate, TYPE momentum, size_t dataLen); \
+    template void gpuSAdamStep<TYPE>(TYPE * params, TYPE * grads, TYPE * m, TYPE * v, TYPE learningRate, TYPE beta1, TYPE beta2, TYPE epsilon, size_t step, size_t dataLen);
+
+INSTANTIATEGPUFUNCTIONS(float)
+INSTANTIATEGPUFUNCTIONS(double)
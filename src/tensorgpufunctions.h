@@ -9,48 +9,91 @@
 #ifndef TENSORGPUFUNCTIONH
 #define TENSORGPUFUNCTIONH
 
-void gpuSNeg(double * ret, double * data1, size_t dataLen);
+#include "tensorcpufunctions.h"
 
-void gpuSAdd(double * ret, double * data1, double * data2, size_t dataLen);
+// Kernels are templated on the element type and instantiated for float and double.
+template<typename T> void gpuSCopy(T * ret, T * data1, size_t dataLen);
 
-void gpuSAddScalar(double * ret, double * data1, double n, size_t dataLen);
+template<typename T> void gpuSNeg(T * ret, T * data1, size_t dataLen);
 
-void gpuSSubtract(double * ret, double * data1, double * data2, size_t dataLen);
+template<typename T> void gpuSAdd(T * ret, T * data1, T * data2, size_t dataLen);
 
-void gpuSSubtractScalar(double * ret, double * data1, double n, size_t dataLen);
+template<typename T> void gpuSAddScalar(T * ret, T * data1, T n, size_t dataLen);
 
-void gpuSScalarSubtract(double * ret, double * data1, double n, size_t dataLen);
+template<typename T> void gpuSSubtract(T * ret, T * data1, T * data2, size_t dataLen);
 
-void gpuSPow(double * ret, double * data1, double n, size_t dataLen);
+template<typename T> void gpuSSubtractScalar(T * ret, T * data1, T n, size_t dataLen);
 
-void gpuSZeroes(double * ret, size_t dataLen);
+template<typename T> void gpuSScalarSubtract(T * ret, T * data1, T n, size_t dataLen);
 
-void gpuSOnes(double * ret, size_t dataLen);
+template<typename T> void gpuSPow(T * ret, T * data1, T n, size_t dataLen);
 
-void gpuSFill(double * ret, double n, size_t dataLen);
+template<typename T> void gpuSZeroes(T * ret, size_t dataLen);
 
-void gpuSElementwiseMult(double * ret, double * data1, double * data2, size_t dataLen);
+template<typename T> void gpuSOnes(T * ret, size_t dataLen);
 
-void gpuSElementwiseMultScalar(double * ret, double * data1, double n, size_t dataLen);
+template<typename T> void gpuSFill(T * ret, T n, size_t dataLen);
 
-void gpuSElementwiseDivision(double * ret, double * data1, double * data2, size_t dataLen);
+template<typename T> void gpuSElementwiseMult(T * ret, T * data1, T * data2, size_t dataLen);
 
-void gpuSElementwiseDivisionScalar(double * ret, double * data1, double n, size_t dataLen);
+template<typename T> void gpuSElementwiseMultScalar(T * ret, T * data1, T n, size_t dataLen);
 
-void gpuSElementwiseDivisionScalar2(double * ret, double * data1, double n, size_t dataLen);
+template<typename T> void gpuSElementwiseDivision(T * ret, T * data1, T * data2, size_t dataLen);
 
-void gpuSRelu(double * ret, double * data1, size_t dataLen);
+template<typename T> void gpuSElementwiseDivisionScalar(T * ret, T * data1, T n, size_t dataLen);
 
-void gpuSBinarize(double * ret, double * data1, size_t dataLen);
+template<typename T> void gpuSElementwiseDivisionScalar2(T * ret, T * data1, T n, size_t dataLen);
 
-void gpuSMatmul2d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1);
+template<typename T> void gpuSAddBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
 
-void gpuSMatmul3d(double * ret, double * data1, double * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1);
+template<typename T> void gpuSSubtractBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
 
-void gpuSTranspose2d(double * ret, double * data1, size_t retDims0, size_t retDims1);
+template<typename T> void gpuSElementwiseMultBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
 
-void gpuSTranspose3d(double * ret, double * data1, size_t retDims0, size_t retDims1, size_t retDims2);
+template<typename T> void gpuSElementwiseDivisionBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
 
-void gpuSReduceSum(double * ret, double * data1, size_t dataLen);
+template<typename T> void gpuSSumToShape(T * ret, T * data1, BroadcastShape shape, size_t retLen);
+
+template<typename T> void gpuSStridedCopy(T * ret, T * data1, BroadcastShape shape);
+
+template<typename T> void gpuSRelu(T * ret, T * data1, size_t dataLen);
+
+template<typename T> void gpuSBinarize(T * ret, T * data1, size_t dataLen);
+
+template<typename T> void gpuSMatmul2d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t data1Dims1, size_t data2Dims1);
+
+template<typename T> void gpuSMatmul3d(T * ret, T * data1, T * data2, size_t retDims0, size_t retDims1, size_t retDims2, size_t data1Dims1, size_t data1Dims2, size_t data2Dims1);
+
+template<typename T> void gpuSTranspose2d(T * ret, T * data1, size_t retDims0, size_t retDims1);
+
+template<typename T> void gpuSTranspose3d(T * ret, T * data1, size_t retDims0, size_t retDims1, size_t retDims2);
+
+template<typename T> void gpuSReduceSum(T * ret, T * data1, size_t dataLen);
+
+template<typename T> void gpuSReduce(T * ret, T * data1, size_t outer, size_t reduceLen, size_t inner, reductionOperation op, T scale);
+
+template<typename T> void gpuSEqualBroadcast(T * ret, T * data1, T * data2, BroadcastShape shape);
+
+template<typename T> void gpuSSoftmax(T * ret, T * data1, size_t rows, size_t cols);
+
+template<typename T> void gpuSSoftmaxBackward(T * ret, T * grad, T * out, size_t rows, size_t cols);
+
+template<typename T> void gpuSArgmax(T * ret, T * data1, size_t rows, size_t cols);
+
+template<typename T> void gpuSCrossEntropy(T * ret, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels);
+
+template<typename T> void gpuSCrossEntropyBackward(T * ret, T * grad, T * logits, T * labels, size_t rows, size_t cols, bool indexLabels);
+
+template<typename T> void gpuSFillRandom(T * ret, T mean, T stddev, uint64_t key, size_t dataLen);
+
+template<typename T> void gpuSDropout(T * ret, T * data1, double p, uint64_t key, size_t dataLen);
+
+template<typename T> void gpuSSgdStep(T * params, T * grads, T learningRate, size_t dataLen);
+
+template<typename T> void gpuSMomentumStep(T * params, T * grads, T * velocity, T learningRate, T momentum, size_t dataLen);
+
+template<typename T> void gpuSAdamStep(T * params, T * grads, T * m, T * v, T learningRate, T beta1, T beta2, T epsilon, size_t step, size_t dataLen);
+
+template<typename T, typename U> void gpuSConvert(T * ret, U * data1, size_t dataLen);
 
 #endif
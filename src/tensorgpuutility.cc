@@ -11,36 +11,27 @@
 #include "device_launch_parameters.h"
 
 #include "tensorgpuutility.h"
+#include "tensormemorypool.h"
 
 namespace TensorGPUUtility{
-    std::shared_ptr<double> toGPU(double * data, size_t dataLen){
-        double * d_data;
-        cudaMalloc(&d_data, sizeof(double) * dataLen);
-        cudaMemcpy(d_data, data, sizeof(double) * dataLen, cudaMemcpyHostToDevice);
-        return std::shared_ptr<double>(d_data, cudaFree);
+    std::shared_ptr<void> toGPU(void * data, size_t numBytes){
+        auto d_data = allocate(numBytes);
+        cudaMemcpy(d_data.get(), data, numBytes, cudaMemcpyHostToDevice);
+        return d_data;
     }
 
-    void toCPU(double * data, double * d_data, size_t dataLen){
-        cudaMemcpy(data, d_data, sizeof(double) * dataLen, cudaMemcpyDeviceToHost);
+    void toCPU(void * data, void * d_data, size_t numBytes){
+        cudaMemcpy(data, d_data, numBytes, cudaMemcpyDeviceToHost);
     }
 
-    std::shared_ptr<double> convert(std::shared_ptr<double> p, bool toGPU, size_t dataLen){
-        if(toGPU){
-            double * d_data;
-            cudaMalloc(&d_data, sizeof(double) * dataLen);
-            cudaMemcpy(d_data, p.get(), sizeof(double) * dataLen, cudaMemcpyHostToDevice);
-            return std::shared_ptr<double>(d_data, cudaFree);
-        }
-        else{
-            double * data = new double[dataLen];
-            cudaMemcpy(data, p.get(), sizeof(double) * dataLen, cudaMemcpyDeviceToHost);
-            return std::shared_ptr<double>(data, std::default_delete<double[]>());
-        }
+    std::shared_ptr<void> convert(std::shared_ptr<void> p, bool toGPU, size_t numBytes){
+        if(toGPU) return TensorGPUUtility::toGPU(p.get(), numBytes);
+        auto data = TensorMemoryPool::allocate(numBytes);
+        cudaMemcpy(data.get(), p.get(), numBytes, cudaMemcpyDeviceToHost);
+        return data;
     }
 
-    std::shared_ptr<double> allocate(size_t dataLen){
-        double * tmp;
-        cudaMalloc(&tmp, sizeof(double) * dataLen);
-        return std::shared_ptr<double>(tmp, cudaFree);
+    std::shared_ptr<void> allocate(size_t numBytes){
+        return TensorMemoryPool::allocate(numBytes, true);
     }
 }
@@ -11,14 +11,15 @@
 
 #include <memory>
 
+// Buffers are untyped and sized in bytes, so every element type shares these functions
 namespace TensorGPUUtility{
-    std::shared_ptr<double> toGPU(double * data, size_t dataLen);
+    std::shared_ptr<void> toGPU(void * data, size_t numBytes);
 
-    void toCPU(double * data, double * d_data, size_t dataLen);
+    void toCPU(void * data, void * d_data, size_t numBytes);
 
-    std::shared_ptr<double> convert(std::shared_ptr<double> p, bool toGPU, size_t dataLen);
+    std::shared_ptr<void> convert(std::shared_ptr<void> p, bool toGPU, size_t numBytes);
 
-    std::shared_ptr<double> allocate(size_t dataLen);
+    std::shared_ptr<void> allocate(size_t numBytes);
 }
 
 #endif
@@ -0,0 +1,174 @@
+/**
+ * @file tensormemorypool.cc
+ * @brief Implements the caching allocator that tensor data buffers are taken from.
+ * 
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#include "tensormemorypool.h"
+
+#ifdef CUDA
+    #include "cuda_runtime.h"
+#endif
+
+namespace{
+    std::atomic<size_t> cacheLimit((size_t) 1 << 30);
+
+    thread_local size_t threadBytes = 0;
+
+    size_t sizeClass(size_t numBytes){
+        if(numBytes <= POOLALIGNMENT) return POOLALIGNMENT;
+        size_t power = POOLALIGNMENT;
+        while(power * 2 < numBytes) power *= 2;
+        size_t step = power / 4 < POOLALIGNMENT ? POOLALIGNMENT : power / 4;
+        return (numBytes + step - 1) / step * step;
+    }
+
+    void * cpuAllocate(size_t numBytes){
+        void * p = aligned_alloc(POOLALIGNMENT, numBytes);
+        if(!p) throw std::bad_alloc();
+        return p;
+    }
+
+    void cpuFree(void * p){
+        free(p);
+    }
+
+    #ifdef CUDA
+        void * gpuAllocate(size_t numBytes){
+            void * p;
+            if(cudaMalloc(&p, numBytes) != cudaSuccess) throw std::bad_alloc();
+            return p;
+        }
+
+        void gpuFree(void * p){
+            cudaFree(p);
+        }
+    #endif
+
+    class BufferPool{
+        std::mutex lock;
+        std::unordered_map<size_t, std::vector<void *>> freeBuffers;
+        PoolStats stats;
+        void * (*systemAllocate)(size_t);
+        void (*systemFree)(void *);
+
+        public:
+            BufferPool(void * (*systemAllocate)(size_t), void (*systemFree)(void *))
+                : systemAllocate(systemAllocate), systemFree(systemFree) {}
+
+            std::shared_ptr<void> allocate(size_t numBytes){
+                size_t size = sizeClass(numBytes);
+                threadBytes += size;
+                void * p = nullptr;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    auto& buffers = freeBuffers[size];
+                    if(!buffers.empty()){
+                        p = buffers.back();
+                        buffers.pop_back();
+                        stats.bytesCached -= size;
+                        ++stats.hits;
+                    }
+                    else ++stats.misses;
+                    stats.bytesInUse += size;
+                    if(stats.bytesInUse > stats.highWaterMark) stats.highWaterMark = stats.bytesInUse;
+                }
+
+                if(!p){
+                    try{
+                        p = systemAllocate(size);
+                    }
+                    catch(std::bad_alloc&){
+                        // Cached buffers of other sizes may be enough to satisfy the request
+                        release();
+                        p = systemAllocate(size);
+                    }
+                }
+                return std::shared_ptr<void>(p, [this, size](void * q) {recycle(q, size);});
+            }
+
+            void recycle(void * p, size_t size){
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    stats.bytesInUse -= size;
+                    if(stats.bytesCached + size <= cacheLimit){
+                        freeBuffers[size].push_back(p);
+                        stats.bytesCached += size;
+                        return;
+                    }
+                }
+                systemFree(p);
+            }
+
+            void release(){
+                std::lock_guard<std::mutex> guard(lock);
+                for(auto& buffers : freeBuffers){
+                    for(void * p : buffers.second) systemFree(p);
+                    buffers.second.clear();
+                }
+                stats.bytesCached = 0;
+            }
+
+            PoolStats getStats(){
+                std::lock_guard<std::mutex> guard(lock);
+                return stats;
+            }
+
+            void resetStats(){
+                std::lock_guard<std::mutex> guard(lock);
+                stats.hits = stats.misses = 0;
+                stats.highWaterMark = stats.bytesInUse;
+            }
+    };
+
+    // Never destroyed, since tensors in static storage may free their buffers after main returns
+    BufferPool& pool(bool onGPU){
+        #ifdef CUDA
+            static BufferPool * gpuPool = new BufferPool(gpuAllocate, gpuFree);
+            if(onGPU) return *gpuPool;
+        #else
+            (void) onGPU;
+        #endif
+        static BufferPool * cpuPool = new BufferPool(cpuAllocate, cpuFree);
+        return *cpuPool;
+    }
+}
+
+namespace TensorMemoryPool{
+    std::shared_ptr<void> allocate(size_t numBytes, bool onGPU){
+        return pool(onGPU).allocate(numBytes);
+    }
+
+    PoolStats getStats(bool onGPU){
+        return pool(onGPU).getStats();
+    }
+
+    void resetStats(bool onGPU){
+        pool(onGPU).resetStats();
+    }
+
+    size_t threadBytesAllocated(){
+        return threadBytes;
+    }
+
+    void setCacheLimit(size_t numBytes){
+        cacheLimit = numBytes;
+    }
+
+    void emptyCache(){
+        pool(false).release();
+        #ifdef CUDA
+            pool(true).release();
+        #endif
+    }
+}
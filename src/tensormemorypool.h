@@ -0,0 +1,53 @@
+/**
+ * @file tensormemorypool.h
+ * @brief Defines the caching allocator that tensor data buffers are taken from.
+ * 
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef TENSORMEMORYPOOLH
+#define TENSORMEMORYPOOLH
+
+#include <cstddef>
+#include <memory>
+
+// Alignment of every CPU buffer, one cache line
+#define POOLALIGNMENT 64
+
+/**
+ * Counters of one device's pool. A hit is an allocation served from a cached buffer and a miss
+ * one that went to the system allocator. Sizes are in bytes after rounding to a size class.
+ */
+struct PoolStats{
+    size_t hits = 0, misses = 0;
+    size_t bytesInUse = 0, bytesCached = 0;
+    size_t highWaterMark = 0;
+};
+
+/**
+ * Freed buffers are kept in lists by size class and handed out again to later allocations of
+ * the same class, so a training loop that allocates the same shapes every step stops calling
+ * the system allocator (or cudaMalloc) after its first step. Size classes are multiples of
+ * POOLALIGNMENT with four classes per power of two, so at most a quarter of a buffer is wasted.
+ */
+namespace TensorMemoryPool{
+    // The buffer returns to the pool when the last shared_ptr to it is dropped
+    std::shared_ptr<void> allocate(size_t numBytes, bool onGPU = false);
+
+    PoolStats getStats(bool onGPU = false);
+
+    // Zeroes the hit and miss counters and resets the high-water mark to the bytes in use
+    void resetStats(bool onGPU = false);
+
+    // Bytes the calling thread has allocated from either pool since it started, used by the profiler
+    size_t threadBytesAllocated();
+
+    // Cached bytes above the limit are returned to the system as buffers are freed
+    void setCacheLimit(size_t numBytes);
+
+    // Returns every cached buffer of both devices to the system
+    void emptyCache();
+}
+
+#endif
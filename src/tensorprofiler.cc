@@ -0,0 +1,162 @@
+/**
+ * @file tensorprofiler.cc
+ * @brief Implements the profiler that records the steps of evaluation and backward passes.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tensormemorypool.h"
+#include "tensorprofiler.h"
+
+namespace{
+    typedef std::chrono::steady_clock Clock;
+
+    struct Profile{
+        std::mutex lock;
+        std::vector<ProfileEvent> events;
+        Clock::time_point epoch = Clock::now();
+    };
+
+    Profile& profile(){
+        static Profile * p = new Profile();
+        return *p;
+    }
+
+    double microseconds(Clock::time_point t){
+        return std::chrono::duration<double, std::micro>(t - profile().epoch).count();
+    }
+
+    // Threads are numbered in the order they first record an event
+    size_t threadNumber(){
+        static std::atomic<size_t> numThreads(0);
+        thread_local size_t number = numThreads++;
+        return number;
+    }
+
+    std::string shapeString(const std::vector<size_t>& dims){
+        std::string ret = "[";
+        for(size_t d = 0; d < dims.size(); ++d) ret += (d ? "," : "") + std::to_string(dims[d]);
+        return ret + "]";
+    }
+
+    std::string jsonString(const std::string& s){
+        std::string ret = "\"";
+        for(char c : s){
+            if(c == '"' || c == '\\') ret += '\\';
+            ret += c;
+        }
+        return ret + "\"";
+    }
+
+    std::string number(double value, int precision){
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.*f", precision, value);
+        return buffer;
+    }
+}
+
+namespace TensorProfiler{
+    std::atomic<bool> enabled(false);
+
+    void enable(){
+        profile();
+        enabled = true;
+    }
+
+    void disable(){
+        enabled = false;
+    }
+
+    void clear(){
+        Profile& p = profile();
+        std::lock_guard<std::mutex> guard(p.lock);
+        p.events.clear();
+        p.epoch = Clock::now();
+    }
+
+    std::vector<ProfileEvent> getEvents(){
+        Profile& p = profile();
+        std::lock_guard<std::mutex> guard(p.lock);
+        return p.events;
+    }
+
+    std::string summary(){
+        struct Total{
+            size_t calls = 0, bytes = 0;
+            double duration = 0;
+        };
+        std::map<std::pair<std::string, std::string>, Total> totals;
+        double allDuration = 0;
+        for(auto& event : getEvents()){
+            Total& t = totals[{event.category, event.name}];
+            ++t.calls;
+            t.bytes += event.bytes;
+            t.duration += event.duration;
+            allDuration += event.duration;
+        }
+
+        std::vector<std::pair<std::pair<std::string, std::string>, Total>> rows(totals.begin(), totals.end());
+        std::stable_sort(rows.begin(), rows.end(), [](const decltype(rows)::value_type& a, const decltype(rows)::value_type& b){
+            return a.second.duration > b.second.duration;
+        });
+
+        char line[256];
+        snprintf(line, sizeof(line), "%-9s %-24s %8s %12s %12s %7s %14s\n", "category", "operation", "calls", "total ms", "mean us", "time %", "bytes");
+        std::string ret = line;
+        for(auto& row : rows){
+            const Total& t = row.second;
+            snprintf(line, sizeof(line), "%-9s %-24s %8zu %12.3f %12.2f %7.1f %14zu\n", row.first.first.c_str(), row.first.second.c_str(),
+                t.calls, t.duration / 1000, t.duration / t.calls, allDuration > 0 ? 100 * t.duration / allDuration : 0.0, t.bytes);
+            ret += line;
+        }
+        return ret;
+    }
+
+    void exportChromeTrace(const std::string& path){
+        std::vector<ProfileEvent> events = getEvents();
+        std::ofstream file(path);
+        if(!file) throw std::runtime_error("Could not open " + path);
+
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for(size_t i = 0; i < events.size(); ++i){
+            const ProfileEvent& e = events[i];
+            std::string shapes;
+            for(size_t s = 0; s < e.shapes.size(); ++s) shapes += (s ? " " : "") + shapeString(e.shapes[s]);
+            file << (i ? ",\n" : "\n") << "{\"name\":" << jsonString(e.name) << ",\"cat\":" << jsonString(e.category)
+                << ",\"ph\":\"X\",\"ts\":" << number(e.start, 3) << ",\"dur\":" << number(e.duration, 3)
+                << ",\"pid\":0,\"tid\":" << e.thread << ",\"args\":{\"shapes\":" << jsonString(shapes) << ",\"bytes\":" << e.bytes << "}}";
+        }
+        file << "\n]}\n";
+        if(!file) throw std::runtime_error("Could not write " + path);
+    }
+
+    Scope::Scope(std::string category, std::string name, std::vector<std::vector<size_t>> shapes){
+        event.category = category;
+        event.name = name;
+        event.shapes = shapes;
+        event.thread = threadNumber();
+        startBytes = TensorMemoryPool::threadBytesAllocated();
+        event.start = microseconds(Clock::now());
+    }
+
+    Scope::~Scope(){
+        event.duration = microseconds(Clock::now()) - event.start;
+        event.bytes = TensorMemoryPool::threadBytesAllocated() - startBytes;
+        Profile& p = profile();
+        std::lock_guard<std::mutex> guard(p.lock);
+        p.events.push_back(std::move(event));
+    }
+}
@@ -0,0 +1,78 @@
+/**
+ * @file tensorprofiler.h
+ * @brief Defines the profiler that records the steps of evaluation and backward passes.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef TENSORPROFILERH
+#define TENSORPROFILERH
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * One recorded step, named after the operation of its node. The category is "eval" for a step of
+ * an evaluation plan, "gradfn" for the backward function of a node in Tensor::backward, which
+ * builds the lazy gradient graph, and "backward" for a step of the plan that then evaluates the
+ * gradients. A fused elementwise chain is named "FUSED" and the operation of its last node.
+ * Shapes are the output's followed by the inputs' of plan steps, and the node's of backward
+ * functions. Bytes are those the step's thread took from the memory pool while it ran.
+ */
+struct ProfileEvent{
+    std::string category, name;
+    std::vector<std::vector<size_t>> shapes;
+    double start, duration; // microseconds since profiling was first enabled or last cleared
+    size_t bytes;
+    size_t thread;
+};
+
+/**
+ * While enabled, every step of TensorContents::evaluate and every node of Tensor::backward is
+ * recorded with its wall time, shapes, allocated bytes and the thread it ran on. The recorded
+ * events can be summed by operation into a table or written as a Chrome trace_event file, which
+ * chrome://tracing and Perfetto open. While disabled, which is the default, a step only loads one
+ * flag before it runs.
+ */
+namespace TensorProfiler{
+    // Read before every step, use isEnabled
+    extern std::atomic<bool> enabled;
+
+    inline bool isEnabled(){
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // Events recorded earlier are kept, call clear to start over
+    void enable();
+
+    void disable();
+
+    // Drops every recorded event and restarts the clock events are timed from, not while tensors are evaluated
+    void clear();
+
+    std::vector<ProfileEvent> getEvents();
+
+    // Calls, total and mean time, share of the recorded time and allocated bytes of each category and operation, slowest first
+    std::string summary();
+
+    // Writes the events as complete ("X") events of the Chrome trace_event format
+    void exportChromeTrace(const std::string& path);
+
+    /**
+     * Records the time from its construction to its destruction as one event, also when that is
+     * reached by an exception. Only constructed while profiling is enabled.
+     */
+    class Scope{
+        ProfileEvent event;
+        size_t startBytes;
+
+        public:
+            Scope(std::string category, std::string name, std::vector<std::vector<size_t>> shapes);
+            ~Scope();
+    };
+}
+
+#endif
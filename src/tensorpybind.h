@@ -13,26 +13,139 @@
 
 #include "tensor.h"
 #include "tensor.cc"
+#include "optimizer.h"
+#include "optimizer.cc"
+#include "checkpoint.h"
+#include "checkpoint.cc"
+#include "dataset.h"
+#include "dataset.cc"
+#include "dataloader.h"
+#include "dataloader.cc"
+#include "layers.h"
+#include "layers.cc"
+#include "tensorautotune.h"
 #include "tensorcpufunctions.h"
+#include "tensormemorypool.h"
+#include "tensorprofiler.h"
 
 namespace py = pybind11;
 
 PYBIND11_MODULE(tensor, m){
+    py::enum_<dtypeOptions>(m, "dtype")
+        .value("FLOAT64", FLOAT64)
+        .value("FLOAT32", FLOAT32)
+        .export_values();
+
+    py::class_<PoolStats>(m, "PoolStats")
+        .def_readonly("hits", &PoolStats::hits)
+        .def_readonly("misses", &PoolStats::misses)
+        .def_readonly("bytesInUse", &PoolStats::bytesInUse)
+        .def_readonly("bytesCached", &PoolStats::bytesCached)
+        .def_readonly("highWaterMark", &PoolStats::highWaterMark);
+
+    m.def("memoryStats", &TensorMemoryPool::getStats, py::arg("onGPU") = false);
+    m.def("resetMemoryStats", &TensorMemoryPool::resetStats, py::arg("onGPU") = false);
+    m.def("emptyCache", &TensorMemoryPool::emptyCache);
+    m.def("enableAutotune", &TensorAutotune::enable, py::arg("cachePath") = "");
+    m.def("disableAutotune", &TensorAutotune::disable);
+
+    py::class_<ProfileEvent>(m, "ProfileEvent")
+        .def_readonly("category", &ProfileEvent::category)
+        .def_readonly("name", &ProfileEvent::name)
+        .def_readonly("shapes", &ProfileEvent::shapes)
+        .def_readonly("start", &ProfileEvent::start)
+        .def_readonly("duration", &ProfileEvent::duration)
+        .def_readonly("bytes", &ProfileEvent::bytes)
+        .def_readonly("thread", &ProfileEvent::thread);
+
+    m.def("enableProfiler", &TensorProfiler::enable);
+    m.def("disableProfiler", &TensorProfiler::disable);
+    m.def("clearProfile", &TensorProfiler::clear);
+    m.def("profileEvents", &TensorProfiler::getEvents);
+    m.def("profileSummary", &TensorProfiler::summary);
+    m.def("exportChromeTrace", &TensorProfiler::exportChromeTrace);
+
+    py::class_<Optimizer>(m, "Optimizer")
+        .def_static("sgd", &Optimizer::sgd)
+        .def_static("momentum", &Optimizer::momentum, py::arg("parameters"), py::arg("learningRate"), py::arg("momentum") = 0.9)
+        .def_static("adam", &Optimizer::adam, py::arg("parameters"), py::arg("learningRate") = 0.001,
+            py::arg("beta1") = 0.9, py::arg("beta2") = 0.999, py::arg("epsilon") = 1e-8)
+        .def("step", &Optimizer::step)
+        .def("zeroGrad", &Optimizer::zeroGrad)
+        .def("setLearningRate", &Optimizer::setLearningRate)
+        .def("getLearningRate", &Optimizer::getLearningRate);
+
+    // Errors of a background save are not returned to Python, waitForSaves waits for the file
+    py::class_<Checkpoint>(m, "Checkpoint")
+        .def_static("save", &Checkpoint::save)
+        .def_static("saveAsync", [](std::string path, std::vector<Tensor> tensors){Checkpoint::saveAsync(path, tensors);})
+        .def_static("waitForSaves", &Checkpoint::waitForSaves)
+        .def_static("load", &Checkpoint::load, py::arg("path"), py::arg("saveGradient") = false, py::arg("device") = CPU);
+
+    py::class_<Dataset>(m, "Dataset")
+        .def(py::init<Tensor, std::vector<int>>())
+        .def_static("readLibsvm", &Dataset::readLibsvm, py::arg("path"), py::arg("numFeatures"), py::arg("dtype") = FLOAT64)
+        .def("getFeatures", &Dataset::getFeatures)
+        .def("getLabels", &Dataset::getLabels)
+        .def("size", &Dataset::size);
+
+    py::class_<DataLoader>(m, "DataLoader")
+        .def_static("fromDataset", &DataLoader::fromDataset, py::arg("dataset"), py::arg("batchSize"), py::arg("shuffleBuffer") = 0,
+            py::arg("dropLast") = false, py::arg("numBuffers") = DATALOADERBUFFERS)
+        .def_static("fromLibsvm", &DataLoader::fromLibsvm, py::arg("path"), py::arg("numFeatures"), py::arg("batchSize"),
+            py::arg("shuffleBuffer") = 0, py::arg("dropLast") = false, py::arg("dtype") = FLOAT64, py::arg("numBuffers") = DATALOADERBUFFERS)
+        .def("next", &DataLoader::next, py::call_guard<py::gil_scoped_release>());
+
+    py::enum_<Layers::activationOptions>(m, "activation")
+        .value("NOACTIVATION", Layers::NOACTIVATION)
+        .value("RELUACTIVATION", Layers::RELUACTIVATION)
+        .value("SOFTMAXACTIVATION", Layers::SOFTMAXACTIVATION)
+        .export_values();
+
+    py::class_<Layers::Linear>(m, "Linear")
+        .def(py::init<size_t, size_t, Layers::activationOptions>(), py::arg("inputSize"), py::arg("outputSize"),
+            py::arg("activation") = Layers::NOACTIVATION)
+        .def(py::init<Tensor, Tensor, Layers::activationOptions>(), py::arg("weight"), py::arg("bias"),
+            py::arg("activation") = Layers::NOACTIVATION)
+        .def("forward", &Layers::Linear::forward)
+        .def("__call__", &Layers::Linear::forward)
+        .def("parameters", &Layers::Linear::parameters)
+        .def("getWeight", &Layers::Linear::getWeight)
+        .def("getBias", &Layers::Linear::getBias)
+        .def("setQuantized", &Layers::Linear::setQuantized);
+
+    py::class_<Layers::MultiLayer>(m, "MultiLayer")
+        .def(py::init<size_t, size_t, std::vector<size_t>, Layers::activationOptions>(), py::arg("inputSize"), py::arg("outputSize"),
+            py::arg("intermediateSizes"), py::arg("outputActivation") = Layers::SOFTMAXACTIVATION)
+        .def("forward", &Layers::MultiLayer::forward)
+        .def("__call__", &Layers::MultiLayer::forward)
+        .def("parameters", &Layers::MultiLayer::parameters)
+        .def("setQuantized", &Layers::MultiLayer::setQuantized);
+
     py::class_<Tensor>(m, "Tensor")
         .def(py::init<vDims, std::vector<double>, bool>())
         .def("print", &Tensor::print)
         .def("getData", &Tensor::getData)
         .def("getDims", &Tensor::getDims)
+        .def("getDtype", &Tensor::getDtype)
 
         .def("backward", &Tensor::backward)
         .def("getGradient", &Tensor::getGradient)
+        .def("getVersion", &Tensor::getVersion)
 
         .def_static("ones", &Tensor::ones)
         .def_static("zeroes", &Tensor::zeroes)
         .def_static("fill", &Tensor::fill)
+        .def_static("fillRandom", &Tensor::fillRandom)
+        .def_static("setSeed", &Tensor::setSeed)
+        .def_static("setInterOpNumThreads", &Tensor::setInterOpNumThreads)
 
+        .def("cast", &Tensor::cast)
         .def("reshape", &Tensor::reshape)
         .def("transpose", &Tensor::transpose)
+        .def("permute", &Tensor::permute)
+        .def("slice", &Tensor::slice)
+        .def("narrow", &Tensor::narrow)
 
         .def("add", py::overload_cast<Tensor, bool>(&Tensor::add))
         .def("add", py::overload_cast<double, bool>(&Tensor::add))
@@ -64,13 +177,19 @@ PYBIND11_MODULE(tensor, m){
         .def("__pow__", [](Tensor a, double b) {return a.pow(b);}, py::is_operator())
         .def("relu", &Tensor::relu)
         .def("binarize", &Tensor::binarize)
+        .def("dropout", &Tensor::dropout)
         .def("reciprocal", &Tensor::reciprocal)
 
         .def("matmul", &Tensor::matmul)
         .def("__matmul__", [](Tensor a, Tensor b) {return a.matmul(b);}, py::is_operator())
 
         .def("reduceSum", &Tensor::reduceSum)
+        .def("sum", &Tensor::sum)
+        .def("mean", &Tensor::mean)
+        .def("max", &Tensor::max)
         .def("softmax", &Tensor::softmax)
+        .def("argmax", &Tensor::argmax)
+        .def("crossEntropy", &Tensor::crossEntropy)
         ;
 }
 
@@ -0,0 +1,307 @@
+/**
+ * @file tensorsimd.h
+ * @brief Vector types of each supported instruction set and the elementwise and reduction kernels
+ * built on them. Only used by tensorcpufunctions.cc, which selects a set at startup.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef TENSORSIMDH
+#define TENSORSIMDH
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "tensorcpufunctions.h"
+
+#if defined(__x86_64__)
+    #include <immintrin.h>
+    #define SIMDX86
+#endif
+
+enum simdOperation {SIMDCOPY, SIMDFILL, SIMDNEG, SIMDADD, SIMDADDSCALAR, SIMDSUBTRACT, SIMDSUBTRACTSCALAR,
+    SIMDSCALARSUBTRACT, SIMDMULT, SIMDMULTSCALAR, SIMDDIVISION, SIMDDIVISIONSCALAR, SIMDSCALARDIVISION,
+    SIMDMAX, SIMDRELU, SIMDBINARIZE, SIMDSQUARE, SIMDSQRT};
+
+// Whether the operation reads a second array, the others read at most the scalar n
+constexpr bool simdIsBinary(simdOperation op){
+    return op == SIMDADD || op == SIMDSUBTRACT || op == SIMDMULT || op == SIMDDIVISION || op == SIMDMAX;
+}
+
+// The operation on one element, used for elements before the first aligned vector and after the last one
+template<simdOperation OP, typename T>
+inline T simdScalarApply(T a, T b, T n){
+    switch(OP){
+        case SIMDCOPY: return a;
+        case SIMDFILL: return n;
+        case SIMDNEG: return -a;
+        case SIMDADD: return a + b;
+        case SIMDADDSCALAR: return a + n;
+        case SIMDSUBTRACT: return a - b;
+        case SIMDSUBTRACTSCALAR: return a - n;
+        case SIMDSCALARSUBTRACT: return n - a;
+        case SIMDMULT: return a * b;
+        case SIMDMULTSCALAR: return a * n;
+        case SIMDDIVISION: return a / b;
+        case SIMDDIVISIONSCALAR: return a / n;
+        case SIMDSCALARDIVISION: return n / a;
+        case SIMDMAX: return a > b ? a : b;
+        case SIMDRELU: return a > 0 ? a : 0;
+        case SIMDBINARIZE: return a > 0 ? 1 : 0;
+        case SIMDSQUARE: return a * a;
+        case SIMDSQRT: return std::sqrt(a);
+    }
+    return a;
+}
+
+/*
+ * Each instruction set defines Vec<T> for float and double in its own namespace: the vector type
+ * V holding width elements, and operations on it. max(a, b) is a > b ? a : b and positive(a, b)
+ * is a > 0 ? b : 0 in every lane, matching the scalar kernels for NaN inputs. fma(a, b, c) is
+ * a * b + c, fused where the set has the instruction. The kernels in tensorsimdkernels.h are then
+ * compiled once per namespace with SIMDTARGET enabling the set.
+ *
+ * Vec<int16_t> is used by the int8 GEMM. Its width is in int32 lanes, each loaded from a pair of
+ * int16, and madd(a, b, c) multiplies the pairs of a and b and adds both products to the lanes of c.
+ */
+
+// The pair of int16 at p as one int32, as the vector loads read it
+inline int32_t simdLoadPair(const int16_t * p){
+    int32_t pair;
+    std::memcpy(&pair, p, sizeof(pair));
+    return pair;
+}
+
+namespace SimdScalar{
+    template<typename T>
+    struct Vec{
+        typedef T V;
+        static const size_t width = 1;
+        static V zero() {return 0;}
+        static V set1(T n) {return n;}
+        static V loadu(const T * p) {return *p;}
+        static void store(T * p, V a) {*p = a;}
+        static void storeu(T * p, V a) {*p = a;}
+        static V add(V a, V b) {return a + b;}
+        static V sub(V a, V b) {return a - b;}
+        static V mul(V a, V b) {return a * b;}
+        static V div(V a, V b) {return a / b;}
+        static V max(V a, V b) {return a > b ? a : b;}
+        static V neg(V a) {return -a;}
+        static V sqrt(V a) {return std::sqrt(a);}
+        static V positive(V a, V b) {return a > 0 ? b : 0;}
+        static V fma(V a, V b, V c) {return a * b + c;}
+    };
+
+    template<>
+    struct Vec<int16_t>{
+        typedef int32_t V;
+        static const size_t width = 1;
+        static V zero() {return 0;}
+        static V set1pair(const int16_t * p) {return simdLoadPair(p);}
+        static V loadu(const int16_t * p) {return simdLoadPair(p);}
+        static void storeu(int32_t * p, V a) {*p = a;}
+        static V madd(V a, V b, V c){
+            int16_t x[2], y[2];
+            std::memcpy(x, &a, sizeof(x));
+            std::memcpy(y, &b, sizeof(y));
+            return x[0] * y[0] + x[1] * y[1] + c;
+        }
+    };
+
+    #define SIMDTARGET
+    #include "tensorsimdkernels.h"
+    #undef SIMDTARGET
+}
+
+#ifdef SIMDX86
+
+namespace SimdSse{
+    #define SIMDTARGET __attribute__((target("sse2")))
+
+    template<typename T> struct Vec;
+
+    template<>
+    struct Vec<float>{
+        typedef __m128 V;
+        static const size_t width = 4;
+        SIMDTARGET static V zero() {return _mm_setzero_ps();}
+        SIMDTARGET static V set1(float n) {return _mm_set1_ps(n);}
+        SIMDTARGET static V loadu(const float * p) {return _mm_loadu_ps(p);}
+        SIMDTARGET static void store(float * p, V a) {_mm_store_ps(p, a);}
+        SIMDTARGET static void storeu(float * p, V a) {_mm_storeu_ps(p, a);}
+        SIMDTARGET static V add(V a, V b) {return _mm_add_ps(a, b);}
+        SIMDTARGET static V sub(V a, V b) {return _mm_sub_ps(a, b);}
+        SIMDTARGET static V mul(V a, V b) {return _mm_mul_ps(a, b);}
+        SIMDTARGET static V div(V a, V b) {return _mm_div_ps(a, b);}
+        SIMDTARGET static V max(V a, V b) {return _mm_max_ps(a, b);}
+        SIMDTARGET static V neg(V a) {return _mm_xor_ps(a, _mm_set1_ps(-0.0f));}
+        SIMDTARGET static V sqrt(V a) {return _mm_sqrt_ps(a);}
+        SIMDTARGET static V positive(V a, V b) {return _mm_and_ps(_mm_cmpgt_ps(a, _mm_setzero_ps()), b);}
+        SIMDTARGET static V fma(V a, V b, V c) {return _mm_add_ps(_mm_mul_ps(a, b), c);}
+    };
+
+    template<>
+    struct Vec<double>{
+        typedef __m128d V;
+        static const size_t width = 2;
+        SIMDTARGET static V zero() {return _mm_setzero_pd();}
+        SIMDTARGET static V set1(double n) {return _mm_set1_pd(n);}
+        SIMDTARGET static V loadu(const double * p) {return _mm_loadu_pd(p);}
+        SIMDTARGET static void store(double * p, V a) {_mm_store_pd(p, a);}
+        SIMDTARGET static void storeu(double * p, V a) {_mm_storeu_pd(p, a);}
+        SIMDTARGET static V add(V a, V b) {return _mm_add_pd(a, b);}
+        SIMDTARGET static V sub(V a, V b) {return _mm_sub_pd(a, b);}
+        SIMDTARGET static V mul(V a, V b) {return _mm_mul_pd(a, b);}
+        SIMDTARGET static V div(V a, V b) {return _mm_div_pd(a, b);}
+        SIMDTARGET static V max(V a, V b) {return _mm_max_pd(a, b);}
+        SIMDTARGET static V neg(V a) {return _mm_xor_pd(a, _mm_set1_pd(-0.0));}
+        SIMDTARGET static V sqrt(V a) {return _mm_sqrt_pd(a);}
+        SIMDTARGET static V positive(V a, V b) {return _mm_and_pd(_mm_cmpgt_pd(a, _mm_setzero_pd()), b);}
+        SIMDTARGET static V fma(V a, V b, V c) {return _mm_add_pd(_mm_mul_pd(a, b), c);}
+    };
+
+    template<>
+    struct Vec<int16_t>{
+        typedef __m128i V;
+        static const size_t width = 4;
+        SIMDTARGET static V zero() {return _mm_setzero_si128();}
+        SIMDTARGET static V set1pair(const int16_t * p) {return _mm_set1_epi32(simdLoadPair(p));}
+        SIMDTARGET static V loadu(const int16_t * p) {return _mm_loadu_si128(reinterpret_cast<const V *>(p));}
+        SIMDTARGET static void storeu(int32_t * p, V a) {_mm_storeu_si128(reinterpret_cast<V *>(p), a);}
+        SIMDTARGET static V madd(V a, V b, V c) {return _mm_add_epi32(_mm_madd_epi16(a, b), c);}
+    };
+
+    #include "tensorsimdkernels.h"
+    #undef SIMDTARGET
+}
+
+namespace SimdAvx2{
+    #define SIMDTARGET __attribute__((target("avx2,fma")))
+
+    template<typename T> struct Vec;
+
+    template<>
+    struct Vec<float>{
+        typedef __m256 V;
+        static const size_t width = 8;
+        SIMDTARGET static V zero() {return _mm256_setzero_ps();}
+        SIMDTARGET static V set1(float n) {return _mm256_set1_ps(n);}
+        SIMDTARGET static V loadu(const float * p) {return _mm256_loadu_ps(p);}
+        SIMDTARGET static void store(float * p, V a) {_mm256_store_ps(p, a);}
+        SIMDTARGET static void storeu(float * p, V a) {_mm256_storeu_ps(p, a);}
+        SIMDTARGET static V add(V a, V b) {return _mm256_add_ps(a, b);}
+        SIMDTARGET static V sub(V a, V b) {return _mm256_sub_ps(a, b);}
+        SIMDTARGET static V mul(V a, V b) {return _mm256_mul_ps(a, b);}
+        SIMDTARGET static V div(V a, V b) {return _mm256_div_ps(a, b);}
+        SIMDTARGET static V max(V a, V b) {return _mm256_max_ps(a, b);}
+        SIMDTARGET static V neg(V a) {return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f));}
+        SIMDTARGET static V sqrt(V a) {return _mm256_sqrt_ps(a);}
+        SIMDTARGET static V positive(V a, V b) {return _mm256_and_ps(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_GT_OQ), b);}
+        SIMDTARGET static V fma(V a, V b, V c) {return _mm256_fmadd_ps(a, b, c);}
+    };
+
+    template<>
+    struct Vec<double>{
+        typedef __m256d V;
+        static const size_t width = 4;
+        SIMDTARGET static V zero() {return _mm256_setzero_pd();}
+        SIMDTARGET static V set1(double n) {return _mm256_set1_pd(n);}
+        SIMDTARGET static V loadu(const double * p) {return _mm256_loadu_pd(p);}
+        SIMDTARGET static void store(double * p, V a) {_mm256_store_pd(p, a);}
+        SIMDTARGET static void storeu(double * p, V a) {_mm256_storeu_pd(p, a);}
+        SIMDTARGET static V add(V a, V b) {return _mm256_add_pd(a, b);}
+        SIMDTARGET static V sub(V a, V b) {return _mm256_sub_pd(a, b);}
+        SIMDTARGET static V mul(V a, V b) {return _mm256_mul_pd(a, b);}
+        SIMDTARGET static V div(V a, V b) {return _mm256_div_pd(a, b);}
+        SIMDTARGET static V max(V a, V b) {return _mm256_max_pd(a, b);}
+        SIMDTARGET static V neg(V a) {return _mm256_xor_pd(a, _mm256_set1_pd(-0.0));}
+        SIMDTARGET static V sqrt(V a) {return _mm256_sqrt_pd(a);}
+        SIMDTARGET static V positive(V a, V b) {return _mm256_and_pd(_mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_GT_OQ), b);}
+        SIMDTARGET static V fma(V a, V b, V c) {return _mm256_fmadd_pd(a, b, c);}
+    };
+
+    template<>
+    struct Vec<int16_t>{
+        typedef __m256i V;
+        static const size_t width = 8;
+        SIMDTARGET static V zero() {return _mm256_setzero_si256();}
+        SIMDTARGET static V set1pair(const int16_t * p) {return _mm256_set1_epi32(simdLoadPair(p));}
+        SIMDTARGET static V loadu(const int16_t * p) {return _mm256_loadu_si256(reinterpret_cast<const V *>(p));}
+        SIMDTARGET static void storeu(int32_t * p, V a) {_mm256_storeu_si256(reinterpret_cast<V *>(p), a);}
+        SIMDTARGET static V madd(V a, V b, V c) {return _mm256_add_epi32(_mm256_madd_epi16(a, b), c);}
+    };
+
+    #include "tensorsimdkernels.h"
+    #undef SIMDTARGET
+}
+
+namespace SimdAvx512{
+    #define SIMDTARGET __attribute__((target("avx512f,avx512bw")))
+
+    // max and sqrt use the zero-masking forms with every lane set, the plain forms pass an undefined source that GCC 12 warns about
+
+    template<typename T> struct Vec;
+
+    template<>
+    struct Vec<float>{
+        typedef __m512 V;
+        static const size_t width = 16;
+        SIMDTARGET static V zero() {return _mm512_setzero_ps();}
+        SIMDTARGET static V set1(float n) {return _mm512_set1_ps(n);}
+        SIMDTARGET static V loadu(const float * p) {return _mm512_loadu_ps(p);}
+        SIMDTARGET static void store(float * p, V a) {_mm512_store_ps(p, a);}
+        SIMDTARGET static void storeu(float * p, V a) {_mm512_storeu_ps(p, a);}
+        SIMDTARGET static V add(V a, V b) {return _mm512_add_ps(a, b);}
+        SIMDTARGET static V sub(V a, V b) {return _mm512_sub_ps(a, b);}
+        SIMDTARGET static V mul(V a, V b) {return _mm512_mul_ps(a, b);}
+        SIMDTARGET static V div(V a, V b) {return _mm512_div_ps(a, b);}
+        SIMDTARGET static V max(V a, V b) {return _mm512_maskz_max_ps(0xFFFF, a, b);}
+        SIMDTARGET static V neg(V a) {return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(INT32_MIN)));}
+        SIMDTARGET static V sqrt(V a) {return _mm512_maskz_sqrt_ps(0xFFFF, a);}
+        SIMDTARGET static V positive(V a, V b) {return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(a, _mm512_setzero_ps(), _CMP_GT_OQ), b);}
+        SIMDTARGET static V fma(V a, V b, V c) {return _mm512_fmadd_ps(a, b, c);}
+    };
+
+    template<>
+    struct Vec<double>{
+        typedef __m512d V;
+        static const size_t width = 8;
+        SIMDTARGET static V zero() {return _mm512_setzero_pd();}
+        SIMDTARGET static V set1(double n) {return _mm512_set1_pd(n);}
+        SIMDTARGET static V loadu(const double * p) {return _mm512_loadu_pd(p);}
+        SIMDTARGET static void store(double * p, V a) {_mm512_store_pd(p, a);}
+        SIMDTARGET static void storeu(double * p, V a) {_mm512_storeu_pd(p, a);}
+        SIMDTARGET static V add(V a, V b) {return _mm512_add_pd(a, b);}
+        SIMDTARGET static V sub(V a, V b) {return _mm512_sub_pd(a, b);}
+        SIMDTARGET static V mul(V a, V b) {return _mm512_mul_pd(a, b);}
+        SIMDTARGET static V div(V a, V b) {return _mm512_div_pd(a, b);}
+        SIMDTARGET static V max(V a, V b) {return _mm512_maskz_max_pd(0xFF, a, b);}
+        SIMDTARGET static V neg(V a) {return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(INT64_MIN)));}
+        SIMDTARGET static V sqrt(V a) {return _mm512_maskz_sqrt_pd(0xFF, a);}
+        SIMDTARGET static V positive(V a, V b) {return _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(a, _mm512_setzero_pd(), _CMP_GT_OQ), b);}
+        SIMDTARGET static V fma(V a, V b, V c) {return _mm512_fmadd_pd(a, b, c);}
+    };
+
+    template<>
+    struct Vec<int16_t>{
+        typedef __m512i V;
+        static const size_t width = 16;
+        SIMDTARGET static V zero() {return _mm512_setzero_si512();}
+        SIMDTARGET static V set1pair(const int16_t * p) {return _mm512_set1_epi32(simdLoadPair(p));}
+        SIMDTARGET static V loadu(const int16_t * p) {return _mm512_loadu_si512(reinterpret_cast<const V *>(p));}
+        SIMDTARGET static void storeu(int32_t * p, V a) {_mm512_storeu_si512(reinterpret_cast<V *>(p), a);}
+        SIMDTARGET static V madd(V a, V b, V c) {return _mm512_add_epi32(_mm512_madd_epi16(a, b), c);}
+    };
+
+    #include "tensorsimdkernels.h"
+    #undef SIMDTARGET
+}
+
+#endif
+
+#endif
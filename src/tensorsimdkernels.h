@@ -0,0 +1,230 @@
+/**
+ * @file tensorsimdkernels.h
+ * @brief Elementwise, reduction and GEMM kernels written once over Vec<T>. Included by tensorsimd.h
+ * inside the namespace of each instruction set, with SIMDTARGET enabling that set, so this file
+ * has no include guard.
+ *
+ * Pointers are not restrict: elementwise nodes may write their output over an input buffer.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+template<simdOperation OP, typename T>
+SIMDTARGET inline typename Vec<T>::V simdApply(typename Vec<T>::V a, typename Vec<T>::V b, typename Vec<T>::V n){
+    typedef Vec<T> S;
+    switch(OP){
+        case SIMDCOPY: return a;
+        case SIMDFILL: return n;
+        case SIMDNEG: return S::neg(a);
+        case SIMDADD: return S::add(a, b);
+        case SIMDADDSCALAR: return S::add(a, n);
+        case SIMDSUBTRACT: return S::sub(a, b);
+        case SIMDSUBTRACTSCALAR: return S::sub(a, n);
+        case SIMDSCALARSUBTRACT: return S::sub(n, a);
+        case SIMDMULT: return S::mul(a, b);
+        case SIMDMULTSCALAR: return S::mul(a, n);
+        case SIMDDIVISION: return S::div(a, b);
+        case SIMDDIVISIONSCALAR: return S::div(a, n);
+        case SIMDSCALARDIVISION: return S::div(n, a);
+        case SIMDMAX: return S::max(a, b);
+        case SIMDRELU: return S::positive(a, a);
+        case SIMDBINARIZE: return S::positive(a, S::set1(1));
+        case SIMDSQUARE: return S::mul(a, a);
+        case SIMDSQRT: return S::sqrt(a);
+    }
+    return a;
+}
+
+/**
+ * ret[i] = OP(a[i], b[i], n) for i in [0, len). Elements are computed one at a time until ret is
+ * aligned to a whole vector, so every vector store is aligned, and the tail that does not fill a
+ * vector is computed the same way. a is not read by SIMDFILL and b only by binary operations.
+ */
+template<simdOperation OP, typename T>
+SIMDTARGET void simdElementwise(T * ret, const T * a, const T * b, T n, size_t len){
+    typedef Vec<T> S;
+    typedef typename S::V V;
+
+    size_t i = 0;
+    for(; i < len && reinterpret_cast<uintptr_t>(ret + i) % (S::width * sizeof(T)) != 0; ++i)
+        ret[i] = simdScalarApply<OP, T>(OP == SIMDFILL ? 0 : a[i], simdIsBinary(OP) ? b[i] : 0, n);
+
+    V vn = S::set1(n);
+    for(; i + S::width <= len; i += S::width){
+        V va = OP == SIMDFILL ? vn : S::loadu(a + i);
+        V vb = simdIsBinary(OP) ? S::loadu(b + i) : va;
+        S::store(ret + i, simdApply<OP, T>(va, vb, vn));
+    }
+
+    for(; i < len; ++i)
+        ret[i] = simdScalarApply<OP, T>(OP == SIMDFILL ? 0 : a[i], simdIsBinary(OP) ? b[i] : 0, n);
+}
+
+// Reduces a row into four independent vector accumulators, which keeps the adds pipelined, then
+// combines them and their lanes
+template<typename T>
+SIMDTARGET T simdReduce(const T * a, size_t len, reductionOperation op){
+    typedef Vec<T> S;
+    typedef typename S::V V;
+
+    bool sum = op == REDUCTIONSUM;
+    T identity = sum ? 0 : -std::numeric_limits<T>::infinity();
+    V acc[4] = {S::set1(identity), S::set1(identity), S::set1(identity), S::set1(identity)};
+
+    size_t i = 0;
+    if(sum){
+        for(; i + 4 * S::width <= len; i += 4 * S::width)
+            for(size_t j = 0; j < 4; ++j) acc[j] = S::add(acc[j], S::loadu(a + i + j * S::width));
+        acc[0] = S::add(S::add(acc[0], acc[1]), S::add(acc[2], acc[3]));
+    }
+    else{
+        for(; i + 4 * S::width <= len; i += 4 * S::width)
+            for(size_t j = 0; j < 4; ++j) acc[j] = S::max(S::loadu(a + i + j * S::width), acc[j]);
+        acc[0] = S::max(S::max(acc[0], acc[1]), S::max(acc[2], acc[3]));
+    }
+
+    T lanes[S::width];
+    S::storeu(lanes, acc[0]);
+    T ret = identity;
+    for(size_t j = 0; j < S::width; ++j) ret = sum ? ret + lanes[j] : (lanes[j] > ret ? lanes[j] : ret);
+    for(; i < len; ++i) ret = sum ? ret + a[i] : (a[i] > ret ? a[i] : ret);
+    return ret;
+}
+
+// Largest magnitude in a row, zero for an empty one, with four accumulators like simdReduce
+template<typename T>
+SIMDTARGET T simdMaxAbs(const T * a, size_t len){
+    typedef Vec<T> S;
+    typedef typename S::V V;
+    V acc[4] = {S::zero(), S::zero(), S::zero(), S::zero()};
+
+    size_t i = 0;
+    for(; i + 4 * S::width <= len; i += 4 * S::width){
+        for(size_t j = 0; j < 4; ++j){
+            V x = S::loadu(a + i + j * S::width);
+            acc[j] = S::max(S::max(x, S::neg(x)), acc[j]);
+        }
+    }
+    acc[0] = S::max(S::max(acc[0], acc[1]), S::max(acc[2], acc[3]));
+
+    T lanes[S::width];
+    S::storeu(lanes, acc[0]);
+    T ret = 0;
+    for(size_t j = 0; j < S::width; ++j) ret = lanes[j] > ret ? lanes[j] : ret;
+    for(; i < len; ++i) ret = std::fabs(a[i]) > ret ? std::fabs(a[i]) : ret;
+    return ret;
+}
+
+// Multiplies GROUP vectors of a row of the packed b by each of the MR broadcast values of the packed a
+template<typename T, size_t MR, size_t GROUP>
+SIMDTARGET inline void simdGemmStep(typename Vec<T>::V (&acc)[MR][GROUP], const T * a, const T * b){
+    typedef Vec<T> S;
+    typename S::V vb[GROUP];
+    for(size_t v = 0; v < GROUP; ++v) vb[v] = S::loadu(b + v * S::width);
+    for(size_t i = 0; i < MR; ++i){
+        typename S::V va = S::set1(a[i]);
+        for(size_t v = 0; v < GROUP; ++v) acc[i][v] = S::fma(va, vb[v], acc[i][v]);
+    }
+}
+
+/**
+ * Computes an MR x NR block of ret from a panel of a packed as MR values per depth step and a panel
+ * of b packed as NR values per depth step. The block's columns are taken GROUP vectors at a time, so
+ * the MR x GROUP accumulators and the vectors of b stay in registers. When that leaves fewer than
+ * eight accumulators, too few to hide the latency of the multiply-adds, even and odd depth steps
+ * are summed into separate accumulators. Edge blocks of fewer than rows x cols are computed whole,
+ * since the panels are padded with zeros, and only their valid part is written.
+ */
+template<typename T, size_t MR, size_t NR>
+SIMDTARGET void simdGemmMicrokernel(T * ret, const T * a, const T * b, size_t kc, size_t ldr, size_t rows, size_t cols, bool accumulate){
+    typedef Vec<T> S;
+    typedef typename S::V V;
+    static_assert(NR % S::width == 0, "GEMM column block must be a multiple of the vector width");
+    const size_t rowVectors = NR / S::width;
+    const size_t GROUP = rowVectors < 2 ? rowVectors : 2;
+    const bool split = MR * GROUP < 8;
+
+    T edge[MR * NR];
+    bool whole = rows == MR && cols == NR;
+    T * out = whole ? ret : edge;
+    size_t ldo = whole ? ldr : NR;
+
+    for(size_t g = 0; g < rowVectors; g += GROUP){
+        V acc[MR][GROUP], acc2[MR][GROUP];
+        for(size_t i = 0; i < MR; ++i)
+            for(size_t v = 0; v < GROUP; ++v) acc[i][v] = acc2[i][v] = S::zero();
+
+        const T * bg = b + g * S::width;
+        size_t p = 0;
+        if(split)
+            for(; p + 2 <= kc; p += 2){
+                simdGemmStep<T, MR, GROUP>(acc, a + p * MR, bg + p * NR);
+                simdGemmStep<T, MR, GROUP>(acc2, a + (p + 1) * MR, bg + (p + 1) * NR);
+            }
+        for(; p < kc; ++p) simdGemmStep<T, MR, GROUP>(acc, a + p * MR, bg + p * NR);
+
+        for(size_t i = 0; i < MR; ++i){
+            for(size_t v = 0; v < GROUP; ++v){
+                V sum = split ? S::add(acc[i][v], acc2[i][v]) : acc[i][v];
+                T * o = out + i * ldo + g * S::width + v * S::width;
+                S::storeu(o, whole && accumulate ? S::add(S::loadu(o), sum) : sum);
+            }
+        }
+    }
+
+    if(whole) return;
+    for(size_t i = 0; i < rows; ++i){
+        T * r = ret + i * ldr;
+        if(accumulate) for(size_t j = 0; j < cols; ++j) r[j] += edge[i * NR + j];
+        else for(size_t j = 0; j < cols; ++j) r[j] = edge[i * NR + j];
+    }
+}
+
+// One pair of depth steps of simdGemmInt8Microkernel, like simdGemmStep
+template<size_t MR, size_t GROUP>
+SIMDTARGET inline void simdGemmInt8Step(typename Vec<int16_t>::V (&acc)[MR][GROUP], const int16_t * a, const int16_t * b){
+    typedef Vec<int16_t> S;
+    typename S::V vb[GROUP];
+    for(size_t v = 0; v < GROUP; ++v) vb[v] = S::loadu(b + 2 * v * S::width);
+    for(size_t i = 0; i < MR; ++i){
+        typename S::V va = S::set1pair(a + 2 * i);
+        for(size_t v = 0; v < GROUP; ++v) acc[i][v] = S::madd(va, vb[v], acc[i][v]);
+    }
+}
+
+/**
+ * The int8 counterpart of simdGemmMicrokernel. a and b are int16 panels packed by pairs of depth
+ * steps, MR or NR pairs per two steps, so each multiply-add sums two steps into the int32
+ * accumulators, and kp is the number of pairs. The int32 block is scaled by rowScales[i] *
+ * colScales[j] into ret.
+ */
+template<typename T, size_t MR, size_t NR>
+SIMDTARGET void simdGemmInt8Microkernel(T * ret, const int16_t * a, const int16_t * b, size_t kp, size_t ldr, size_t rows, size_t cols,
+        const float * rowScales, const float * colScales, bool accumulate){
+    typedef Vec<int16_t> S;
+    typedef typename S::V V;
+    static_assert(NR % S::width == 0, "GEMM column block must be a multiple of the vector width");
+    const size_t rowVectors = NR / S::width;
+    const size_t GROUP = rowVectors < 2 ? rowVectors : 2;
+
+    int32_t block[MR * NR];
+    for(size_t g = 0; g < rowVectors; g += GROUP){
+        V acc[MR][GROUP];
+        for(size_t i = 0; i < MR; ++i)
+            for(size_t v = 0; v < GROUP; ++v) acc[i][v] = S::zero();
+
+        const int16_t * bg = b + 2 * g * S::width;
+        for(size_t q = 0; q < kp; ++q) simdGemmInt8Step<MR, GROUP>(acc, a + 2 * q * MR, bg + 2 * q * NR);
+
+        for(size_t i = 0; i < MR; ++i)
+            for(size_t v = 0; v < GROUP; ++v) S::storeu(block + i * NR + (g + v) * S::width, acc[i][v]);
+    }
+
+    for(size_t i = 0; i < rows; ++i){
+        T * r = ret + i * ldr;
+        float rowScale = rowScales[i];
+        if(accumulate) for(size_t j = 0; j < cols; ++j) r[j] += (T) (block[i * NR + j] * rowScale * colScales[j]);
+        else for(size_t j = 0; j < cols; ++j) r[j] = (T) (block[i * NR + j] * rowScale * colScales[j]);
+    }
+}
@@ -0,0 +1,155 @@
+/**
+ * @file tensorthreadpool.cc
+ * @brief Implements the work-stealing thread pool that independent nodes of a graph are evaluated on.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "tensorthreadpool.h"
+
+#ifdef OMP
+    #include <omp.h>
+#endif
+
+namespace{
+    // Index of the worker running on this thread, or -1 off the pool
+    thread_local int workerIndex = -1;
+
+    struct Worker{
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    class ThreadPool{
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<std::thread> threads;
+
+        // Counts tasks that are queued or about to be, so a worker only sleeps when there are none
+        std::mutex sleepLock;
+        std::condition_variable wake;
+        size_t queued = 0;
+        bool stopping = false;
+        size_t nextWorker = 0;
+
+        bool take(size_t index, std::function<void()>& task){
+            for(size_t i = 0; i < workers.size(); ++i){
+                Worker& w = *workers[(index + i) % workers.size()];
+                std::lock_guard<std::mutex> guard(w.lock);
+                if(w.tasks.empty()) continue;
+                // The owner takes its newest task and thieves the oldest
+                if(i == 0){
+                    task = std::move(w.tasks.back());
+                    w.tasks.pop_back();
+                }
+                else{
+                    task = std::move(w.tasks.front());
+                    w.tasks.pop_front();
+                }
+                return true;
+            }
+            return false;
+        }
+
+        void run(size_t index){
+            workerIndex = (int) index;
+            #ifdef OMP
+                omp_set_num_threads(1);
+            #endif
+            while(true){
+                std::function<void()> task;
+                if(take(index, task)){
+                    {
+                        std::lock_guard<std::mutex> guard(sleepLock);
+                        --queued;
+                    }
+                    task();
+                    continue;
+                }
+                std::unique_lock<std::mutex> guard(sleepLock);
+                wake.wait(guard, [this]{return queued > 0 || stopping;});
+                if(stopping && queued == 0) return;
+            }
+        }
+
+        void stop(){
+            {
+                std::lock_guard<std::mutex> guard(sleepLock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for(auto& t : threads) t.join();
+            threads.clear();
+            workers.clear();
+            stopping = false;
+        }
+
+        void start(size_t numWorkers){
+            for(size_t i = 0; i < numWorkers; ++i) workers.push_back(std::unique_ptr<Worker>(new Worker()));
+            for(size_t i = 0; i < numWorkers; ++i) threads.push_back(std::thread(&ThreadPool::run, this, i));
+        }
+
+        public:
+            ThreadPool(){
+                size_t cores = std::thread::hardware_concurrency();
+                start(cores > 1 ? cores - 1 : 0);
+            }
+
+            void submit(std::function<void()> task){
+                if(workers.empty()){
+                    task();
+                    return;
+                }
+                size_t index;
+                {
+                    std::lock_guard<std::mutex> guard(sleepLock);
+                    ++queued;
+                    index = workerIndex >= 0 ? (size_t) workerIndex : nextWorker++ % workers.size();
+                }
+                {
+                    std::lock_guard<std::mutex> guard(workers[index]->lock);
+                    workers[index]->tasks.push_back(std::move(task));
+                }
+                wake.notify_one();
+            }
+
+            size_t getNumWorkers(){
+                return workers.size();
+            }
+
+            void setNumWorkers(size_t numWorkers){
+                if(workerIndex >= 0) throw std::runtime_error("The thread pool cannot be resized from one of its workers");
+                stop();
+                start(numWorkers);
+            }
+    };
+
+    // Never destroyed, so workers are not joined while static tensors are still being freed
+    ThreadPool& pool(){
+        static ThreadPool * threadPool = new ThreadPool();
+        return *threadPool;
+    }
+}
+
+namespace TensorThreadPool{
+    void submit(std::function<void()> task){
+        pool().submit(std::move(task));
+    }
+
+    size_t getNumWorkers(){
+        return pool().getNumWorkers();
+    }
+
+    void setNumWorkers(size_t numWorkers){
+        pool().setNumWorkers(numWorkers);
+    }
+}
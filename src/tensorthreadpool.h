@@ -0,0 +1,33 @@
+/**
+ * @file tensorthreadpool.h
+ * @brief Defines the work-stealing thread pool that independent nodes of a graph are evaluated on.
+ *
+ * @author Zoe Lurie
+ * @date November 2024
+ */
+
+#ifndef TENSORTHREADPOOLH
+#define TENSORTHREADPOOLH
+
+#include <cstddef>
+#include <functional>
+
+/**
+ * Each worker owns a deque of tasks. A worker runs its own newest task first, which keeps the
+ * data a task just produced in its cache for the tasks that read it, and when its deque is empty
+ * it steals the oldest task of another worker. Tasks submitted by a worker go to its own deque
+ * and tasks submitted from other threads are spread over the deques in turn.
+ *
+ * Workers run with a single OpenMP thread, so small nodes evaluated side by side do not each
+ * start a full team. Large nodes are left to the calling thread, which splits them over OpenMP.
+ */
+namespace TensorThreadPool{
+    void submit(std::function<void()> task);
+
+    size_t getNumWorkers();
+
+    // Waits for queued tasks to finish and replaces the workers, zero leaves every task to the caller
+    void setNumWorkers(size_t numWorkers);
+}
+
+#endif
@@ -1,13 +1,130 @@
+#include <algorithm>
 #include <vector>
 #include <iostream>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
 
+#include "checkpoint.h"
+#include "dataloader.h"
 #include "tensor.h"
+#include "tensorcpufunctions.h"
 
 #define OP(x, y) (x - y).pow(3).reduceSum();
 
+static double largestDifference(std::vector<double> a, std::vector<double> b){
+    double ret = 0;
+    for(size_t i = 0; i < a.size(); ++i) ret = std::max(ret, std::fabs(a[i] - b[i]));
+    return ret;
+}
+
+#ifdef OMP
+    // Values of fillRandom and dropout with a fixed seed, evaluated with the given number of OpenMP threads
+    static std::vector<double> randomValues(int numThreads){
+        Tensor::setOmpNumThreads(numThreads);
+        Tensor::setSeed(11);
+        auto noise = Tensor::fillRandom({300, 301}, 0, 1);
+        auto dropped = Tensor::ones({300, 301}).dropout(0.3);
+        std::vector<double> ret = noise.getData(), kept = dropped.getData();
+        ret.insert(ret.end(), kept.begin(), kept.end());
+        return ret;
+    }
+#endif
+
+// Largest difference between tensors of each dtype and a view, and the same tensors saved with
+// save and saveAsync and loaded again, or infinity if a dtype or shape was not kept
+static double checkpointError(){
+    std::vector<Tensor> tensors = {Tensor::fillRandom({4, 6}, 0, 1, false, CPU, FLOAT32), Tensor::fillRandom({4, 6}, 0, 1),
+        Tensor::fillRandom({5, 8}, 0, 1).quantize(), Tensor::fillRandom({3, 7}, 0, 1).transpose()};
+    Checkpoint::save("test1_checkpoint.bin", tensors);
+    Checkpoint::saveAsync("test1_checkpoint_async.bin", tensors);
+    Checkpoint::waitForSaves();
+
+    double maxError = 0;
+    for(std::string path : {"test1_checkpoint.bin", "test1_checkpoint_async.bin"}){
+        {
+            auto loaded = Checkpoint::load(path);
+            if(loaded.size() != tensors.size()) maxError = std::numeric_limits<double>::infinity();
+            for(size_t i = 0; i < loaded.size() && i < tensors.size(); ++i){
+                if(loaded[i].getDtype() != tensors[i].getDtype() || loaded[i].getDims() != tensors[i].getDims())
+                    maxError = std::numeric_limits<double>::infinity();
+                else maxError = std::max(maxError, largestDifference(loaded[i].getData(), tensors[i].getData()));
+            }
+        }
+        std::remove(path.c_str());
+    }
+    return maxError;
+}
+
+// Epochs of a DataLoader that fully shuffles ten samples in batches of four that do not hold each
+// sample once, or whose batches are not two of four and, unless dropLast, a last one of two
+static size_t badEpochs(bool dropLast){
+    const size_t N = 10;
+    std::vector<double> values(N);
+    std::vector<int> labels(N);
+    for(size_t i = 0; i < N; ++i) values[i] = labels[i] = i;
+    auto loader = DataLoader::fromDataset(Dataset(Tensor({N, 1}, values), labels), 4, N, dropLast);
+
+    size_t bad = 0;
+    for(int epoch = 0; epoch < 3; ++epoch){
+        std::vector<double> seen;
+        std::vector<size_t> batchSizes;
+        for(auto batch = loader.next(); !batch.empty(); batch = loader.next()){
+            std::vector<double> features = batch[0].getData(), batchLabels = batch[1].getData();
+            if(features != batchLabels) ++bad;
+            batchSizes.push_back(batchLabels.size());
+            seen.insert(seen.end(), batchLabels.begin(), batchLabels.end());
+        }
+        std::sort(seen.begin(), seen.end());
+        bool repeated = std::adjacent_find(seen.begin(), seen.end()) != seen.end();
+        if(dropLast ? batchSizes != std::vector<size_t>{4, 4} || repeated
+                : batchSizes != std::vector<size_t>{4, 4, 2} || seen != values) ++bad;
+    }
+    return bad;
+}
+
+// Largest difference between cpuGemm and a naive product over odd shapes, transposed operands and
+// accumulation into the output, at every SIMD level the CPU supports
+static double gemmError(){
+    std::vector<std::vector<size_t>> shapes = {{1, 1, 1}, {3, 5, 7}, {17, 33, 19}, {65, 130, 300}, {5, 2100, 3}};
+    simdLevel selected = cpuGetSimdLevel();
+    double maxError = 0;
+    for(int level = SIMDNONE; level <= SIMDAVX512; ++level){
+        cpuSetSimdLevel((simdLevel) level);
+        for(auto& shape : shapes){
+            size_t m = shape[0], n = shape[1], k = shape[2];
+            std::vector<double> a(m * k), b(k * n);
+            for(size_t i = 0; i < a.size(); ++i) a[i] = std::sin(i + 1.0);
+            for(size_t i = 0; i < b.size(); ++i) b[i] = std::cos(i + 1.0);
+
+            for(int transposeA = 0; transposeA < 2; ++transposeA){
+                for(int transposeB = 0; transposeB < 2; ++transposeB){
+                    for(int accumulate = 0; accumulate < 2; ++accumulate){
+                        // a is read as m x k and b as k x n, from row-major buffers of either orientation
+                        size_t aRow = transposeA ? 1 : k, aCol = transposeA ? m : 1;
+                        size_t bRow = transposeB ? 1 : n, bCol = transposeB ? k : 1;
+                        std::vector<double> ret(m * n, 0.5), expected(m * n, accumulate ? 0.5 : 0);
+                        for(size_t i = 0; i < m; ++i)
+                            for(size_t j = 0; j < n; ++j)
+                                for(size_t p = 0; p < k; ++p) expected[i * n + j] += a[i * aRow + p * aCol] * b[p * bRow + j * bCol];
+
+                        cpuGemm(ret.data(), a.data(), b.data(), m, n, k, aRow, aCol, bRow, bCol, accumulate);
+                        for(size_t i = 0; i < ret.size(); ++i) maxError = std::max(maxError, std::fabs(ret[i] - expected[i]));
+                    }
+                }
+            }
+        }
+    }
+    cpuSetSimdLevel(selected);
+    return maxError;
+}
+
 int main(){
 
-    Tensor::setOmpNumThreads(8);
+    #ifdef OMP
+        Tensor::setOmpNumThreads(8);
+    #endif
 
     std::cout << "CPU output:\n";
 
@@ -25,6 +142,38 @@ int main(){
     std::cout << "\n";
     cy.getGradient().print();
 
+    // Reducing axes that are not next to each other with keepDims keeps the other axes in place
+    auto r = Tensor::fillRandom({2,3,4}, 0, 1);
+    auto rmax = r.max({0,2}, true);
+    std::cout << "\nShape of max over axes 0 and 2 with keepDims (expected 1 3 1):";
+    for(auto d : rmax.getDims()) std::cout << " " << d;
+    std::cout << "\n";
+    (r - rmax).sum({0,2}, true).print();
+
+    // x feeds both branches of the sum and both factors of each product, so its gradient is summed from every use
+    auto dx = Tensor({3}, {-1, 0.5, 2}, true, CPU);
+    auto dy = (dx * dx + dx * dx * dx).reduceSum();
+    dy.backward();
+    std::cout << "\nLargest error of the gradient of sum(x*x + x*x*x) against 2x + 3x^2 (expected 0): "
+        << largestDifference(dx.getGradient().getData(), {1, 1.75, 16}) << "\n";
+    dy.backward();
+    std::cout << "Largest error after a second backward, which adds to the gradient (expected 0): "
+        << largestDifference(dx.getGradient().getData(), {2, 3.5, 32}) << "\n";
+
+    #ifdef OMP
+        std::cout << "\nLargest difference between random values made with 1 and 4 OpenMP threads (expected 0): "
+            << largestDifference(randomValues(1), randomValues(4)) << "\n";
+        Tensor::setOmpNumThreads(8);
+    #endif
+
+    std::cout << "\nLargest difference after saving and loading float32, float64, INT8 and transposed tensors (expected 0): "
+        << checkpointError() << "\n";
+
+    std::cout << "\nDataLoader epochs that were not a full shuffle with a last batch of two (expected 0): " << badEpochs(false) << "\n";
+    std::cout << "DataLoader epochs with dropLast that were not two full batches of distinct samples (expected 0): " << badEpochs(true) << "\n";
+
+    std::cout << "\nLargest cpuGemm error against a naive product at every SIMD level (expected below 1e-9): " << gemmError() << "\n";
+
 /*
     std::cout << "GPU output:\n";
 